@@ -0,0 +1,139 @@
+#include "Airtime.h"
+
+#define PREAMBLE_SYMBOLS 8
+#define CODING_RATE 1 // 4/5
+
+uint32_t airtimeUs(uint8_t sf, uint32_t bwHz, uint8_t payloadLen) {
+  uint32_t symbolUs = ((uint32_t)1000000 << sf) / bwHz;
+  int de = (sf>=11 && bwHz==125000) ? 1 : 0;
+
+  // Payload symbols: 8 + max(ceil((8PL - 4SF + 28 + 16) / (4(SF - 2DE))) * (CR + 4), 0)
+  int32_t pl = payloadLen + LORAWAN_OVERHEAD;
+  int32_t numerator = 8*pl - 4*sf + 28 + 16;
+  int32_t denominator = 4*(sf - 2*de);
+  int32_t blocks = numerator>0 ? (numerator + denominator - 1) / denominator : 0;
+  uint32_t payloadSymbols = 8 + blocks * (CODING_RATE + 4);
+
+  // Preamble is PREAMBLE_SYMBOLS + 4.25 symbols
+  return (PREAMBLE_SYMBOLS*4 + 17) * symbolUs / 4 + payloadSymbols * symbolUs;
+}
+
+#define HOUR_MS 3600000UL
+#define BUCKETS 24
+
+typedef struct {
+  uint16_t permille;
+  uint32_t availMs;   // millis() at which the band frees up
+  bool pending;
+} DutyBand;
+
+static DutyBand bands[AIRTIME_BANDS];
+static uint8_t bandsInUse = (1 << AIRTIME_BANDS) - 1;
+
+static uint32_t usedMs[BUCKETS];   // Airtime per hour of the last day
+static uint32_t currentHour = 0;
+
+void airtimeSetDutyCycle(uint8_t band, uint16_t permille) {
+  if (band<AIRTIME_BANDS) {
+    bands[band].permille = permille;
+  }
+}
+
+void airtimeSetBandsInUse(uint8_t inUse) {
+  bandsInUse = inUse;
+}
+
+// Duty cycle LMIC can spread frames over, summed over the bands in use. 0 if one of them has none.
+static uint16_t dutyPermilleInUse() {
+  uint16_t sum = 0;
+  for (uint8_t b=0; b<AIRTIME_BANDS; ++b) {
+    if (bandsInUse & (1 << b)) {
+      if (bands[b].permille==0) {
+        return 0;
+      }
+      sum += bands[b].permille;
+    }
+  }
+  return sum;
+}
+
+// Wait until the band frees up
+static uint32_t bandWaitMs(uint8_t band, uint32_t nowMs) {
+  DutyBand *b = &bands[band];
+  if (b->pending) {
+    int32_t wait = (int32_t)(b->availMs - nowMs);
+    if (wait>0) {
+      return wait;
+    }
+    b->pending = false;
+  }
+  return 0;
+}
+
+// Clears buckets for hours that have passed since the last call
+static void advanceHours(uint32_t nowMs) {
+  uint32_t hour = nowMs / HOUR_MS;
+  uint32_t passed = hour - currentHour; // Wrap of millis() clears everything
+  if (passed>BUCKETS) {
+    passed = BUCKETS;
+  }
+  while (passed--) {
+    usedMs[++currentHour % BUCKETS] = 0;
+  }
+  currentHour = hour;
+}
+
+void airtimeRecordTx(uint32_t startMs, uint32_t airtimeMs, uint8_t band) {
+  advanceHours(startMs);
+  usedMs[currentHour % BUCKETS] += airtimeMs;
+
+  if (band<AIRTIME_BANDS && bands[band].permille) {
+    DutyBand *b = &bands[band];
+    b->availMs = startMs + airtimeMs + airtimeMs * (1000 / b->permille - 1);
+    b->pending = true;
+  }
+}
+
+void airtimeRestoreUsed(uint32_t nowMs, uint32_t earlierMs) {
+  advanceHours(nowMs);
+  usedMs[currentHour % BUCKETS] += earlierMs;
+}
+
+uint32_t airtimeBudgetRemainingMs(uint32_t nowMs) {
+  advanceHours(nowMs);
+  uint32_t used = 0;
+  for (int i=0; i<BUCKETS; ++i) {
+    used += usedMs[i];
+  }
+  return used<AIRTIME_DAILY_BUDGET_MS ? AIRTIME_DAILY_BUDGET_MS - used : 0;
+}
+
+bool airtimeSustainable(uint32_t nowMs, uint32_t airtimeMs, uint32_t intervalMs) {
+  uint16_t dutyPermille = dutyPermilleInUse();
+  if (dutyPermille && (uint64_t)airtimeMs * 1000 > (uint64_t)intervalMs * dutyPermille) {
+    return false;
+  }
+  uint64_t perDayMs = (uint64_t)airtimeMs * BUCKETS * HOUR_MS / intervalMs;
+  return perDayMs <= airtimeBudgetRemainingMs(nowMs);
+}
+
+uint32_t airtimeUntilNextTxMs(uint32_t nowMs) {
+  // The band in use that frees up first
+  uint32_t wait = 0;
+  bool any = false;
+  for (uint8_t b=0; b<AIRTIME_BANDS; ++b) {
+    uint32_t bandWait = bandWaitMs(b, nowMs);
+    if ((bandsInUse & (1 << b)) && (!any || bandWait<wait)) {
+      wait = bandWait;
+      any = true;
+    }
+  }
+  if (airtimeBudgetRemainingMs(nowMs)==0) {
+    // Budget returns when the oldest hour drops out of the window
+    uint32_t untilNextHour = HOUR_MS - nowMs % HOUR_MS;
+    if (untilNextHour>wait) {
+      wait = untilNextHour;
+    }
+  }
+  return wait;
+}
@@ -0,0 +1,38 @@
+#include <stdint.h>
+
+// LoRaWAN header, port and MIC added to every application payload
+#define LORAWAN_OVERHEAD 13
+
+/* Time on air of a LoRa frame carrying payloadLen application bytes.
+  Explicit header, CRC on, coding rate 4/5, 8 symbol preamble.
+  Low data rate optimization is on for SF11 and SF12 at 125 kHz.
+  See Semtech AN1200.13.
+*/
+uint32_t airtimeUs(uint8_t sf, uint32_t bwHz, uint8_t payloadLen);
+
+/* Airtime accounting.
+  Two limits are tracked:
+  - Duty cycle, per sub-band: after a frame with airtime A, its band is off limits
+    for A * (1000/permille - 1). Bands are numbered as LMIC's (in EU868 g/g1 are
+    BAND_CENTI, g2 BAND_MILLI, g3 BAND_DECI). A frame may go once one of the bands
+    in use is free, as LMIC then picks a channel in that band. 0 permille means no
+    regulatory duty cycle (US915).
+  - Daily budget: total uplink airtime in a rolling 24 hour window, kept in hourly
+    buckets. Defaults to the TTN fair access policy.
+  All times are millis() values.
+*/
+#define AIRTIME_DAILY_BUDGET_MS 30000
+
+#define AIRTIME_BANDS 4
+
+void airtimeSetDutyCycle(uint8_t band, uint16_t permille);
+// Bit per band with a channel the next uplink may go on. All bands until set.
+void airtimeSetBandsInUse(uint8_t bands);
+void airtimeRecordTx(uint32_t startMs, uint32_t airtimeMs, uint8_t band);
+uint32_t airtimeUntilNextTxMs(uint32_t nowMs); // 0 if a frame may go now
+uint32_t airtimeBudgetRemainingMs(uint32_t nowMs);
+// True if frames of airtimeMs every intervalMs fit the duty cycle of the bands in use, and
+// keeping that up for a day fits the budget that remains
+bool airtimeSustainable(uint32_t nowMs, uint32_t airtimeMs, uint32_t intervalMs);
+// Counts airtime spent before a reboot against the current hour
+void airtimeRestoreUsed(uint32_t nowMs, uint32_t earlierMs);
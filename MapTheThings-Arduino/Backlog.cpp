@@ -0,0 +1,278 @@
+#include <string.h>
+#include "Backlog.h"
+#include "Flash.h"
+
+/* Row:    [magic][24bit sequence] records...
+   Record: [state][len][CRC-8][~len] [32bit millis()] [16bit boot id][data], padded to 4 bytes.
+   The CRC covers everything after the first word.
+*/
+#define ROW_MAGIC 0x5A
+#define ROW_HEADER_SIZE 4
+#define RECORD_HEADER_SIZE 8 // State word and millis()
+
+#define STATE_FREE      0xFF
+#define STATE_ALLOCATED 0xFE
+#define STATE_VALID     0xFC
+#define STATE_SENT      0xF8
+
+typedef struct {
+  uint8_t state;
+  uint8_t len;
+  uint8_t crc;
+  uint8_t lenCheck; // ~len
+} RecordHeader;
+
+typedef struct {
+  uint8_t row;
+  uint16_t offset; // Within the row
+} Cursor;
+
+static bool ready = false;
+static uint16_t bootId = 0;
+static uint8_t headRow = 0;      // Row being appended to
+static uint16_t headOffset = 0;  // Next free offset in headRow. FLASH_ROW_SIZE once full.
+static uint32_t headSeq = 0;
+static uint8_t tailRow = 0;      // Oldest row that may hold unsent records
+static uint16_t pending = 0;
+static uint32_t dropped = 0;
+
+static uint8_t crc8(const uint8_t *data, uint16_t len) {
+  uint8_t crc = 0;
+  for (uint16_t i=0; i<len; ++i) {
+    crc ^= data[i];
+    for (uint8_t bit=0; bit<8; ++bit) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+static uint16_t recordSize(uint8_t len) {
+  return RECORD_HEADER_SIZE + ((2 + len + 3) & ~3);
+}
+
+static uint32_t address(uint8_t row, uint16_t offset) {
+  return (uint32_t)row * FLASH_ROW_SIZE + offset;
+}
+
+// Sequence number of the row, 0 if it holds no log row
+static uint32_t rowSeq(uint8_t row) {
+  uint8_t header[ROW_HEADER_SIZE];
+  flashRead(address(row, 0), header, sizeof(header));
+  if (header[0]!=ROW_MAGIC) {
+    return 0;
+  }
+  uint32_t seq = header[1] | ((uint32_t)header[2] << 8) | ((uint32_t)header[3] << 16);
+  return seq==0xFFFFFF ? 0 : seq;
+}
+
+// Reads the header at offset. False at the end of the row's records, including a damaged header.
+static bool readHeader(uint8_t row, uint16_t offset, RecordHeader *h) {
+  if (offset + RECORD_HEADER_SIZE > FLASH_ROW_SIZE) {
+    return false;
+  }
+  flashRead(address(row, offset), h, sizeof(*h));
+  if (h->state==STATE_FREE || (uint8_t)~h->len!=h->lenCheck) {
+    return false;
+  }
+  return offset + recordSize(h->len) <= FLASH_ROW_SIZE;
+}
+
+static bool setState(uint8_t row, uint16_t offset, RecordHeader *h, uint8_t state) {
+  h->state = state;
+  return flashWrite(address(row, offset), h, sizeof(*h));
+}
+
+// Moves c to the next valid record at or after it. False at the end of the log.
+static bool findValid(Cursor *c, RecordHeader *h) {
+  while (true) {
+    if (readHeader(c->row, c->offset, h)) {
+      if (h->state==STATE_VALID) {
+        return true;
+      }
+      c->offset += recordSize(h->len);
+    }
+    else {
+      if (c->row==headRow) {
+        return false;
+      }
+      c->row = (c->row + 1) % FLASH_ROWS;
+      c->offset = ROW_HEADER_SIZE;
+    }
+  }
+}
+
+static uint16_t rowPending(uint8_t row) {
+  uint16_t count = 0;
+  RecordHeader h;
+  uint16_t offset = ROW_HEADER_SIZE;
+  while (readHeader(row, offset, &h)) {
+    if (h.state==STATE_VALID) {
+      ++count;
+    }
+    offset += recordSize(h.len);
+  }
+  return count;
+}
+
+static void advanceTail() {
+  while (tailRow!=headRow && rowPending(tailRow)==0) {
+    tailRow = (tailRow + 1) % FLASH_ROWS;
+  }
+}
+
+static bool startRow(uint8_t row, uint32_t seq) {
+  uint8_t header[ROW_HEADER_SIZE] = { ROW_MAGIC, (uint8_t)seq, (uint8_t)(seq >> 8), (uint8_t)(seq >> 16) };
+  if (!flashEraseRow(address(row, 0)) || !flashWrite(address(row, 0), header, sizeof(header))) {
+    return false;
+  }
+  headRow = row;
+  headSeq = seq;
+  headOffset = ROW_HEADER_SIZE;
+  return true;
+}
+
+bool backlogInit(uint16_t boot) {
+  bootId = boot;
+  ready = false;
+  if (!flashInit()) {
+    return false;
+  }
+
+  // The newest row, then back over rows with consecutive sequence numbers to the oldest
+  headSeq = 0;
+  for (uint8_t row=0; row<FLASH_ROWS; ++row) {
+    uint32_t seq = rowSeq(row);
+    if (seq>headSeq) {
+      headSeq = seq;
+      headRow = row;
+    }
+  }
+  if (headSeq==0) {
+    if (!startRow(0, 1)) {
+      return false;
+    }
+    tailRow = 0;
+  }
+  else {
+    tailRow = headRow;
+    for (uint8_t n=1; n<FLASH_ROWS; ++n) {
+      uint8_t row = (headRow + FLASH_ROWS - n) % FLASH_ROWS;
+      if (rowSeq(row)!=headSeq - n) {
+        break;
+      }
+      tailRow = row;
+    }
+    // Appends continue after the last readable record. A damaged header closes the row.
+    RecordHeader h;
+    headOffset = ROW_HEADER_SIZE;
+    while (readHeader(headRow, headOffset, &h)) {
+      headOffset += recordSize(h.len);
+    }
+    if (headOffset + RECORD_HEADER_SIZE <= FLASH_ROW_SIZE) {
+      flashRead(address(headRow, headOffset), &h, sizeof(h));
+      if (h.state!=STATE_FREE) {
+        headOffset = FLASH_ROW_SIZE;
+      }
+    }
+  }
+
+  pending = 0;
+  for (uint8_t row=tailRow; ; row=(row + 1) % FLASH_ROWS) {
+    pending += rowPending(row);
+    if (row==headRow) {
+      break;
+    }
+  }
+  advanceTail();
+  ready = true;
+  return true;
+}
+
+bool backlogAppend(const uint8_t data[], uint8_t len, uint32_t nowMs) {
+  if (!ready || len>BACKLOG_MAX_SAMPLE) {
+    return false;
+  }
+  uint16_t size = recordSize(len);
+  if (headOffset + size > FLASH_ROW_SIZE) {
+    uint8_t next = (headRow + 1) % FLASH_ROWS;
+    if (next==tailRow) {
+      // Ring full: the oldest row goes
+      uint16_t lost = rowPending(tailRow);
+      pending -= lost;
+      dropped += lost;
+      tailRow = (tailRow + 1) % FLASH_ROWS;
+    }
+    if (!startRow(next, headSeq + 1)) {
+      return false;
+    }
+    advanceTail();
+  }
+
+  uint8_t record[RECORD_HEADER_SIZE + 2 + BACKLOG_MAX_SAMPLE + 3];
+  memset(record, 0xFF, sizeof(record));
+  memcpy(&record[4], &nowMs, sizeof(nowMs));
+  memcpy(&record[8], &bootId, sizeof(bootId));
+  memcpy(&record[10], data, len);
+  RecordHeader h = { STATE_ALLOCATED, len, crc8(&record[4], 4 + 2 + len), (uint8_t)~len };
+
+  // Header first, so that a reset mid-append leaves a record that scanning can step over
+  uint16_t offset = headOffset;
+  headOffset += size;
+  if (!flashWrite(address(headRow, offset), &h, sizeof(h))
+    || !flashWrite(address(headRow, offset + 4), &record[4], size - 4)
+    || !setState(headRow, offset, &h, STATE_VALID)) {
+    return false;
+  }
+  ++pending;
+  return true;
+}
+
+uint16_t backlogCount() {
+  return pending;
+}
+
+bool backlogPeekAt(uint16_t pos, BacklogRecord *record) {
+  if (!ready || pos>=pending) {
+    return false;
+  }
+  Cursor c = { tailRow, ROW_HEADER_SIZE };
+  RecordHeader h;
+  while (findValid(&c, &h)) {
+    if (pos==0) {
+      uint8_t body[4 + 2 + BACKLOG_MAX_SAMPLE];
+      flashRead(address(c.row, c.offset + 4), body, 4 + 2 + h.len);
+      if (crc8(body, 4 + 2 + h.len)!=h.crc) {
+        // Damaged since it was written. Give it up and look again.
+        setState(c.row, c.offset, &h, STATE_SENT);
+        --pending;
+        ++dropped;
+        return backlogPeekAt(pos, record);
+      }
+      memcpy(&record->timeMs, &body[0], sizeof(record->timeMs));
+      memcpy(&record->bootId, &body[4], sizeof(record->bootId));
+      record->len = h.len;
+      memcpy(record->data, &body[6], h.len);
+      return true;
+    }
+    --pos;
+    c.offset += recordSize(h.len);
+  }
+  return false;
+}
+
+void backlogMarkSent(uint16_t count) {
+  Cursor c = { tailRow, ROW_HEADER_SIZE };
+  RecordHeader h;
+  while (count>0 && findValid(&c, &h)) {
+    setState(c.row, c.offset, &h, STATE_SENT);
+    --pending;
+    --count;
+    c.offset += recordSize(h.len);
+  }
+  advanceTail();
+}
+
+uint32_t backlogDropped() {
+  return dropped;
+}
@@ -0,0 +1,31 @@
+#include <stdint.h>
+
+/*
+ Store-and-forward backlog of samples that could not be queued for the radio.
+
+ A log in the spare flash of Flash.h, written as a ring of rows. Each row
+ starts with a header holding a sequence number, so the newest row is found
+ at boot. Appends fill the newest row and then erase and start the next one,
+ so every row is erased in turn (wear leveling). When the ring is full, the
+ oldest row is given up, unsent records and all.
+
+ A record goes through states by clearing bits of its header, never by
+ erasing: allocated (length known), valid (body written and checked by
+ CRC), sent. A reset mid-append leaves an allocated record that scanning
+ skips, and a damaged header ends its row.
+*/
+#define BACKLOG_MAX_SAMPLE 64
+
+typedef struct {
+  uint16_t bootId;  // Boot in which the sample was stored
+  uint32_t timeMs;  // millis() when stored, in that boot
+  uint8_t len;
+  uint8_t data[BACKLOG_MAX_SAMPLE];
+} BacklogRecord;
+
+bool backlogInit(uint16_t bootId); // Scans flash for the log. False if flash is unusable.
+bool backlogAppend(const uint8_t data[], uint8_t len, uint32_t nowMs);
+uint16_t backlogCount(void); // Unsent records
+bool backlogPeekAt(uint16_t pos, BacklogRecord *record); // pos-th unsent record, oldest first
+void backlogMarkSent(uint16_t count); // The count oldest unsent records
+uint32_t backlogDropped(void); // Unsent records lost to a full ring or damage
@@ -0,0 +1,111 @@
+#include <Arduino.h>
+#include "Battery.h"
+#include "TokenLog.h"
+
+#define VBATPIN A7
+#define FILTER_SHIFT 4
+#define MIN_MV 3200
+#define MAX_MV 4200
+
+static bool started = false;
+static uint32_t lastSampleMs = 0;
+static uint32_t filteredMv = 0;    // Millivolts << FILTER_SHIFT
+static uint8_t reportedLevel = 0;
+
+static uint32_t trendSnapshotMs = 0;
+static uint16_t trendSnapshotMv = 0;
+static int16_t trendMvPerHour = 0;
+
+static uint8_t dischargeStartLevel = 0;
+static uint32_t pingsSinceStart = 0;
+
+static uint16_t readMillivolts() {
+  // Divided by 2 on the board, 3.3V reference, 10 bit ADC
+  return (uint32_t)analogRead(VBATPIN) * 2 * 3300 / 1024;
+}
+
+static uint8_t levelFor(uint16_t mv) {
+  if (mv<=MIN_MV) {
+    return 0;
+  }
+  if (mv>=MAX_MV) {
+    return 100;
+  }
+  return (uint32_t)(mv - MIN_MV) * 100 / (MAX_MV - MIN_MV);
+}
+
+bool batterySample(uint32_t nowMs) {
+  if (started && nowMs - lastSampleMs < BATTERY_SAMPLE_INTERVAL_MS) {
+    return false;
+  }
+  lastSampleMs = nowMs;
+  uint16_t mv = readMillivolts();
+
+  if (!started) {
+    started = true;
+    filteredMv = (uint32_t)mv << FILTER_SHIFT;
+    reportedLevel = dischargeStartLevel = levelFor(mv);
+    trendSnapshotMs = nowMs;
+    trendSnapshotMv = mv;
+    return true;
+  }
+
+  filteredMv += mv - (int32_t)(filteredMv >> FILTER_SHIFT);
+  mv = batteryMillivolts();
+  bool changed = false;
+
+  uint8_t level = levelFor(mv);
+  uint8_t moved = level>reportedLevel ? level - reportedLevel : reportedLevel - level;
+  if (moved>=BATTERY_HYSTERESIS_PERCENT) {
+    TLOG_DEBUG("Battery %d mV, level %d" CR, mv, level);
+    reportedLevel = level;
+    if (level>dischargeStartLevel) {
+      // Charged. Earlier drain says nothing about the new charge.
+      dischargeStartLevel = level;
+      pingsSinceStart = 0;
+    }
+    changed = true;
+  }
+
+  if (nowMs - trendSnapshotMs >= BATTERY_TREND_INTERVAL_MS) {
+    trendMvPerHour = ((int32_t)mv - trendSnapshotMv) * (int32_t)(3600000UL / BATTERY_TREND_INTERVAL_MS);
+    trendSnapshotMs = nowMs;
+    trendSnapshotMv = mv;
+    changed = true;
+  }
+  return changed;
+}
+
+uint32_t batteryIdleMs(uint32_t nowMs) {
+  uint32_t since = nowMs - lastSampleMs;
+  return (started && since<BATTERY_SAMPLE_INTERVAL_MS) ? BATTERY_SAMPLE_INTERVAL_MS - since : 0;
+}
+
+void batteryRecordPing() {
+  ++pingsSinceStart;
+}
+
+uint8_t batteryLevel() {
+  return reportedLevel;
+}
+
+uint16_t batteryMillivolts() {
+  return filteredMv >> FILTER_SHIFT;
+}
+
+int16_t batteryTrendMvPerHour() {
+  return trendMvPerHour;
+}
+
+uint16_t batteryRemainingPings() {
+  uint8_t drop = dischargeStartLevel - reportedLevel;
+  if (drop<BATTERY_HYSTERESIS_PERCENT || pingsSinceStart==0) {
+    return BATTERY_PINGS_UNKNOWN;
+  }
+  uint32_t remaining = pingsSinceStart * reportedLevel / drop;
+  return remaining<BATTERY_PINGS_UNKNOWN ? remaining : BATTERY_PINGS_UNKNOWN - 1;
+}
+
+bool batteryLow() {
+  return started && reportedLevel<BATTERY_LOW_PERCENT;
+}
@@ -0,0 +1,29 @@
+#include <stdint.h>
+
+/*
+ Battery estimator. One ADC reading per BATTERY_SAMPLE_INTERVAL_MS goes into a
+ fixed-point low-pass filter (1/16 weight per sample), so spikes while the radio
+ transmits are smoothed out. The reported level only moves when the filtered
+ level is BATTERY_HYSTERESIS_PERCENT away from it, so noise does not trigger
+ notifications.
+
+ Remaining pings are extrapolated from the level drop seen per uplink since the
+ last charge. Unknown (BATTERY_PINGS_UNKNOWN) until the level has dropped
+ BATTERY_HYSTERESIS_PERCENT.
+*/
+#define BATTERY_SAMPLE_INTERVAL_MS 1000
+#define BATTERY_HYSTERESIS_PERCENT 2
+#define BATTERY_TREND_INTERVAL_MS 600000UL // 10 minutes
+#define BATTERY_LOW_PERCENT 15
+#define BATTERY_PINGS_UNKNOWN 0xFFFF
+
+// Takes a sample if one is due. Returns true when the reported values changed.
+bool batterySample(uint32_t nowMs);
+uint32_t batteryIdleMs(uint32_t nowMs); // Until the next sample is due
+void batteryRecordPing();
+
+uint8_t batteryLevel();           // 0-100
+uint16_t batteryMillivolts();
+int16_t batteryTrendMvPerHour();
+uint16_t batteryRemainingPings();
+bool batteryLow();
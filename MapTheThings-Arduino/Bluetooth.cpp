@@ -48,7 +48,11 @@
 #include "BluefruitConfig.h"
 
 #include "Bluetooth.h"
+#include "Idle.h"
+#include "Diag.h"
+#include "Latency.h"
 #include "Logging.h"
+#include "TokenLog.h"
 
 // Create the bluefruit object, either software serial...uncomment these lines
 /*
@@ -78,35 +82,72 @@ Adafruit_BLEGatt gatt(ble);
 static CharacteristicConfigType *charConfigs;
 static int32_t charConfigsCount;
 
+static bool queueUpdate(int32_t charId, uint8_t const data[], uint8_t len, BlePriority priority, bool coalesce);
+
 void setBluetoothCharData(uint8_t charID, uint8_t const data[], uint8_t size) {
-  Log.Debug("setBluetoothCharData (charID=%d)" CR, charID);
-  gatt.setChar(charID, data, size);
+  TLOG_DEBUG("setBluetoothCharData (charID=%d)" CR, charID);
+  queueUpdate(charID, data, size, BlePriorityNormal, true);
+}
+
+void sendBluetoothCharEvent(uint8_t charID, uint8_t const data[], uint8_t size) {
+  queueUpdate(charID, data, size, BlePriorityHigh, false);
 }
 
 void gattCallback(int32_t index, uint8_t data[], uint16_t len) {
-  Log.Debug("gattCallback (index=%d)" CR, index);
+  latencyMarkGattWrite();
+  TLOG_DEBUG("gattCallback (index=%d)" CR, index);
+  DIAG_COUNT(DiagGattWrites);
   for (int i=0; i<charConfigsCount; ++i) {
     if (index==charConfigs[i].charId) {
 //      for(int i=0; i<len; ++i) {
 //        Log.Debug("%x", data[i]);
 //      }
 //      Log.Debug(CR);
+      DIAG_BEGIN(DiagGattCallback);
       charConfigs[i].callback(data, len);
+      DIAG_END(DiagGattCallback);
       return;
     }
   }
   Log.Error(F("Failed to find callback" CR));
 }
 
+static volatile bool irqPending = false;
+
+static void bluetoothIrq() {
+  irqPending = true;
+  idleWake();
+  DIAG_COUNT(DiagBleIrqs);
+}
+
 /* The service information */
 
 int32_t loraServiceId;
 int32_t loraSendCharId;
 int32_t loraTxResultCharId;
+int32_t loraQueueStatusCharId;
+int32_t loraAirtimeStatusCharId;
+int32_t loraDownlinkCharId;
+int32_t loraJoinStatusCharId;
+int32_t batteryStatusCharId;
 
 int32_t logServiceId;
 int32_t logMessageCharId;
 
+#if defined(DIAGNOSTICS)
+int32_t diagServiceId;
+int32_t diagCharId;
+
+// Selects a diagnostics page and makes it the characteristic value for the next read
+static void diagCallback(int32_t index, uint8_t data[], uint16_t len) {
+  uint8_t buffer[20];
+  uint8_t size = diagPage(data[0], len>1 ? data[1] : 0, buffer);
+  if (size) {
+    setBluetoothCharData(diagCharId, buffer, size);
+  }
+}
+#endif
+
 int32_t deviceInfoServiceId;
 int32_t deviceInfoCharId;
 
@@ -139,6 +180,155 @@ bool initNVRam() {
   return true;
 }
 
+/* The GATT layout is defined once, in defineGatt(), and walked in one of three modes:
+  - GattHash: fold every AT command into a hash of the layout
+  - GattBuild: send the commands to the module
+  - GattRecover: assign the IDs the module handed out last time it was built.
+    Services and characteristics are numbered from 1 in the order they are added.
+  The hash is kept in NVM. If it matches, the module already holds this layout and
+  we skip GATTCLEAR, the rebuild and the module reset.
+*/
+#define GATT_HASH_OFFSET (MAGIC_NUMBER_SIZE + NV_USER_SIZE) // Last NVM word
+
+typedef enum GattModeEnum {
+  GattHash,
+  GattBuild,
+  GattRecover,
+} GattMode;
+
+static GattMode gattMode;
+static uint32_t gattHash;
+static int32_t nextServiceId;
+static int32_t nextCharId;
+
+static bool gattCommand(const char *command, int32_t *id, bool isService) {
+  switch (gattMode) {
+    case GattHash:
+      for (const char *c = command; *c; ++c) {
+        gattHash = (gattHash ^ (uint8_t)*c) * 16777619UL; // FNV-1a
+      }
+      return true;
+    case GattRecover:
+      *id = isService ? nextServiceId++ : nextCharId++;
+      return true;
+    case GattBuild:
+      TLOG_DEBUG("%s" CR, command);
+      if (! ble.sendCommandWithIntReply(command, id)) {
+        TLOG_ERROR("Failed GATT command: %s" CR, command);
+        return false;
+      }
+      return true;
+  }
+  return false;
+}
+
+#define GATT_SERVICE(command, id) if (!gattCommand(command, id, true)) return false;
+#define GATT_CHAR(command, id) if (!gattCommand(command, id, false)) return false;
+
+#define GATT_ADV_DATA "AT+GAPSETADVDATA=02-01-06-09-02-0A-18-0F-18-30-18-31-18"
+
+static bool defineGatt(CharacteristicConfigType *cconfigs, int32_t cccount) {
+  /* LoRa service */
+  GATT_SERVICE("AT+GATTADDSERVICE=UUID=0x1830", &loraServiceId)
+  // 0x10 notify to bluetooth app only
+  GATT_CHAR("AT+GATTADDCHAR=UUID=0x2ADA,PROPERTIES=0x10,MIN_LEN=1,MAX_LEN=20,DESCRIPTION=TX Result", &loraTxResultCharId)
+  GATT_CHAR("AT+GATTADDCHAR=UUID=0x2ADC,PROPERTIES=0x12,MIN_LEN=1,MAX_LEN=8,DESCRIPTION=Queue status", &loraQueueStatusCharId)
+  GATT_CHAR("AT+GATTADDCHAR=UUID=0x2ADE,PROPERTIES=0x12,MIN_LEN=1,MAX_LEN=12,DESCRIPTION=Airtime status", &loraAirtimeStatusCharId)
+  GATT_CHAR("AT+GATTADDCHAR=UUID=0x2AE1,PROPERTIES=0x10,MIN_LEN=1,MAX_LEN=20,DESCRIPTION=Downlink", &loraDownlinkCharId)
+  GATT_CHAR("AT+GATTADDCHAR=UUID=0x2AE5,PROPERTIES=0x12,MIN_LEN=1,MAX_LEN=16,DESCRIPTION=Join status", &loraJoinStatusCharId)
+  /* LoRa write characteristics */
+  for (int i=0; i<cccount; ++i) {
+    GATT_CHAR(cconfigs[i].charDef, &cconfigs[i].charId)
+  }
+
+  /* Logging service */
+  GATT_SERVICE("AT+GATTADDSERVICE=UUID=0x1831", &logServiceId)
+  GATT_CHAR("AT+GATTADDCHAR=UUID=0x2AD6,PROPERTIES=0x10,MIN_LEN=1,MAX_LEN=20", &logMessageCharId)
+
+  #if defined(DIAGNOSTICS)
+  /* Diagnostics service: write [probe][page], then read it back. See Diag.h */
+  GATT_SERVICE("AT+GATTADDSERVICE=UUID=0x1832", &diagServiceId)
+  GATT_CHAR("AT+GATTADDCHAR=UUID=0x2AE4,PROPERTIES=0x0A,MIN_LEN=1,MAX_LEN=20,DATATYPE=2,DESCRIPTION=Diagnostics", &diagCharId)
+  #endif
+
+  /* Device Info service: manufacturer name, software version */
+  GATT_SERVICE("AT+GATTADDSERVICE=UUID=0x180A", &deviceInfoServiceId)
+  GATT_CHAR("AT+GATTADDCHAR=UUID=0x2A29,PROPERTIES=0x02,MIN_LEN=1,MAX_LEN=20,VALUE=TheThingsNYC", &deviceInfoCharId)
+  GATT_CHAR("AT+GATTADDCHAR=UUID=0x2A28,PROPERTIES=0x02,MIN_LEN=1,MAX_LEN=20,VALUE=" MAPTHETHINGS_SOFTWARE_VERSION, &deviceInfoCharId)
+
+  // Battery service: 0x180F
+  // Battery level: 0x2A19, 1 byte, 0-100 values (read mandatory, notify optional)
+  GATT_SERVICE("AT+GATTADDSERVICE=UUID=0x180F", &batteryLevelServiceId)
+  GATT_CHAR("AT+GATTADDCHAR=UUID=0x2A19,PROPERTIES=0x12,MIN_LEN=1,MAX_LEN=1,VALUE=00", &batteryLevelCharId)
+  GATT_CHAR("AT+GATTADDCHAR=UUID=0x2AE3,PROPERTIES=0x12,MIN_LEN=1,MAX_LEN=8,DESCRIPTION=Battery status", &batteryStatusCharId)
+
+  if (gattMode==GattHash) {
+    // Advertising data is part of what the cache stands for
+    gattCommand(GATT_ADV_DATA, NULL, false);
+  }
+  return true;
+}
+
+// Cheap check that the module really holds the layout: read back the software version
+static bool gattVersionMatches() {
+  char version[21];
+  uint8_t len = gatt.getChar(deviceInfoCharId, (uint8_t *)version, sizeof(version)-1);
+  version[len] = 0;
+  return strcmp(version, MAPTHETHINGS_SOFTWARE_VERSION)==0;
+}
+
+// Builds the GATT layout, or recovers IDs if the module already holds it
+static bool setupGatt(CharacteristicConfigType *cconfigs, int32_t cccount) {
+  gattMode = GattHash;
+  gattHash = 2166136261UL;
+  defineGatt(cconfigs, cccount);
+
+  int32_t storedHash = 0;
+  ble.readNVM(GATT_HASH_OFFSET, &storedHash);
+  if ((uint32_t)storedHash==gattHash) {
+    gattMode = GattRecover;
+    nextServiceId = 1;
+    nextCharId = 1;
+    defineGatt(cconfigs, cccount);
+    if (gattVersionMatches()) {
+      TLOG_DEBUG("GATT layout matches cache (%x). Skipping rebuild." CR, gattHash);
+      return true;
+    }
+    TLOG_WARN("GATT cache hash matched but module layout did not. Rebuilding." CR);
+  }
+
+  TLOG_DEBUG("Clearing the GATT." CR);
+  if (! ble.atcommand( F("AT+GATTCLEAR") )) {
+    TLOG_ERROR("Could not clear GATT!" CR);
+    return false;
+  }
+
+  gattMode = GattBuild;
+  if (!defineGatt(cconfigs, cccount)) {
+    return false;
+  }
+
+  /* Add the LoRa to the advertising data (needed for Nordic apps to detect the service) */
+  TLOG_DEBUG("Adding LoRa and Device info UUIDs to the advertising payload:" CR);
+  // 02-01-06 - len-flagtype-flags
+  // 09-02 - len-16bitlisttype- 0x180A(Device) - 0x180F(Battery) - 0x1830(LoRa) - 0x1831(Logging)
+  //   bit
+  //    0 LE Limited Discoverable Mode - 180sec advertising
+  //    1 LE General Discoverable Mode - Indefinite advertising time
+  //    2 BR/EDR Not Supported
+  //    3 Simultaneous LE and BR/EDR (Controller)
+  //    4 Simultaneous LE and BR/EDR (Host)
+  ble.sendCommandCheckOK( GATT_ADV_DATA );
+
+  /* Reset the device for the new service setting changes to take effect */
+  TLOG_DEBUG("Performing a SW reset (service changes require a reset):" CR);
+  ble.reset();
+
+  ble.writeNVM(GATT_HASH_OFFSET, (int32_t)gattHash);
+  TLOG_DEBUG("Stored GATT layout hash %x" CR, gattHash);
+  return true;
+}
+
 /**************************************************************************/
 /*!
     @brief  Sets up the HW an the BLE module (this function is called
@@ -147,11 +337,10 @@ bool initNVRam() {
 /**************************************************************************/
 bool setupBluetooth(CharacteristicConfigType *cconfigs, int32_t cccount, bool verbose)
 {
+  uint32_t startMs = millis();
   charConfigs = cconfigs;
   charConfigsCount = cccount;
 
-  boolean success;
-
   /* Initialise the module */
   Log.Info(F("Initialising the Bluefruit LE module" CR));
 
@@ -169,7 +358,7 @@ bool setupBluetooth(CharacteristicConfigType *cconfigs, int32_t cccount, bool ve
   ble.echo(false);
 
   if (verbose) {
-    Log.Debug("Requesting Bluefruit info:" CR);
+    TLOG_DEBUG("Requesting Bluefruit info:" CR);
     /* Print Bluefruit information */
     ble.info();
   }
@@ -200,170 +389,347 @@ bool setupBluetooth(CharacteristicConfigType *cconfigs, int32_t cccount, bool ve
   }
 
 
-  Log.Debug(F("Clearing the GATT." CR));
-  success = ble.atcommand( F("AT+GATTCLEAR") );
-  if (! success) {
-    Log.Error(F("Could not clear GATT!" CR));
+  if (!setupGatt(cconfigs, cccount)) {
     return false;
   }
 
-  /* Add the LoRa Service definition */
-  /* Service ID should be 1 */
-  Log.Debug(F("Adding the LoRa Service definition (UUID = 0x1830): " CR));
-  success = ble.sendCommandWithIntReply( F("AT+GATTADDSERVICE=UUID=0x1830"), &loraServiceId);
-  if (! success) {
-    Log.Error(F("Could not add LoRa service" CR));
-    return false;
+  Log.Debug(F("Signing up for callbacks on characteristic write: " CR));
+  for (int i=0; i<cccount; ++i) {
+    ble.setBleGattRxCallback(cconfigs[i].charId, gattCallback);
   }
+  #if defined(DIAGNOSTICS)
+  ble.setBleGattRxCallback(diagCharId, diagCallback);
+  #endif
 
-  // 0x10 notify to bluetooth app only
-  success = ble.sendCommandWithIntReply( F("AT+GATTADDCHAR=UUID=0x2ADA,PROPERTIES=0x10,MIN_LEN=1,MAX_LEN=16,DESCRIPTION=TX Result"), &loraTxResultCharId);
-  if (! success) {
-    Log.Error(F("Could not add TX Result characteristic" CR));
-    return false;
+  // The module raises IRQ when it has data for us. Use it to poll only when needed.
+  attachInterrupt(digitalPinToInterrupt(BLUEFRUIT_SPI_IRQ), bluetoothIrq, RISING);
+
+  ble.verbose(verbose);
+  TLOG_INFO("Bluetooth ready in %d ms" CR, millis() - startMs);
+  return true;
+}
+
+static bool logResult(bool result, const char * op) {
+  if ( !result ) {
+    Log.Error(F("Failed to get response! "));
+    Log.Error(op);
+    Log.Error(CR);
   }
+  return result;
+}
 
-  /* Add the LoRa write characteristic */
-  /* Chars ID for Measurement should be 1 */
-  for (int i=0; i<cccount; ++i) {
-    Log.Debug(F("Adding characteristic: %s" CR), cconfigs[i].charDef);
-    success = ble.sendCommandWithIntReply(cconfigs[i].charDef, &cconfigs[i].charId);
-    if (! success) {
-      Log.Error(F("Could not add characteristic" CR));
+/* Outbound characteristic updates.
+  Callers never wait on the module. Updates are queued here, and loopBluetooth
+  sends one per pass: highest priority first, then oldest first. Log chunks go
+  out only when nothing else is waiting. A coalescing update replaces a queued
+  update of the same characteristic that has not gone out yet, so repeated
+  status values cost one AT round trip. Events such as TX results are never
+  coalesced.
+*/
+#define OUTBOUND_SLOTS 12
+#define OUTBOUND_MAX_LEN 20
+
+typedef struct {
+  int32_t charId; // 0 when the slot is free
+  uint8_t priority;
+  bool coalesce;
+  uint8_t len;
+  uint16_t order;
+  uint8_t data[OUTBOUND_MAX_LEN];
+} OutboundUpdate;
+
+static OutboundUpdate outbound[OUTBOUND_SLOTS];
+static uint8_t outboundPending = 0;
+static uint16_t outboundOrder = 0;
+static uint32_t outboundDropped = 0;
+
+static bool olderThan(const OutboundUpdate *a, const OutboundUpdate *b) {
+  return (int16_t)(a->order - b->order) < 0;
+}
+
+static bool queueUpdate(int32_t charId, uint8_t const data[], uint8_t len, BlePriority priority, bool coalesce) {
+  if (charId<=0 || len>OUTBOUND_MAX_LEN) {
+    return false; // GATT not set up yet, or oversized
+  }
+  OutboundUpdate *slot = NULL;
+  for (int i=0; i<OUTBOUND_SLOTS; ++i) {
+    OutboundUpdate *u = &outbound[i];
+    if (coalesce && u->charId==charId && u->coalesce) {
+      // Superseded value. Keeps its place in line.
+      memcpy(u->data, data, len);
+      u->len = len;
+      return true;
+    }
+    if (u->charId==0 && slot==NULL) {
+      slot = u;
+    }
+  }
+  if (slot==NULL) {
+    // Full. Evict the oldest update of lower priority, if any.
+    for (int i=0; i<OUTBOUND_SLOTS; ++i) {
+      OutboundUpdate *u = &outbound[i];
+      if (u->priority>priority && (slot==NULL || olderThan(u, slot))) {
+        slot = u;
+      }
+    }
+    ++outboundDropped;
+    if (slot==NULL) {
       return false;
     }
+    --outboundPending;
   }
-  Log.Debug(F("Done adding LoRa service" CR));
+  slot->charId = charId;
+  slot->priority = priority;
+  slot->coalesce = coalesce;
+  slot->len = len;
+  slot->order = outboundOrder++;
+  memcpy(slot->data, data, len);
+  ++outboundPending;
+  return true;
+}
 
-  Log.Debug(F("Adding the Logging Service definition (UUID = 0x1831): " CR));
-  success = ble.sendCommandWithIntReply( F("AT+GATTADDSERVICE=UUID=0x1831"), &logServiceId);
-  if (! success) {
-    Log.Error(F("Could not add Logging service" CR));
-    return false;
-  }
-  Log.Debug(F("Adding the log message characteristic (UUID = 0x2AD6):" CR));
-  success = ble.sendCommandWithIntReply( F("AT+GATTADDCHAR=UUID=0x2AD6,PROPERTIES=0x10,MIN_LEN=1,MAX_LEN=20"), &logMessageCharId);
-  if (! success) {
-    Log.Error(F("Could not add log message characteristic" CR));
-    return false;
-  }
+static void drainLog();
 
-  Log.Debug(F("Adding the Device Info service definition (UUID = 0x180A):" CR));
-  success = ble.sendCommandWithIntReply( F("AT+GATTADDSERVICE=UUID=0x180A"), &deviceInfoServiceId);
-  if (! success) {
-    Log.Error(F("Could not add Device Info service" CR));
-    return false;
+// Sends the most urgent queued update, or a log chunk if none is waiting
+static void drainOutbound() {
+  if (outboundPending==0) {
+    drainLog();
+    return;
   }
-  Log.Debug(F("Adding the Device Info manufacturer name characteristic (UUID = 0x2A29):" CR));
-  success = ble.sendCommandWithIntReply( F("AT+GATTADDCHAR=UUID=0x2A29,PROPERTIES=0x02,MIN_LEN=1,MAX_LEN=20,VALUE=TheThingsNYC"), &deviceInfoCharId);
-  if (! success) {
-    Log.Error(F("Could not add Device Info manufacturer name characteristic" CR));
-    return false;
-  }
-  Log.Debug(F("Adding the Device Info software version characteristic (UUID = 0x2A28):" CR));
-  success = ble.sendCommandWithIntReply( F("AT+GATTADDCHAR=UUID=0x2A28,PROPERTIES=0x02,MIN_LEN=1,MAX_LEN=20,VALUE=" MAPTHETHINGS_SOFTWARE_VERSION), &deviceInfoCharId);
-  if (! success) {
-    Log.Error(F("Could not add Device Info software version characteristic" CR));
-    return false;
+  OutboundUpdate *next = NULL;
+  for (int i=0; i<OUTBOUND_SLOTS; ++i) {
+    OutboundUpdate *u = &outbound[i];
+    if (u->charId!=0 && (next==NULL || u->priority<next->priority
+        || (u->priority==next->priority && olderThan(u, next)))) {
+      next = u;
+    }
   }
 
-  // Battery service: 0x180F
-  // Battery level: 0x2A19, 1 byte, 0-100 values (read mandatory, notify optional)
-  Log.Debug(F("Adding the Battery level service definition (UUID = 0x180F):" CR));
-  success = ble.sendCommandWithIntReply( F("AT+GATTADDSERVICE=UUID=0x180F"), &batteryLevelServiceId);
-  if (! success) {
-    Log.Error(F("Could not add Battery level service"));
-    return false;
+  uint32_t startUs = micros();
+  bool result = gatt.setChar(next->charId, next->data, next->len);
+  #if defined(DIAGNOSTICS)
+  if (next->charId==loraTxResultCharId) {
+    diagRecord(DiagAtTxResult, micros() - startUs);
   }
-  Log.Debug(F("Adding the Battery level characteristic (UUID = 0x2A19):" CR));
-  success = ble.sendCommandWithIntReply( F("AT+GATTADDCHAR=UUID=0x2A19,PROPERTIES=0x12,MIN_LEN=1,MAX_LEN=1,VALUE=00"), &batteryLevelCharId);
-  if (! success) {
-    Log.Error(F("Could not add Battery level characteristic" CR));
-    return false;
+  else if (next->charId==batteryLevelCharId) {
+    diagRecord(DiagAtBattery, micros() - startUs);
   }
+  #else
+  (void)startUs;
+  #endif
+  logResult(result, "GATT update");
 
-  /* Add the LoRa to the advertising data (needed for Nordic apps to detect the service) */
-  Log.Debug(F("Adding LoRa and Device info UUIDs to the advertising payload:" CR));
-  // 02-01-06 - len-flagtype-flags
-  // 09-02 - len-16bitlisttype- 0x180A(Device) - 0x180F(Battery) - 0x1830(LoRa) - 0x1831(Logging)
-  //   bit
-  //    0 LE Limited Discoverable Mode - 180sec advertising
-  //    1 LE General Discoverable Mode - Indefinite advertising time
-  //    2 BR/EDR Not Supported
-  //    3 Simultaneous LE and BR/EDR (Controller)
-  //    4 Simultaneous LE and BR/EDR (Host)
-  ble.sendCommandCheckOK( F("AT+GAPSETADVDATA=02-01-06-09-02-0A-18-0F-18-30-18-31-18") );
+  next->charId = 0;
+  --outboundPending;
+}
 
-  /* Reset the device for the new service setting changes to take effect */
-  Log.Debug(F("Performing a SW reset (service changes require a reset):" CR));
-  ble.reset();
+uint32_t bluetoothUpdatesDropped() {
+  return outboundDropped;
+}
 
-  Log.Debug(F("Signing up for callbacks on characteristic write: " CR));
-  for (int i=0; i<cccount; ++i) {
-    ble.setBleGattRxCallback(cconfigs[i].charId, gattCallback);
-  }
+void sendBatteryLevel(uint8_t level) {
+  queueUpdate(batteryLevelCharId, &level, sizeof(level), BlePriorityNormal, true);
+}
 
-  ble.verbose(verbose);
-  return true;
+void sendBatteryStatus(uint8_t level, uint16_t millivolts, int16_t trendMvPerHour, uint16_t remainingPings) {
+  // 8bit format, 8bit level, 16bit mV, 16bit trend mV/h, 16bit remaining pings (0xFFFF unknown)
+  uint8_t buffer[8];
+  #define BATTERY_STATUS_FORMAT_V1 0x01
+  buffer[0] = BATTERY_STATUS_FORMAT_V1;
+  buffer[1] = level;
+  memcpy(&buffer[2], (uint8_t *)&millivolts, sizeof(millivolts));
+  memcpy(&buffer[4], (uint8_t *)&trendMvPerHour, sizeof(trendMvPerHour));
+  memcpy(&buffer[6], (uint8_t *)&remainingPings, sizeof(remainingPings));
+
+  queueUpdate(batteryStatusCharId, buffer, sizeof(buffer), BlePriorityNormal, true);
 }
 
-static bool waitForOK(const char * op) {
-  if ( ble.waitForOK() ) {
-    return true;
-  }
-  else {
-    Log.Error(F("Failed to get response! "));
-    Log.Error(op);
-    Log.Error(CR);
-    return false;
-  }
+static void putLatency(uint8_t *at, uint16_t ms) {
+  memcpy(at, (uint8_t *)&ms, sizeof(ms));
 }
 
-static bool logResult(bool result, const char * op) {
-  if ( !result ) {
-    Log.Error(F("Failed to get response! "));
-    Log.Error(op);
-    Log.Error(CR);
+void sendTxResult(uint8_t bleSeq, uint16_t error, uint32_t seq_no, uint8_t flags, uint8_t attempts, uint8_t sf,
+  const uint16_t latencyMs[]) {
+  // 8bit format, 8bit ble_seq, 16bit error, 32bit seq_no,
+  // 8bit TX_RESULT_* flags, 8bit attempts, 8bit SF of the last attempt,
+  // latency per LatencyStage in ms: 8bit BLE, 16bit queue, 16bit LMIC, 16bit radio, 8bit result.
+  // The 8bit stages run within one call chain and saturate at 255.
+  // V1 was the first 8 bytes. V2 had a reserved byte where BLE latency is now, and stopped there.
+  uint8_t buffer[19];
+  #define TX_RESULT_FORMAT_V3 0x03
+  buffer[0] = TX_RESULT_FORMAT_V3;
+  buffer[1] = bleSeq;
+  memcpy(&buffer[2*sizeof(uint8_t)], (uint8_t *)&error, sizeof(error));
+  memcpy(&buffer[2*sizeof(uint8_t)+sizeof(uint16_t)], (uint8_t *)&seq_no, sizeof(seq_no));
+  buffer[8] = flags;
+  buffer[9] = attempts;
+  buffer[10] = sf;
+  buffer[11] = latencyMs[LatencyBle]<0xFF ? latencyMs[LatencyBle] : 0xFF;
+  putLatency(&buffer[12], latencyMs[LatencyQueue]);
+  putLatency(&buffer[14], latencyMs[LatencyLmic]);
+  putLatency(&buffer[16], latencyMs[LatencyRadio]);
+  buffer[18] = latencyMs[LatencyResult]<0xFF ? latencyMs[LatencyResult] : 0xFF;
+
+  // Every result counts, so never coalesced
+  if (!queueUpdate(loraTxResultCharId, buffer, sizeof(buffer), BlePriorityHigh, false)) {
+    TLOG_ERROR("TX result for BLE seq %d dropped" CR, bleSeq);
   }
-  return result;
 }
 
-void sendBatteryLevel(uint8_t level) {
-  /* Command is sent when \n (\r) or println is called */
-  /* AT+GATTCHAR=CharacteristicID,value */
-  ble.print( F("AT+GATTCHAR=") );
-  ble.print( batteryLevelCharId );
-  ble.print( F(",") );
-  ble.println(level, HEX);
+void sendQueueStatus(uint8_t depth, uint8_t capacity, uint8_t policy, uint32_t overflows) {
+  // 8bit format, 8bit depth, 8bit capacity, 8bit policy, 32bit overflow count
+  uint8_t buffer[8];
+  #define QUEUE_STATUS_FORMAT_V1 0x01
+  buffer[0] = QUEUE_STATUS_FORMAT_V1;
+  buffer[1] = depth;
+  buffer[2] = capacity;
+  buffer[3] = policy;
+  memcpy(&buffer[4*sizeof(uint8_t)], (uint8_t *)&overflows, sizeof(overflows));
+
+  queueUpdate(loraQueueStatusCharId, buffer, sizeof(buffer), BlePriorityNormal, true);
+}
 
-  waitForOK("Send battery level");
+void sendAirtimeStatus(uint32_t nextTxMs, uint32_t budgetRemainingMs, uint16_t lastAirtimeMs) {
+  // 8bit format, 8bit reserved, 16bit last frame airtime ms,
+  // 32bit ms until next TX allowed, 32bit daily budget remaining ms
+  uint8_t buffer[12];
+  #define AIRTIME_STATUS_FORMAT_V1 0x01
+  buffer[0] = AIRTIME_STATUS_FORMAT_V1;
+  buffer[1] = 0;
+  memcpy(&buffer[2], (uint8_t *)&lastAirtimeMs, sizeof(lastAirtimeMs));
+  memcpy(&buffer[4], (uint8_t *)&nextTxMs, sizeof(nextTxMs));
+  memcpy(&buffer[8], (uint8_t *)&budgetRemainingMs, sizeof(budgetRemainingMs));
+
+  queueUpdate(loraAirtimeStatusCharId, buffer, sizeof(buffer), BlePriorityNormal, true);
 }
 
-void sendTxResult(uint8_t bleSeq, uint16_t error, uint32_t seq_no) {
-  // 8bit format, 8bit ble_seq, 16bit error, 32bit seq_no
-  uint8_t buffer[8];
-  #define TX_RESULT_FORMAT_V1 0x01
-  buffer[0] = TX_RESULT_FORMAT_V1;
-  buffer[1] = bleSeq;
-  memcpy(&buffer[2*sizeof(uint8_t)], (uint8_t *)&error, sizeof(error));
-  memcpy(&buffer[2*sizeof(uint8_t)+sizeof(uint16_t)], (uint8_t *)&seq_no, sizeof(seq_no));
+void sendJoinStatus(uint8_t phase, uint16_t attempts, uint8_t sf, uint16_t devNonce, uint32_t waitMs, uint32_t elapsedMs) {
+  // 8bit format, 8bit phase, 16bit attempts, 8bit SF, 8bit reserved, 16bit next DevNonce,
+  // 32bit ms until the next round, 32bit ms since joining started (time to join once joined)
+  uint8_t buffer[16];
+  #define JOIN_STATUS_FORMAT_V1 0x01
+  buffer[0] = JOIN_STATUS_FORMAT_V1;
+  buffer[1] = phase;
+  memcpy(&buffer[2], (uint8_t *)&attempts, sizeof(attempts));
+  buffer[4] = sf;
+  buffer[5] = 0;
+  memcpy(&buffer[6], (uint8_t *)&devNonce, sizeof(devNonce));
+  memcpy(&buffer[8], (uint8_t *)&waitMs, sizeof(waitMs));
+  memcpy(&buffer[12], (uint8_t *)&elapsedMs, sizeof(elapsedMs));
+
+  queueUpdate(loraJoinStatusCharId, buffer, sizeof(buffer), BlePriorityNormal, true);
+}
 
-  bool result = gatt.setChar(loraTxResultCharId, buffer, sizeof(buffer));
+/* Downlink payload split over notifications of at most BLE_MTU bytes.
+  First:     8bit format, 4bit chunk index | 4bit chunk count, 8bit port,
+             8bit RSSI, 8bit SNR (quarter dB), 32bit frame counter, data
+  Following: 8bit format, 4bit chunk index | 4bit chunk count, data
+  Chunks are copied into the outbound queue as events, so the LMIC receive
+  path never waits on the module. A chunk that finds no room ends the downlink.
+*/
+#define BLE_MTU 20
+#define DOWNLINK_FORMAT_V1 0x01
+#define DOWNLINK_FIRST_HEADER 9
+#define DOWNLINK_NEXT_HEADER 2
+void sendDownlink(uint8_t const data[], uint8_t len, uint8_t port, int8_t rssi, int8_t snr, uint32_t fcnt) {
+  const uint8_t firstMax = BLE_MTU - DOWNLINK_FIRST_HEADER;
+  const uint8_t nextMax = BLE_MTU - DOWNLINK_NEXT_HEADER;
+  uint8_t count = 1;
+  if (len>firstMax) {
+    count += (len - firstMax + nextMax - 1) / nextMax;
+  }
+
+  uint8_t chunk[BLE_MTU];
+  uint8_t n = len<firstMax ? len : firstMax;
+  chunk[0] = DOWNLINK_FORMAT_V1;
+  chunk[1] = count;
+  chunk[2] = port;
+  chunk[3] = rssi;
+  chunk[4] = snr;
+  memcpy(&chunk[5], (uint8_t *)&fcnt, sizeof(fcnt));
+  memcpy(&chunk[DOWNLINK_FIRST_HEADER], data, n);
+  bool result = queueUpdate(loraDownlinkCharId, chunk, DOWNLINK_FIRST_HEADER + n, BlePriorityHigh, false);
+
+  for (uint8_t index=1, sent=n; result && sent<len; ++index, sent+=n) {
+    n = len - sent<nextMax ? len - sent : nextMax;
+    chunk[1] = (index << 4) | count;
+    memcpy(&chunk[DOWNLINK_NEXT_HEADER], data + sent, n);
+    result = queueUpdate(loraDownlinkCharId, chunk, DOWNLINK_NEXT_HEADER + n, BlePriorityHigh, false);
+  }
 
-  logResult(result, "sendTxResult");
+  if (!result) {
+    TLOG_ERROR("Downlink %d dropped" CR, fcnt);
+  }
 }
 
+/* Log bytes waiting to go out on the log message characteristic.
+  Single producer (sendLogMessage) and single consumer (drainLog). Each side only
+  writes its own index, so no locking is needed. Indices run free and wrap
+  naturally; LOG_RING_SIZE must be a power of two.
+*/
+#define LOG_RING_SIZE 512
+#define LOG_CHUNK_SIZE 20 // One BLE notification
+#define LOG_DRAIN_INTERVAL_MS 20 // At most one chunk per interval: ~1KB/s
+static uint8_t logRing[LOG_RING_SIZE];
+static volatile uint16_t logHead = 0;
+static volatile uint16_t logTail = 0;
+static uint32_t logDropped = 0;
+static uint32_t lastDrainMs = 0;
+
+static bool logRingPut(const uint8_t *s, uint16_t len) {
+  uint16_t head = logHead;
+  if ((uint16_t)(LOG_RING_SIZE - (uint16_t)(head - logTail)) < len) {
+    return false;
+  }
+  for (uint16_t i=0; i<len; ++i) {
+    logRing[(head + i) & (LOG_RING_SIZE-1)] = s[i];
+  }
+  logHead = head + len;
+  return true;
+}
+
+/* Queues a log message for the phone. Never blocks: if there is no room the whole
+  message is dropped and counted, rather than sending part of a line.
+*/
 void sendLogMessage(const char *s) {
+  sendLogBytes((const uint8_t *)s, strlen(s));
+}
+
+void sendLogBytes(const uint8_t *bytes, uint16_t len) {
   // NOTE: Don't use Log.Debug because infinite recursion.
-  // Serial.print(F("Sending message: ")); Serial.println(s);
-  int len = strlen(s);
-  // Break into 20 byte chunks
-  while (len>20) {
-    gatt.setChar(logMessageCharId, (const uint8_t *)s, 20);
-    s += 20;
-    len -= 20;
+  static uint32_t reportedDropped = 0;
+  if (logDropped!=reportedDropped) {
+    char note[32];
+    int noteLen = snprintf(note, sizeof(note), "[Dropped %lu log bytes]\r\n", (unsigned long)logDropped);
+    if (logRingPut((const uint8_t *)note, noteLen)) {
+      reportedDropped = logDropped;
+    }
+  }
+  if (!logRingPut(bytes, len)) {
+    logDropped += len;
+  }
+}
+
+uint32_t logDroppedBytes() {
+  return logDropped;
+}
+
+static void drainLog() {
+  uint16_t tail = logTail;
+  uint16_t pending = logHead - tail;
+  uint32_t now = millis();
+  if (pending==0 || now - lastDrainMs < LOG_DRAIN_INTERVAL_MS) {
+    return;
   }
-  gatt.setChar(logMessageCharId, (const uint8_t *)s, len);
+  lastDrainMs = now;
+
+  uint8_t chunk[LOG_CHUNK_SIZE];
+  uint8_t len = min(pending, LOG_CHUNK_SIZE);
+  for (uint8_t i=0; i<len; ++i) {
+    chunk[i] = logRing[(tail + i) & (LOG_RING_SIZE-1)];
+  }
+  gatt.setChar(logMessageCharId, chunk, len);
+  logTail = tail + len;
 }
 
 /* Writes NV bytes with offset after magic number
@@ -372,9 +738,11 @@ void sendLogMessage(const char *s) {
 bool writeNVBytes(uint8_t offset, uint8_t *bytes, uint8_t length) {
   offset += MAGIC_NUMBER_SIZE;
   bool success = true;
-  for (uint8_t i = 0; i < length; i += BLE_BUFSIZE) {
+  DIAG_BEGIN(DiagAtNvWrite);
+  for (uint16_t i = 0; i < length; i += BLE_BUFSIZE) {
     success = success && ble.writeNVM(offset + i, bytes + i, min(BLE_BUFSIZE, (length - i)));
   }
+  DIAG_END(DiagAtNvWrite);
   return success;
 }
 bool writeNVInt(uint8_t offset, int32_t number) {
@@ -387,7 +755,7 @@ bool writeNVInt(uint8_t offset, int32_t number) {
 bool readNVBytes(uint8_t offset, uint8_t *bytes, uint8_t length) {
   offset += MAGIC_NUMBER_SIZE;
   bool success = true;
-  for (uint8_t i = 0; i < length; i += BLE_BUFSIZE) {
+  for (uint16_t i = 0; i < length; i += BLE_BUFSIZE) {
     success = success && ble.readNVM(offset + i, bytes + i, min(BLE_BUFSIZE, (length - i)));
   }
   return success;
@@ -396,6 +764,46 @@ bool readNVInt(uint8_t offset, int32_t *number) {
   return ble.readNVM(offset+MAGIC_NUMBER_SIZE, number);
 }
 
+// Fallback poll for GATT writes, in case the module holds events without raising IRQ
+#define BLE_POLL_INTERVAL_MS 200
+static uint32_t lastPollMs = 0;
+
+/* Polls the module for GATT writes without blocking the caller between polls.
+  IRQ edges also follow our own AT responses, so poll on IRQ only if the line is
+  still high, which means the module has unread data.
+*/
 void loopBluetooth(void) {
+  #if defined(BLE_BLOCKING_POLL)
+    // Original behaviour, kept for loop latency comparison
     ble.update(200);
+  #else
+    uint32_t now = millis();
+    bool poll = now - lastPollMs >= BLE_POLL_INTERVAL_MS;
+    if (irqPending) {
+      irqPending = false;
+      poll = poll || digitalRead(BLUEFRUIT_SPI_IRQ);
+    }
+    if (poll) {
+      lastPollMs = now;
+      DIAG_COUNT(DiagBlePolls);
+      ble.update(0); // Period 0: check event status now
+    }
+  #endif
+  drainOutbound();
+}
+
+uint32_t bluetoothIdleMs(uint32_t nowMs) {
+  if (irqPending || outboundPending) {
+    return 0;
+  }
+  uint32_t sincePoll = nowMs - lastPollMs;
+  uint32_t ms = sincePoll<BLE_POLL_INTERVAL_MS ? BLE_POLL_INTERVAL_MS - sincePoll : 0;
+  if (logHead!=logTail) {
+    uint32_t sinceDrain = nowMs - lastDrainMs;
+    uint32_t drainMs = sinceDrain<LOG_DRAIN_INTERVAL_MS ? LOG_DRAIN_INTERVAL_MS - sinceDrain : 0;
+    if (drainMs<ms) {
+      ms = drainMs;
+    }
+  }
+  return ms;
 }
@@ -13,13 +13,38 @@ typedef struct {
 
 bool setupBluetooth(CharacteristicConfigType *cconfigs, int32_t cccount, bool verbose);
 void loopBluetooth(void);
+uint32_t bluetoothIdleMs(uint32_t nowMs); // How long loopBluetooth has nothing to do
 void bluetoothDisconnect();
 
+typedef enum BlePriorityEnum {
+  BlePriorityHigh,    // Events the phone waits for, e.g. TX results
+  BlePriorityNormal,  // Status values. Log chunks go after both.
+} BlePriority;
+
+// Updates are queued and sent from loopBluetooth. Never waits on the module.
+// Value update: replaces a queued update of the same characteristic
 void setBluetoothCharData(uint8_t charID, uint8_t const data[], uint8_t size);
+// Event: never coalesced, goes ahead of value updates
+void sendBluetoothCharEvent(uint8_t charID, uint8_t const data[], uint8_t size);
+uint32_t bluetoothUpdatesDropped();
 
 void sendBatteryLevel(uint8_t level);
-void sendTxResult(uint8_t bleSeq, uint16_t error, uint32_t seq_no);
-void sendLogMessage(const char *s);
+void sendBatteryStatus(uint8_t level, uint16_t millivolts, int16_t trendMvPerHour, uint16_t remainingPings);
+#define TX_RESULT_CONFIRMED 0x01 // Sent as a confirmed uplink
+#define TX_RESULT_ACKED     0x02 // The network acknowledged it
+#define TX_RESULT_HEARD     0x04 // A gateway heard it: ACK or downlink received
+// latencyMs holds LATENCY_STAGES deltas, see Latency.h
+void sendTxResult(uint8_t bleSeq, uint16_t error, uint32_t seq_no, uint8_t flags, uint8_t attempts, uint8_t sf,
+  const uint16_t latencyMs[]);
+void sendQueueStatus(uint8_t depth, uint8_t capacity, uint8_t policy, uint32_t overflows);
+void sendAirtimeStatus(uint32_t nextTxMs, uint32_t budgetRemainingMs, uint16_t lastAirtimeMs);
+void sendJoinStatus(uint8_t phase, uint16_t attempts, uint8_t sf, uint16_t devNonce, uint32_t waitMs, uint32_t elapsedMs);
+void sendDownlink(uint8_t const data[], uint8_t len, uint8_t port, int8_t rssi, int8_t snr, uint32_t fcnt);
+void sendLogMessage(const char *s); // Queued. Sent from loopBluetooth.
+void sendLogBytes(const uint8_t *bytes, uint16_t len); // Queued as one unit or dropped
+uint32_t logDroppedBytes();
+
+#define NV_USER_SIZE 248 // NVM bytes available to the functions below, between the magic number and the GATT layout hash
 
 bool writeNVInt(uint8_t offset, int32_t number);
 bool writeNVBytes(uint8_t offset, uint8_t *bytes, uint8_t length);
@@ -0,0 +1,347 @@
+#include <string.h>
+#include "ChannelPlan.h"
+#include "Airtime.h"
+#include "lmic.h"
+#include "Logging.h"
+#include "TokenLog.h"
+
+#define CHANNEL_HISTORY 32 // Outcomes per channel before old ones count half
+
+typedef struct {
+  uint8_t known; // Uplinks with a known outcome
+  uint8_t heard; // Of those, heard by the network
+} ChannelStats;
+
+#if defined(CFG_eu868)
+
+typedef struct {
+  uint32_t freq;
+  uint16_t drMap;
+  uint8_t band;
+} EuChannel;
+
+// The channels used by the Things Network, which correspond to the defaults
+// of most gateways. The first three are the LoRaWAN default channels.
+// TTN defines an additional channel at 869.525Mhz using SF9 for class B
+// devices' ping slots. LMIC does not have an easy way to define set this
+// frequency and support for class B is spotty and untested, so this
+// frequency is not configured here.
+static const EuChannel euChannels[] = {
+  { 868100000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI },      // g-band
+  { 868300000, DR_RANGE_MAP(DR_SF12, DR_SF7B), BAND_CENTI },      // g-band
+  { 868500000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI },      // g-band
+  { 867100000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI },      // g-band
+  { 867300000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI },      // g-band
+  { 867500000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI },      // g-band
+  { 867700000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI },      // g-band
+  { 867900000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI },      // g-band
+  { 868800000, DR_RANGE_MAP(DR_FSK,  DR_FSK),  BAND_MILLI },      // g2-band
+};
+
+typedef struct {
+  const char *name;
+  uint8_t channels;     // Leading entries of euChannels in use
+  uint8_t loraChannels; // Of those, the LoRa channels. Only these are steered.
+} ChannelPlanDef;
+
+static const ChannelPlanDef plans[] = {
+  { "TTN", 9, 8 },
+  { "LoRaWAN default", 3, 3 },
+};
+
+#define STEERED_CHANNELS 8
+#define PLAN_MAX_CHANNELS 16 // Bits in LMIC.channelMap
+
+#else
+
+#define SUB_BANDS 8
+#define SUB_BAND_CHANNELS 8
+
+typedef struct {
+  const char *name;
+  uint8_t subBands; // Bit n: sub-band n+1
+  bool hop;         // One sub-band per uplink, in turn. Otherwise all at once.
+} ChannelPlanDef;
+
+static const ChannelPlanDef plans[] = {
+  { "TTN sub-band 2", 0x02, false },
+  { "Hop sub-bands 1-8", 0xFF, true },
+  { "Hop sub-bands 1-2", 0x03, true },
+  { "Sub-bands 1-8", 0xFF, false },
+};
+
+#define STEERED_CHANNELS (SUB_BANDS * SUB_BAND_CHANNELS) // 125 kHz channels
+
+static uint8_t hopSubBand = 0;
+
+#endif
+
+static uint8_t current = 0;
+static ChannelStats stats[STEERED_CHANNELS];
+
+// Channels the plan and the network allow, laid out as LMIC.channelMap.
+// Hopping and steering only ever take channels out of it.
+static uint8_t allowed[sizeof(LMIC.channelMap)];
+// LMIC.channelMap as last set here. Anything else there came from a LinkADRReq.
+static uint8_t applied[sizeof(LMIC.channelMap)];
+
+uint8_t channelPlanCount() {
+  return sizeof(plans) / sizeof(*plans);
+}
+
+const char *channelPlanName(uint8_t index) {
+  return index<channelPlanCount() ? plans[index].name : NULL;
+}
+
+bool channelPlanSelect(uint8_t index) {
+  if (index>=channelPlanCount()) {
+    return false;
+  }
+  current = index;
+  TLOG_INFO("Channel plan %d: %s" CR, index, plans[index].name);
+  return true;
+}
+
+uint8_t channelPlanCurrent() {
+  return current;
+}
+
+// Delivery rate in 1/256. One imagined success and one failure start new channels at one half.
+static uint16_t rate(uint16_t heard, uint16_t known) {
+  return (uint32_t)(heard + 1) * 256 / (known + 2);
+}
+
+// Keeps a channel unless it is measured and delivers under half as well as the best
+static bool keep(uint16_t heard, uint16_t known, uint16_t best) {
+  return known<CHANNEL_STEER_MIN_OUTCOMES || rate(heard, known) * 2 >= best;
+}
+
+static bool isAllowed(uint8_t channel) {
+  return allowed[channel / 8] & (1 << (channel % 8));
+}
+
+static void setChannel(uint8_t channel, bool on) {
+  #if defined(CFG_eu868)
+  // LMIC_disableChannel would also forget the frequency
+  if (on) {
+    LMIC.channelMap |= (1 << channel);
+  }
+  else {
+    LMIC.channelMap &= ~(1 << channel);
+  }
+  #else
+  if (on) {
+    LMIC_enableChannel(channel);
+  }
+  else {
+    LMIC_disableChannel(channel);
+  }
+  #endif
+}
+
+// Takes up a channel mask the network set since the last uplink
+static void followNetwork() {
+  if (memcmp(&LMIC.channelMap, applied, sizeof(applied))!=0) {
+    memcpy(allowed, &LMIC.channelMap, sizeof(allowed));
+    TLOG_DEBUG("Channel mask set by the network" CR);
+  }
+}
+
+#if defined(CFG_eu868)
+
+static void applyPlan() {
+  const ChannelPlanDef *plan = &plans[current];
+  uint16_t best = 0;
+  for (uint8_t ch=0; ch<plan->loraChannels; ++ch) {
+    uint16_t r = rate(stats[ch].heard, stats[ch].known);
+    if (isAllowed(ch) && r>best) {
+      best = r;
+    }
+  }
+  bool any = false;
+  for (uint8_t ch=0; ch<PLAN_MAX_CHANNELS; ++ch) {
+    bool on = ch<plan->channels && isAllowed(ch);
+    if (on && ch<plan->loraChannels) {
+      on = keep(stats[ch].heard, stats[ch].known, best);
+      any = any || on;
+    }
+    setChannel(ch, on);
+  }
+  if (!any) {
+    // The network left none of the plan's channels. Its mask wins.
+    for (uint8_t ch=0; ch<PLAN_MAX_CHANNELS; ++ch) {
+      setChannel(ch, isAllowed(ch));
+    }
+  }
+  memcpy(applied, &LMIC.channelMap, sizeof(applied));
+
+  uint8_t bands = 0;
+  for (uint8_t ch=0; ch<plan->channels; ++ch) {
+    if ((LMIC.channelMap & (1 << ch)) && (euChannels[ch].drMap & (1 << LMIC.datarate))) {
+      bands |= (1 << euChannels[ch].band);
+    }
+  }
+  airtimeSetBandsInUse(bands);
+}
+
+uint8_t channelPlanBand(uint8_t channel) {
+  if (channel<sizeof(euChannels) / sizeof(*euChannels)) {
+    return euChannels[channel].band;
+  }
+  return BAND_CENTI; // A channel the network added. Taken to be in the g-band.
+}
+
+void channelPlanConfigure() {
+  const ChannelPlanDef *plan = &plans[current];
+  memset(allowed, 0, sizeof(allowed));
+  for (uint8_t ch=0; ch<plan->channels; ++ch) {
+    LMIC_setupChannel(ch, euChannels[ch].freq, euChannels[ch].drMap, euChannels[ch].band);
+    allowed[ch / 8] |= (1 << (ch % 8));
+  }
+  applyPlan();
+}
+
+void channelPlanBeforeTx() {
+  followNetwork();
+  applyPlan();
+}
+
+#else
+
+static bool subBandAllowed(uint8_t sb) {
+  for (uint8_t i=0; i<SUB_BAND_CHANNELS; ++i) {
+    if (isAllowed(sb*SUB_BAND_CHANNELS + i)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void subBandStats(uint8_t sb, uint16_t *heard, uint16_t *known) {
+  *heard = 0;
+  *known = 0;
+  for (uint8_t i=0; i<SUB_BAND_CHANNELS; ++i) {
+    *heard += stats[sb*SUB_BAND_CHANNELS + i].heard;
+    *known += stats[sb*SUB_BAND_CHANNELS + i].known;
+  }
+}
+
+// The plan's next sub-band in turn, passing over those that deliver under half as well as the best
+// and those the network masked out
+static uint8_t nextSubBand(uint8_t subBands) {
+  uint8_t usable = 0;
+  for (uint8_t sb=0; sb<SUB_BANDS; ++sb) {
+    if ((subBands & (1 << sb)) && subBandAllowed(sb)) {
+      usable |= (1 << sb);
+    }
+  }
+  if (usable!=0) {
+    subBands = usable;
+  }
+  uint16_t best = 0;
+  for (uint8_t sb=0; sb<SUB_BANDS; ++sb) {
+    uint16_t heard, known;
+    subBandStats(sb, &heard, &known);
+    uint16_t r = rate(heard, known);
+    if ((subBands & (1 << sb)) && r>best) {
+      best = r;
+    }
+  }
+  for (uint8_t step=1; step<=SUB_BANDS; ++step) {
+    uint8_t sb = (hopSubBand + step) % SUB_BANDS;
+    uint16_t heard, known;
+    subBandStats(sb, &heard, &known);
+    if ((subBands & (1 << sb)) && keep(heard, known, best)) {
+      return sb;
+    }
+  }
+  return hopSubBand;
+}
+
+static bool subBandActive(const ChannelPlanDef *plan, uint8_t sb) {
+  return (plan->subBands & (1 << sb)) && (!plan->hop || sb==hopSubBand);
+}
+
+static void applyPlan() {
+  const ChannelPlanDef *plan = &plans[current];
+  uint16_t best = 0;
+  for (uint8_t ch=0; ch<STEERED_CHANNELS; ++ch) {
+    uint16_t r = rate(stats[ch].heard, stats[ch].known);
+    if (subBandActive(plan, ch / SUB_BAND_CHANNELS) && isAllowed(ch) && r>best) {
+      best = r;
+    }
+  }
+  bool any = false;
+  for (uint8_t sb=0; sb<SUB_BANDS; ++sb) {
+    bool active = subBandActive(plan, sb);
+    for (uint8_t i=0; i<SUB_BAND_CHANNELS; ++i) {
+      uint8_t ch = sb*SUB_BAND_CHANNELS + i;
+      bool on = active && isAllowed(ch) && keep(stats[ch].heard, stats[ch].known, best);
+      setChannel(ch, on);
+      any = any || on;
+    }
+    // The sub-band's 500 kHz channel
+    setChannel(STEERED_CHANNELS + sb, active && isAllowed(STEERED_CHANNELS + sb));
+  }
+  if (!any) {
+    // The network left none of the plan's channels. Its mask wins.
+    for (uint8_t ch=0; ch<STEERED_CHANNELS + SUB_BANDS; ++ch) {
+      setChannel(ch, isAllowed(ch));
+    }
+  }
+  memcpy(applied, &LMIC.channelMap, sizeof(applied));
+}
+
+void channelPlanConfigure() {
+  const ChannelPlanDef *plan = &plans[current];
+  memset(allowed, 0, sizeof(allowed));
+  for (uint8_t sb=0; sb<SUB_BANDS; ++sb) {
+    if (plan->subBands & (1 << sb)) {
+      allowed[sb] = 0xFF; // Its 8 x 125 kHz channels
+      allowed[(STEERED_CHANNELS + sb) / 8] |= (1 << ((STEERED_CHANNELS + sb) % 8));
+    }
+  }
+  if (plan->hop && !(plan->subBands & (1 << hopSubBand))) {
+    hopSubBand = nextSubBand(plan->subBands);
+  }
+  applyPlan();
+}
+
+void channelPlanBeforeTx() {
+  const ChannelPlanDef *plan = &plans[current];
+  followNetwork();
+  if (plan->hop) {
+    hopSubBand = nextSubBand(plan->subBands);
+  }
+  applyPlan();
+}
+
+uint8_t channelPlanBand(uint8_t channel) {
+  return 0;
+}
+
+#endif
+
+void channelPlanGetMask(uint8_t mask[]) {
+  memcpy(mask, allowed, sizeof(allowed));
+}
+
+void channelPlanRestoreMask(const uint8_t mask[]) {
+  memcpy(allowed, mask, sizeof(allowed));
+  applyPlan();
+}
+
+void channelPlanRecord(uint8_t channel, bool known, bool heard) {
+  if (channel>=STEERED_CHANNELS || !known) {
+    return;
+  }
+  ChannelStats *s = &stats[channel];
+  if (s->known>=CHANNEL_HISTORY) {
+    s->known /= 2;
+    s->heard /= 2;
+  }
+  ++s->known;
+  if (heard) {
+    ++s->heard;
+  }
+}
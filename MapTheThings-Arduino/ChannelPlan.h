@@ -0,0 +1,40 @@
+#include <stdint.h>
+
+/*
+ Channel plans and channel steering.
+
+ LMIC is built for one region, so only the plans of that region are
+ compiled in. The plan is picked at runtime by index:
+ - US915: a set of sub-bands (8 x 125 kHz channels each), used together or
+   hopped one sub-band per uplink. Plan 0 is sub-band 2, which TTN uses.
+ - EU868: plan 0 is the TTN channel list, plan 1 the three LoRaWAN default
+   channels only.
+
+ Each channel counts uplinks with a known outcome and those heard by the
+ network. Before an uplink, channels delivering under half as well as the
+ best one in the plan are masked out, so LMIC picks busy channels less.
+ Channels with fewer than CHANNEL_STEER_MIN_OUTCOMES outcomes always stay in.
+
+ Selecting a plan enables all of its channels. After that, a channel mask
+ the network sets in a LinkADRReq is kept: hopping and steering only pick
+ among the plan's channels the network allows. If it allows none of them,
+ the network's mask is used as is.
+
+ In EU868 the plan also tells Airtime which duty cycle bands the next uplink
+ may go on: those with an enabled channel that takes the current data rate.
+*/
+#define CHANNEL_STEER_MIN_OUTCOMES 8
+
+uint8_t channelPlanCount(void);
+const char *channelPlanName(uint8_t index);
+bool channelPlanSelect(uint8_t index); // False if there is no such plan. Takes effect at channelPlanConfigure.
+uint8_t channelPlanCurrent(void);
+
+void channelPlanConfigure(void); // Sets up the plan's channels. Call after LMIC_reset or LMIC_setSession.
+void channelPlanBeforeTx(void);  // Hops and steers: picks the channels LMIC may use for the next uplink
+// Channels the plan and the network allow, as sizeof(LMIC.channelMap) bytes. For saving with the session.
+void channelPlanGetMask(uint8_t mask[]);
+void channelPlanRestoreMask(const uint8_t mask[]);
+uint8_t channelPlanBand(uint8_t channel); // LMIC duty cycle band of the channel. 0 in US915.
+// Outcome of an uplink on channel. known=false when nothing was heard back from an unconfirmed uplink.
+void channelPlanRecord(uint8_t channel, bool known, bool heard);
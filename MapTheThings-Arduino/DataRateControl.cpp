@@ -0,0 +1,112 @@
+#include "DataRateControl.h"
+#include "Airtime.h"
+
+#define HISTORY_SIZE 16 // Bits in history
+#define SNR_FRESH_UPLINKS 8 // Downlink SNR is trusted for this many uplinks
+
+static uint8_t minSf = 7;
+static uint8_t maxSf = 10;
+static uint32_t bandwidth = 125000;
+
+static uint16_t history = 0;    // Bit per known outcome, 1 = delivered, newest in bit 0
+static uint8_t outcomes = 0;    // Number of valid bits in history
+
+static int8_t lastSnr = 0;
+static uint8_t snrAge = SNR_FRESH_UPLINKS; // Uplinks since lastSnr was measured
+
+static uint32_t lastTxMs = 0;
+static uint32_t txIntervalMs = 0; // Smoothed time between uplinks
+static uint8_t lastPayloadLen = 0;
+
+// Demodulation SNR floor per SF, SF7 to SF12
+static const int8_t requiredSnrDb[] = { -7, -10, -12, -15, -17, -20 };
+
+void drcInit(uint8_t min, uint8_t max, uint32_t bwHz) {
+  minSf = min;
+  maxSf = max;
+  bandwidth = bwHz;
+  history = 0;
+  outcomes = 0;
+  snrAge = SNR_FRESH_UPLINKS;
+}
+
+void drcRecordTx(uint32_t nowMs, uint8_t payloadLen, bool known, bool delivered) {
+  if (lastTxMs!=0) {
+    uint32_t interval = nowMs - lastTxMs;
+    // Exponential moving average, weight 1/4
+    txIntervalMs = txIntervalMs==0 ? interval : (3*txIntervalMs + interval) / 4;
+  }
+  lastTxMs = nowMs;
+  lastPayloadLen = payloadLen;
+
+  if (snrAge<SNR_FRESH_UPLINKS) {
+    ++snrAge;
+  }
+  if (known) {
+    history = (history << 1) | (delivered ? 1 : 0);
+    if (outcomes<HISTORY_SIZE) {
+      ++outcomes;
+    }
+  }
+}
+
+void drcRecordDownlink(int8_t snrDb, int16_t rssi) {
+  (void)rssi; // SNR is what decides demodulation. RSSI kept in the interface for future use.
+  lastSnr = snrDb;
+  snrAge = 0;
+}
+
+static uint8_t deliveredPercent() {
+  uint8_t delivered = 0;
+  for (uint8_t i=0; i<outcomes; ++i) {
+    delivered += (history >> i) & 1;
+  }
+  return (uint16_t)100 * delivered / outcomes;
+}
+
+// True if uplinks at this SF, at the current rate, stay within the airtime limits
+static bool fitsDutyCycle(uint8_t sf) {
+  if (txIntervalMs==0) {
+    return true; // No rate estimate yet
+  }
+  uint32_t airtimeMs = airtimeUs(sf, bandwidth, lastPayloadLen) / 1000;
+  return airtimeSustainable(lastTxMs, airtimeMs, txIntervalMs);
+}
+
+static void resetHistory() {
+  history = 0;
+  outcomes = 0;
+}
+
+uint8_t drcChooseSf(uint8_t sf) {
+  bool haveRate = outcomes>=DRC_MIN_OUTCOMES;
+  if (haveRate && deliveredPercent()<DRC_TARGET_PERCENT) {
+    if (sf<maxSf) {
+      resetHistory(); // Judge the new SF on its own outcomes
+      return sf + 1;
+    }
+    return sf;
+  }
+
+  if (snrAge<SNR_FRESH_UPLINKS) {
+    // Lowest SF with enough link margin
+    uint8_t best = minSf;
+    while (best<maxSf && lastSnr - requiredSnrDb[best-7] < DRC_SNR_MARGIN_DB) {
+      ++best;
+    }
+    if (best<sf) {
+      resetHistory();
+      return sf - 1;
+    }
+    if (best>sf && sf<maxSf && fitsDutyCycle(sf + 1)) {
+      resetHistory();
+      return sf + 1;
+    }
+  }
+  else if (!fitsDutyCycle(sf) && sf>minSf && (!haveRate || deliveredPercent()>=DRC_TARGET_PERCENT)) {
+    // Over budget and delivery is fine: trade margin for airtime
+    resetHistory();
+    return sf - 1;
+  }
+  return sf;
+}
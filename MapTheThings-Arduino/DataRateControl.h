@@ -0,0 +1,28 @@
+#include <stdint.h>
+
+/*
+ On-device spreading factor controller.
+
+ Picks the lowest SF that keeps the delivery rate of recent uplinks above
+ DRC_TARGET_PERCENT, using two kinds of evidence:
+ - Outcomes of uplinks whose delivery is known (acknowledged, or followed by
+   a downlink, or timed out).
+ - SNR of received downlinks, compared with the demodulation floor of each SF
+   plus DRC_SNR_MARGIN_DB.
+ SF only moves one step per decision. A step up for link margin is skipped
+ if its airtime at the current uplink rate would not be sustainable, as
+ airtimeSustainable() judges from the region's duty cycle and the daily budget
+ left. When over that limit with good delivery, SF steps down to save airtime.
+*/
+#define DRC_TARGET_PERCENT 90
+#define DRC_SNR_MARGIN_DB 10
+#define DRC_MIN_OUTCOMES 4   // Known outcomes needed before delivery rate counts
+
+void drcInit(uint8_t minSf, uint8_t maxSf, uint32_t bwHz);
+
+// Delivery outcome of an uplink. known=false when nothing was heard back from an unconfirmed uplink.
+void drcRecordTx(uint32_t nowMs, uint8_t payloadLen, bool known, bool delivered);
+void drcRecordDownlink(int8_t snrDb, int16_t rssi);
+
+// Returns the SF to use for the next uplink
+uint8_t drcChooseSf(uint8_t currentSf);
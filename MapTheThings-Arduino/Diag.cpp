@@ -0,0 +1,114 @@
+#include "Diag.h"
+
+#if defined(DIAGNOSTICS)
+
+#include <string.h>
+
+#define DIAG_FORMAT_V1 0x01
+
+typedef struct {
+  uint32_t count;
+  uint32_t totalUs;
+  uint32_t maxUs;
+  uint32_t spanStartUs;
+  bool spanOpen;
+  uint16_t buckets[DIAG_BUCKETS];
+} ProbeStats;
+
+static ProbeStats probes[DIAG_PROBE_COUNT];
+static uint32_t counters[DIAG_COUNTER_COUNT];
+
+static const char * const probeNames[DIAG_PROBE_COUNT] = {
+  "loopBluetooth", "os_runloop_once", "gattCallback", "AT TX result",
+  "AT battery level", "AT writeNVBytes", "TX write->start", "TX start->complete",
+};
+static const char * const counterNames[DIAG_COUNTER_COUNT] = {
+  "BLE IRQs", "BLE polls", "GATT writes", "TX timeouts",
+};
+
+void diagRecord(DiagProbe probe, uint32_t us) {
+  ProbeStats *p = &probes[probe];
+  ++p->count;
+  p->totalUs += us;
+  if (us>p->maxUs) {
+    p->maxUs = us;
+  }
+  uint8_t bucket = us ? 31 - __builtin_clz(us) : 0;
+  if (bucket>=DIAG_BUCKETS) {
+    bucket = DIAG_BUCKETS - 1;
+  }
+  if (p->buckets[bucket]!=0xFFFF) {
+    ++p->buckets[bucket];
+  }
+}
+
+void diagSpanBegin(DiagProbe probe, uint32_t startUs) {
+  probes[probe].spanStartUs = startUs;
+  probes[probe].spanOpen = true;
+}
+
+void diagSpanEnd(DiagProbe probe) {
+  ProbeStats *p = &probes[probe];
+  if (p->spanOpen) {
+    p->spanOpen = false;
+    diagRecord(probe, micros() - p->spanStartUs);
+  }
+}
+
+void diagCount(DiagCounter counter) {
+  ++counters[counter];
+}
+
+uint8_t diagPage(uint8_t probe, uint8_t page, uint8_t buffer[20]) {
+  buffer[0] = DIAG_FORMAT_V1;
+  buffer[1] = probe;
+  buffer[2] = page;
+  if (probe==DIAG_COUNTERS_PROBE && page==0) {
+    memcpy(&buffer[3], counters, sizeof(counters));
+    return 3 + sizeof(counters);
+  }
+  if (probe>=DIAG_PROBE_COUNT) {
+    return 0;
+  }
+  ProbeStats *p = &probes[probe];
+  if (page==0) {
+    memcpy(&buffer[3], &p->count, sizeof(p->count));
+    memcpy(&buffer[7], &p->maxUs, sizeof(p->maxUs));
+    memcpy(&buffer[11], &p->totalUs, sizeof(p->totalUs));
+    return 15;
+  }
+  uint8_t first = (page - 1) * DIAG_PAGE_BUCKETS;
+  if (first>=DIAG_BUCKETS) {
+    return 0;
+  }
+  memcpy(&buffer[3], &p->buckets[first], DIAG_PAGE_BUCKETS * sizeof(uint16_t));
+  return 3 + DIAG_PAGE_BUCKETS * sizeof(uint16_t);
+}
+
+// Plain Serial output, so the dump does not itself go through the instrumented BLE log path
+void diagDump() {
+  Serial.println("Diagnostics: probe count max_us avg_us | log2 us buckets");
+  for (int i=0; i<DIAG_PROBE_COUNT; ++i) {
+    ProbeStats *p = &probes[i];
+    Serial.print(probeNames[i]);
+    Serial.print(' ');
+    Serial.print(p->count);
+    Serial.print(' ');
+    Serial.print(p->maxUs);
+    Serial.print(' ');
+    Serial.print(p->count ? p->totalUs / p->count : 0);
+    Serial.print(" |");
+    for (int b=0; b<DIAG_BUCKETS; ++b) {
+      Serial.print(' ');
+      Serial.print(p->buckets[b]);
+    }
+    Serial.println();
+  }
+  for (int i=0; i<DIAG_COUNTER_COUNT; ++i) {
+    Serial.print(counterNames[i]);
+    Serial.print(' ');
+    Serial.println(counters[i]);
+  }
+}
+
+#endif
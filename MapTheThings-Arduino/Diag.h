@@ -0,0 +1,74 @@
+#include <stdint.h>
+
+/*
+ Hot path instrumentation. Build with -DDIAGNOSTICS to enable. Without it,
+ every DIAG_* macro expands to nothing and no RAM, flash or GATT
+ characteristic is used.
+
+ Each probe keeps a count, total, maximum and a log2 histogram of durations
+ in microseconds: bucket i counts durations in [2^i, 2^(i+1)) us, with bucket 0
+ also taking 0 us. Bucket counts saturate at 0xFFFF. SAMD21's Cortex-M0+ has
+ no DWT cycle counter, so durations come from micros(), which reads SysTick.
+
+ DIAG_BEGIN/DIAG_END time a block in one function. DIAG_SPAN_BEGIN_AT and
+ DIAG_SPAN_END time an interval that starts in one place and ends in another.
+ Only one span per probe can be open at a time.
+
+ Results are dumped over Serial with diagDump() and read over BLE from the
+ Diagnostics service. A write of [probe][page] to the Diagnostics
+ characteristic selects what a following read returns:
+   page 0       8bit format, probe, page, 32bit count, 32bit max us, 32bit total us
+   pages 1..3   8bit format, probe, page, 8 x 16bit buckets starting at (page-1)*8
+   probe 0xFF   8bit format, 0xFF, 0, DIAG_COUNTER_COUNT x 32bit counters
+*/
+typedef enum DiagProbeEnum {
+  DiagLoopBluetooth,     // loopBluetooth()
+  DiagLmicRunloop,       // os_runloop_once()
+  DiagGattCallback,      // Characteristic write handling
+  DiagAtTxResult,        // TX result AT round trip, when drained from the outbound queue
+  DiagAtBattery,         // Battery level AT round trip, when drained from the outbound queue
+  DiagAtNvWrite,         // writeNVBytes() AT round trips
+  DiagTxWriteToStart,    // Packet written over BLE until EV_TXSTART
+  DiagTxStartToComplete, // EV_TXSTART until EV_TXCOMPLETE, RX windows included
+  DIAG_PROBE_COUNT
+} DiagProbe;
+
+typedef enum DiagCounterEnum {
+  DiagBleIrqs,
+  DiagBlePolls,
+  DiagGattWrites,
+  DiagTxTimeouts,
+  DIAG_COUNTER_COUNT
+} DiagCounter;
+
+#define DIAG_BUCKETS 24 // Up to 2^24 us, about 16 s
+#define DIAG_PAGE_BUCKETS 8
+#define DIAG_COUNTERS_PROBE 0xFF
+
+#if defined(DIAGNOSTICS)
+
+#include <Arduino.h>
+
+void diagRecord(DiagProbe probe, uint32_t us);
+void diagSpanBegin(DiagProbe probe, uint32_t startUs);
+void diagSpanEnd(DiagProbe probe);
+void diagCount(DiagCounter counter);
+// Fills buffer with the page described above. Returns its length, or 0 for an unknown probe or page.
+uint8_t diagPage(uint8_t probe, uint8_t page, uint8_t buffer[20]);
+void diagDump();
+
+#define DIAG_BEGIN(probe) uint32_t diagStart##probe = micros()
+#define DIAG_END(probe) diagRecord(probe, micros() - diagStart##probe)
+#define DIAG_SPAN_BEGIN_AT(probe, startUs) diagSpanBegin(probe, startUs)
+#define DIAG_SPAN_END(probe) diagSpanEnd(probe)
+#define DIAG_COUNT(counter) diagCount(counter)
+
+#else
+
+#define DIAG_BEGIN(probe) do {} while (0)
+#define DIAG_END(probe) do {} while (0)
+#define DIAG_SPAN_BEGIN_AT(probe, startUs) do {} while (0)
+#define DIAG_SPAN_END(probe) do {} while (0)
+#define DIAG_COUNT(counter) do {} while (0)
+
+#endif
@@ -0,0 +1,133 @@
+#include <string.h>
+#include "Flash.h"
+
+#define FLASH_SIZE ((uint32_t)FLASH_ROWS * FLASH_ROW_SIZE)
+
+#if defined(FLASH_FILE)
+
+#include <stdio.h>
+
+static FILE *file = NULL;
+
+bool flashInit() {
+  file = fopen(FLASH_FILE, "r+b");
+  if (file==NULL) {
+    // A new area reads as erased
+    file = fopen(FLASH_FILE, "w+b");
+    if (file==NULL) {
+      return false;
+    }
+    for (uint32_t row=0; row<FLASH_ROWS; ++row) {
+      flashEraseRow(row * FLASH_ROW_SIZE);
+    }
+  }
+  return true;
+}
+
+void flashRead(uint32_t offset, void *data, uint16_t len) {
+  fseek(file, offset, SEEK_SET);
+  if (fread(data, 1, len, file)!=len) {
+    memset(data, 0xFF, len);
+  }
+}
+
+bool flashWrite(uint32_t offset, const void *data, uint16_t len) {
+  if ((offset | len) & 3 || offset + len > FLASH_SIZE) {
+    return false;
+  }
+  uint8_t current[FLASH_ROW_SIZE];
+  const uint8_t *bytes = (const uint8_t *)data;
+  while (len) {
+    uint16_t chunk = len<sizeof(current) ? len : sizeof(current);
+    flashRead(offset, current, chunk);
+    for (uint16_t i=0; i<chunk; ++i) {
+      current[i] &= bytes[i]; // Programming only clears bits
+    }
+    fseek(file, offset, SEEK_SET);
+    fwrite(current, 1, chunk, file);
+    offset += chunk;
+    bytes += chunk;
+    len -= chunk;
+  }
+  fflush(file);
+  return true;
+}
+
+bool flashEraseRow(uint32_t offset) {
+  uint8_t erased[FLASH_ROW_SIZE];
+  memset(erased, 0xFF, sizeof(erased));
+  fseek(file, offset - offset % FLASH_ROW_SIZE, SEEK_SET);
+  fwrite(erased, 1, sizeof(erased), file);
+  fflush(file);
+  return true;
+}
+
+#else
+
+#include <Arduino.h>
+
+#define FLASH_PAGE_SIZE 64
+
+// Uploads program this area to zeros. The backlog erases rows before use.
+// Volatile, so the compiler never folds reads to the initializer.
+__attribute__((__aligned__(FLASH_ROW_SIZE)))
+static const volatile uint8_t area[FLASH_SIZE] = { 0 };
+
+static uintptr_t areaAddress(uint32_t offset) {
+  return (uintptr_t)&area[offset];
+}
+
+static void nvmCommand(uint16_t command) {
+  NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMDEX_KEY | command;
+  while (!NVMCTRL->INTFLAG.bit.READY) {
+  }
+}
+
+bool flashInit() {
+  // Page writes only on command, so a partly filled page buffer programs just those words
+  NVMCTRL->CTRLB.bit.MANW = 1;
+  return true;
+}
+
+void flashRead(uint32_t offset, void *data, uint16_t len) {
+  uint8_t *bytes = (uint8_t *)data;
+  for (uint16_t i=0; i<len; ++i) {
+    bytes[i] = area[offset + i];
+  }
+}
+
+bool flashWrite(uint32_t offset, const void *data, uint16_t len) {
+  if ((offset | len) & 3 || offset + len > FLASH_SIZE) {
+    return false;
+  }
+  const uint8_t *bytes = (const uint8_t *)data;
+  while (len) {
+    uint16_t chunk = FLASH_PAGE_SIZE - offset % FLASH_PAGE_SIZE;
+    if (chunk>len) {
+      chunk = len;
+    }
+    nvmCommand(NVMCTRL_CTRLA_CMD_PBC); // Page buffer back to all ones
+    volatile uint32_t *dst = (volatile uint32_t *)areaAddress(offset);
+    for (uint16_t i=0; i<chunk; i+=4) {
+      uint32_t word;
+      memcpy(&word, &bytes[i], sizeof(word));
+      *dst++ = word; // Sets ADDR to the page being written
+    }
+    nvmCommand(NVMCTRL_CTRLA_CMD_WP);
+    offset += chunk;
+    bytes += chunk;
+    len -= chunk;
+  }
+  return true;
+}
+
+bool flashEraseRow(uint32_t offset) {
+  if (offset>=FLASH_SIZE) {
+    return false;
+  }
+  NVMCTRL->ADDR.reg = (uint32_t)areaAddress(offset - offset % FLASH_ROW_SIZE) / 2; // 16 bit word address
+  nvmCommand(NVMCTRL_CTRLA_CMD_ER);
+  return true;
+}
+
+#endif
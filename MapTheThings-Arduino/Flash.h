@@ -0,0 +1,23 @@
+#include <stdint.h>
+
+/*
+ Spare internal flash for the uplink backlog.
+
+ FLASH_ROWS rows are reserved as a row aligned constant array, so the linker
+ keeps sketch code out of them. Offsets below are relative to that area.
+ Rows are the erase unit. Writes only move bits from 1 to 0, so a location
+ can be written again to clear more bits (record states rely on this).
+ The SAMD21 NVM has no ECC, which is what makes that safe.
+
+ Build with FLASH_FILE defined as a path, e.g. -DFLASH_FILE='"flash.bin"',
+ to keep the area in a file instead. That runs the backlog on a host with the
+ same bit semantics.
+*/
+#define FLASH_ROW_SIZE 256 // SAMD21: 4 pages of 64 bytes
+#define FLASH_ROWS 64      // 16 KB
+
+bool flashInit(void);
+void flashRead(uint32_t offset, void *data, uint16_t len);
+// offset and len must be multiples of 4
+bool flashWrite(uint32_t offset, const void *data, uint16_t len);
+bool flashEraseRow(uint32_t offset); // Erases the row holding offset to 0xFF
@@ -0,0 +1,60 @@
+#include <string.h>
+#include "Fragment.h"
+#include "TokenLog.h"
+
+static FragmentPayload payload;
+static bool active = false;
+static uint8_t nextIndex = 0;
+static uint32_t startMs = 0;
+static uint32_t lastMs = 0;
+
+FragmentStatus fragmentReceive(uint8_t const fragment[], uint16_t len, uint32_t nowMs) {
+  if (len<FRAGMENT_HEADER_SIZE) {
+    return FragmentOutOfOrder;
+  }
+  uint8_t bleSeq = fragment[0];
+  uint8_t index = fragment[1] & FRAGMENT_INDEX_MASK;
+  uint16_t dataLen = len - FRAGMENT_HEADER_SIZE;
+
+  if (index==0) {
+    active = true;
+    nextIndex = 0;
+    startMs = nowMs;
+    payload.bleSeq = bleSeq;
+    payload.priority = fragment[1] & FRAGMENT_PRIORITY;
+    payload.len = 0;
+  }
+  else if (!active || bleSeq!=payload.bleSeq || index!=nextIndex) {
+    active = false;
+    payload.bleSeq = bleSeq;
+    return FragmentOutOfOrder;
+  }
+
+  if (payload.len + dataLen > MAX_LEN_PAYLOAD) {
+    active = false;
+    return FragmentTooLong;
+  }
+  memcpy(&payload.data[payload.len], &fragment[FRAGMENT_HEADER_SIZE], dataLen);
+  payload.len += dataLen;
+  ++nextIndex;
+  lastMs = nowMs;
+
+  if (fragment[1] & FRAGMENT_LAST) {
+    active = false;
+    TLOG_DEBUG("Reassembled %d bytes from %d fragments in %d ms" CR, payload.len, nextIndex, nowMs - startMs);
+    return FragmentComplete;
+  }
+  return FragmentPending;
+}
+
+FragmentStatus fragmentCheckTimeout(uint32_t nowMs) {
+  if (active && nowMs - lastMs > FRAGMENT_TIMEOUT_MS) {
+    active = false;
+    return FragmentTimedOut;
+  }
+  return FragmentPending;
+}
+
+FragmentPayload *fragmentPayload() {
+  return &payload;
+}
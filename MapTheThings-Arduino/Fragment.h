@@ -0,0 +1,42 @@
+#include <stdint.h>
+#include "lmic.h"
+
+/*
+ Reassembly of uplink payloads too long for one GATT write.
+
+ Each write to the Send fragment characteristic:
+   [0]     ble seq, the same for all fragments of one payload
+   [1]     bit 7 last fragment, bit 6 priority, bits 5..0 fragment index from 0
+   [2..]   up to 18 bytes of payload
+ Fragments must arrive in order. Index 0 starts a new payload and abandons any
+ unfinished one. A payload is abandoned if its next fragment does not arrive
+ within FRAGMENT_TIMEOUT_MS. One payload is reassembled at a time, in a static
+ buffer of MAX_LEN_PAYLOAD bytes.
+*/
+#define FRAGMENT_HEADER_SIZE 2
+#define FRAGMENT_LAST 0x80
+#define FRAGMENT_PRIORITY 0x40
+#define FRAGMENT_INDEX_MASK 0x3F
+#define FRAGMENT_TIMEOUT_MS 2000
+
+typedef enum FragmentStatusEnum {
+  FragmentPending,     // Waiting for more fragments
+  FragmentComplete,    // Payload available from fragmentPayload
+  FragmentOutOfOrder,  // Unexpected index. Payload dropped.
+  FragmentTooLong,     // Payload would exceed MAX_LEN_PAYLOAD. Payload dropped.
+  FragmentTimedOut,    // Next fragment did not arrive in time. Payload dropped.
+  FragmentOverRate,    // Complete, but longer than the current data rate allows. Payload dropped.
+} FragmentStatus;
+
+typedef struct {
+  uint8_t bleSeq;
+  bool priority;
+  uint8_t len;
+  uint8_t data[MAX_LEN_PAYLOAD];
+} FragmentPayload;
+
+FragmentStatus fragmentReceive(uint8_t const fragment[], uint16_t len, uint32_t nowMs);
+// Returns FragmentTimedOut once for an abandoned payload, else FragmentPending
+FragmentStatus fragmentCheckTimeout(uint32_t nowMs);
+// Payload being reassembled, or just completed
+FragmentPayload *fragmentPayload();
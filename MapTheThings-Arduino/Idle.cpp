@@ -0,0 +1,56 @@
+#include <Arduino.h>
+#include "Idle.h"
+#include "TokenLog.h"
+
+static volatile bool wake = false;
+
+static uint32_t periodStartMs = 0;
+static uint32_t periodSleptMs = 0;
+static uint16_t activePermille = 1000;
+static bool reported = false;
+
+static uint16_t permilleAwake(uint32_t sleptMs, uint32_t elapsedMs) {
+  if (elapsedMs==0) {
+    return 1000;
+  }
+  return 1000 - (uint64_t)sleptMs * 1000 / elapsedMs;
+}
+
+static void updateReport(uint32_t nowMs) {
+  uint32_t elapsed = nowMs - periodStartMs;
+  if (elapsed<IDLE_REPORT_INTERVAL_MS) {
+    return;
+  }
+  activePermille = permilleAwake(periodSleptMs, elapsed);
+  reported = true;
+  TLOG_INFO("Awake %d permille of the last %d s" CR, activePermille, elapsed / 1000);
+  periodStartMs = nowMs;
+  periodSleptMs = 0;
+}
+
+void idleSleep(uint32_t ms) {
+  uint32_t start = millis();
+  if (ms) {
+    wake = false;
+    uint32_t slept;
+    while (!wake && (slept = millis() - start)<ms) {
+      #if defined(IDLE_VIRTUAL_CLOCK)
+        idleVirtualAdvance(ms - slept);
+      #else
+        SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk; // IDLE, not STANDBY: clocks for SysTick keep running
+        __DSB();
+        __WFI();
+      #endif
+    }
+    periodSleptMs += millis() - start;
+  }
+  updateReport(millis());
+}
+
+void idleWake() {
+  wake = true;
+}
+
+uint16_t idleActivePermille() {
+  return reported ? activePermille : permilleAwake(periodSleptMs, millis());
+}
@@ -0,0 +1,32 @@
+#include <stdint.h>
+
+/*
+ Idle sleep between pieces of work.
+
+ loop() asks each module how long it can wait (LMIC jobs, BLE polling and log
+ drain, battery sampling, held uplinks) and sleeps for the shortest of these.
+ The MCU sleeps in IDLE mode with WFI. The SysTick interrupt keeps millis()
+ and LMIC time running, and any interrupt (BLE IRQ, USB) ends the sleep early.
+ idleWake() from an ISR ends the whole sleep, not just the current WFI.
+
+ Build with IDLE_VIRTUAL_CLOCK to run on a host. Sleeping then calls
+ idleVirtualAdvance(), which the host build implements by moving its
+ millis()/micros() clock forward. No real waiting happens.
+
+ Every IDLE_REPORT_INTERVAL_MS the share of time spent awake is logged. It is
+ also available from idleActivePermille(). test/test_survey reads it over a
+ simulated hour of surveying. The awake time there comes from the simulator's
+ fixed costs, not from hardware.
+*/
+#define IDLE_MAX_SLEEP_MS 250 // Caps latency for work nobody announced, e.g. jobs LMIC posts for itself
+#define IDLE_REPORT_INTERVAL_MS 3600000UL
+
+#if defined(IDLE_VIRTUAL_CLOCK)
+void idleVirtualAdvance(uint32_t ms);
+#endif
+
+void idleSleep(uint32_t ms);
+void idleWake(); // Safe from interrupt handlers
+
+// Awake time per thousand over the last completed report interval, or since boot before that
+uint16_t idleActivePermille();
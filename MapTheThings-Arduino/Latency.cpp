@@ -0,0 +1,57 @@
+#include <string.h>
+#include "Latency.h"
+
+static ostime_t lastGattWrite = 0;
+
+static uint16_t window[LATENCY_STAGES][LATENCY_WINDOW];
+static uint8_t next = 0;  // Slot for the next uplink, same for all stages
+static uint8_t count = 0;
+
+void latencyMarkGattWrite() {
+  lastGattWrite = os_getTime();
+}
+
+ostime_t latencyLastGattWrite() {
+  return lastGattWrite;
+}
+
+uint16_t latencyDeltaMs(ostime_t from, ostime_t to) {
+  ostime_t ticks = to - from;
+  if (ticks<0) {
+    return 0;
+  }
+  uint32_t ms = osticks2ms(ticks);
+  return ms<0xFFFF ? ms : 0xFFFF;
+}
+
+void latencyRecord(const uint16_t deltasMs[LATENCY_STAGES]) {
+  for (uint8_t stage=0; stage<LATENCY_STAGES; ++stage) {
+    window[stage][next] = deltasMs[stage];
+  }
+  next = (next + 1) % LATENCY_WINDOW;
+  if (count<LATENCY_WINDOW) {
+    ++count;
+  }
+}
+
+// Sorts a copy of the window. Insertion sort: 32 entries, on request only.
+void latencySummary(LatencyStage stage, LatencySummary *summary) {
+  uint16_t sorted[LATENCY_WINDOW];
+  for (uint8_t i=0; i<count; ++i) {
+    uint16_t v = window[stage][i];
+    uint8_t j = i;
+    while (j>0 && sorted[j-1]>v) {
+      sorted[j] = sorted[j-1];
+      --j;
+    }
+    sorted[j] = v;
+  }
+  summary->count = count;
+  if (count==0) {
+    summary->minMs = summary->medianMs = summary->p95Ms = 0;
+    return;
+  }
+  summary->minMs = sorted[0];
+  summary->medianMs = sorted[(count - 1) / 2];
+  summary->p95Ms = sorted[(count - 1) * 95 / 100];
+}
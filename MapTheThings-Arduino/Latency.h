@@ -0,0 +1,36 @@
+#include <stdint.h>
+#include "lmic.h"
+
+/*
+ Uplink latency tracing.
+
+ Each packet is stamped with os_getTime() at gattCallback, enqueuePacket,
+ LMIC_setTxData2, its first EV_TXSTART, EV_TXCOMPLETE and sendTxResult.
+ The deltas between stamps are the stages below. They go out with the TX
+ result and into a rolling window of the last LATENCY_WINDOW uplinks per
+ stage, summarized as min, median and 95th percentile.
+*/
+#define LATENCY_WINDOW 32
+
+typedef enum LatencyStageEnum {
+  LatencyBle,     // gattCallback to enqueuePacket: parsing, fragment reassembly
+  LatencyQueue,   // enqueuePacket to LMIC_setTxData2: waiting in TxQueue, aggregation hold
+  LatencyLmic,    // LMIC_setTxData2 to first EV_TXSTART: duty cycle, LMIC scheduling
+  LatencyRadio,   // First EV_TXSTART to EV_TXCOMPLETE: airtime, RX windows, retries
+  LatencyResult,  // EV_TXCOMPLETE to sendTxResult
+  LATENCY_STAGES
+} LatencyStage;
+
+typedef struct {
+  uint8_t count; // Uplinks in the window
+  uint16_t minMs;
+  uint16_t medianMs;
+  uint16_t p95Ms;
+} LatencySummary;
+
+void latencyMarkGattWrite(void);     // Called by gattCallback
+ostime_t latencyLastGattWrite(void); // Stamp of the GATT write being handled
+uint16_t latencyDeltaMs(ostime_t from, ostime_t to); // Saturates at 0xFFFF
+
+void latencyRecord(const uint16_t deltasMs[LATENCY_STAGES]);
+void latencySummary(LatencyStage stage, LatencySummary *summary);
@@ -0,0 +1,93 @@
+#include <string.h>
+#include "LocationCodec.h"
+
+#define LAT_BITS 25
+#define LON_BITS 26
+#define ALT_BITS 14
+#define DLAT_BITS 12
+#define DLON_BITS 12
+#define DALT_BITS 6
+
+static bool haveKey = false;
+static uint8_t keyId = 0;
+static uint8_t sinceKey = 0;
+static int32_t keyLat, keyLon, keyAlt; // Units of the frame fields
+
+// 1e-7 degrees to 1e-5 degrees, rounded to nearest
+static int32_t toFrameUnits(int32_t v) {
+  return (v + (v>=0 ? 50 : -50)) / 100;
+}
+
+static bool fitsSigned(int32_t v, uint8_t bits) {
+  int32_t limit = 1L << (bits - 1);
+  return v>=-limit && v<limit;
+}
+
+typedef struct {
+  uint8_t *frame;
+  uint8_t bit;
+} BitWriter;
+
+static void putBits(BitWriter *w, uint32_t value, uint8_t bits) {
+  while (bits--) {
+    if (value & (1UL << bits)) {
+      w->frame[w->bit / 8] |= 0x80 >> (w->bit % 8);
+    }
+    ++w->bit;
+  }
+}
+
+void locationReset() {
+  haveKey = false;
+}
+
+uint8_t locationEncode(const LocationFix *fix, uint8_t frame[LOCATION_MAX_FRAME]) {
+  int32_t lat = toFrameUnits(fix->lat) + 9000000;
+  int32_t lon = toFrameUnits(fix->lon) + 18000000;
+  int32_t alt = fix->alt + LOCATION_ALT_OFFSET;
+  if (alt<0) {
+    alt = 0;
+  }
+  else if (alt>=(1L << ALT_BITS)) {
+    alt = (1L << ALT_BITS) - 1;
+  }
+
+  int32_t dLat = lat - keyLat;
+  int32_t dLon = lon - keyLon;
+  int32_t dAlt = alt - keyAlt;
+  bool delta = haveKey && sinceKey<LOCATION_KEY_INTERVAL
+    && fitsSigned(dLat, DLAT_BITS) && fitsSigned(dLon, DLON_BITS) && fitsSigned(dAlt, DALT_BITS);
+
+  memset(frame, 0, LOCATION_MAX_FRAME);
+  BitWriter w = {frame, 0};
+  if (delta) {
+    ++sinceKey;
+    putBits(&w, 1, 1);
+    putBits(&w, LOCATION_FORMAT_V1, 2);
+    putBits(&w, keyId, 5);
+    putBits(&w, dLat, DLAT_BITS);
+    putBits(&w, dLon, DLON_BITS);
+    putBits(&w, dAlt, DALT_BITS);
+  }
+  else {
+    if (haveKey) {
+      keyId = (keyId + 1) & 0x1F;
+    }
+    haveKey = true;
+    sinceKey = 1;
+    keyLat = lat;
+    keyLon = lon;
+    keyAlt = alt;
+    putBits(&w, 0, 1);
+    putBits(&w, LOCATION_FORMAT_V1, 2);
+    putBits(&w, keyId, 5);
+    putBits(&w, lat, LAT_BITS);
+    putBits(&w, lon, LON_BITS);
+    putBits(&w, alt, ALT_BITS);
+  }
+  return (w.bit + 7) / 8;
+}
+
+bool locationIsKey(uint8_t const frame[]) {
+  return (frame[0] & 0x80)==0;
+}
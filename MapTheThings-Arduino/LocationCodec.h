@@ -0,0 +1,38 @@
+#include <stdint.h>
+
+/*
+ Compact location frames for mapping pings.
+
+ Fixes are rounded to 1e-5 degrees (about 1 m) and packed into bit fields,
+ most significant bit first. Every frame starts with a header byte:
+   bit 7     - 1 for a delta frame
+   bits 6..5 - LOCATION_FORMAT_V1
+   bits 4..0 - key id: counts key frames, modulo 32
+ Key frame (10 bytes): lat + 90 deg (25 bits), lon + 180 deg (26 bits),
+   alt + LOCATION_ALT_OFFSET m (14 bits).
+ Delta frame (5 bytes): signed lat (12 bits), lon (12 bits) and alt (6 bits)
+   differences from the key frame named by the key id.
+ Deltas are always taken against a key frame, never the previous delta, so a
+ lost delta frame costs only itself. A lost key frame costs the deltas that
+ name it too, up to LOCATION_KEY_INTERVAL-1 of them. A key frame is sent every
+ LOCATION_KEY_INTERVAL frames or when a difference does not fit. Call
+ locationReset() when the node knows a key frame did not go out (dropped from
+ the queue, TX failed), so the next fix is a key frame again.
+ tools/locationcodec.py decodes frames on the host.
+*/
+#define LOCATION_FORMAT_V1 0
+#define LOCATION_MAX_FRAME 10
+#define LOCATION_KEY_INTERVAL 8
+#define LOCATION_ALT_OFFSET 1000
+
+typedef struct {
+  int32_t lat;  // 1e-7 degrees
+  int32_t lon;  // 1e-7 degrees
+  int16_t alt;  // Metres above sea level
+} LocationFix;
+
+// Forces the next frame to be a key frame
+void locationReset();
+// Encodes fix into frame and returns the frame length
+uint8_t locationEncode(const LocationFix *fix, uint8_t frame[LOCATION_MAX_FRAME]);
+bool locationIsKey(uint8_t const frame[]);
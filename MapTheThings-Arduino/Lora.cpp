@@ -10,6 +10,11 @@
 #include <SPI.h>
 #include "Lora.h"
 #include "Logging.h"
+#include "TokenLog.h"
+#include "DataRateControl.h"
+#include "Airtime.h"
+#include "ChannelPlan.h"
+#include "Diag.h"
 
 #if defined(DISABLE_INVERT_IQ_ON_RX)
 #error This example requires DISABLE_INVERT_IQ_ON_RX to be NOT set. Update \
@@ -46,8 +51,81 @@ typedef enum LoraModeEnum {
 static LoraMode mode = NeedsConfiguration;
 
 static JoinResultCallbackFn onJoinCb = NULL;
+static JoinProgressCallbackFn onJoinProgressCb = NULL;
 static TransmitResultCallbackFn onTransmitCb = NULL;
 
+static bool autoSF = false;     // Data rate picked by DataRateControl
+static dr_t currentDr = DR_SF10;  // Survives resetLora()
+static dr_t restoreDr = DR_NONE;  // Data rate before loraSetNextSF, restored after that uplink
+static uint8_t lastPayloadLen = 0;
+static uint16_t lastAirtimeMs = 0;
+static LoraTxInfo lastTx;
+
+#if defined(CFG_eu868)
+#define MAX_SF 12
+// Duty cycle per sub-band, as LMIC enforces it: 1% in g/g1, where ChannelPlan's
+// LoRa channels are, 0.1% in g2 (its FSK channel), 10% in g3
+#define DUTY_CYCLE_CENTI_PERMILLE 10
+#define DUTY_CYCLE_MILLI_PERMILLE 1
+#define DUTY_CYCLE_DECI_PERMILLE 100
+#define RX2_SF 12
+#define RX2_BW 125000
+#else
+#define MAX_SF 10 // US915 125 kHz uplinks stop at SF10. No duty cycle limit, only dwell time.
+#define RX2_SF 12
+#define RX2_BW 500000
+#endif
+
+#define TX_TIMEOUT_MARGIN_MS 1000
+#define RETRY_DELAY_MAX_MS 3000 // LMIC waits up to this long before a confirmed retry
+
+static dr_t sfToDr(uint sf) {
+  switch (sf) {
+    #if defined(CFG_eu868)
+    case 12: return DR_SF12;
+    case 11: return DR_SF11;
+    #endif
+    case 10: return DR_SF10;
+    case 9: return DR_SF9;
+    case 8: return DR_SF8;
+    case 7: return DR_SF7;
+    default: return DR_NONE;
+  }
+}
+
+static uint8_t drToSf(dr_t dr) {
+  for (uint8_t sf = 7; sf<=MAX_SF; ++sf) {
+    if (sfToDr(sf)==dr) {
+      return sf;
+    }
+  }
+  return 0; // Not a 125 kHz LoRa rate
+}
+
+// Feeds the outcome of the last uplink to DataRateControl and applies its choice
+static void updateDataRate(bool known, bool delivered) {
+  drcRecordTx(millis(), lastPayloadLen, known, delivered);
+  uint8_t sf = drToSf(LMIC.datarate);
+  if (autoSF && sf!=0 && restoreDr==DR_NONE) {
+    uint8_t next = drcChooseSf(sf);
+    if (next!=sf) {
+      TLOG_DEBUG("Auto SF: %d -> %d" CR, sf, next);
+      currentDr = sfToDr(next);
+      LMIC_setDrTxpow(currentDr, 20);
+    }
+  }
+}
+
+// Ends the one-off data rate of loraSetNextSF. Returns false if there was none.
+static bool restoreDataRate() {
+  if (restoreDr==DR_NONE) {
+    return false;
+  }
+  LMIC_setDrTxpow(restoreDr, 20);
+  restoreDr = DR_NONE;
+  return true;
+}
+
 static u1_t join_appkey[16];
 static u1_t join_appeui[8];
 static u1_t join_deveui[8];
@@ -65,6 +143,20 @@ void os_getDevKey (u1_t* buf) {
   memcpy(buf, join_appkey, sizeof(join_appkey));
 }
 
+// Longest time from TX start to EV_TXCOMPLETE: our frame, the wait for RX2
+// and the longest downlink RX2 can carry.
+static uint32_t txTimeoutMs(uint8_t len) {
+  uint8_t sf = drToSf(LMIC.datarate);
+  if (sf==0) {
+    sf = MAX_SF;
+  }
+  uint8_t rxDelay = LMIC.rxDelay ? LMIC.rxDelay : 1; // Seconds to RX1. RX2 follows 1 s later.
+  return airtimeUs(sf, 125000, len) / 1000
+    + (rxDelay + 1) * 1000UL
+    + airtimeUs(RX2_SF, RX2_BW, MAX_LEN_PAYLOAD) / 1000
+    + TX_TIMEOUT_MARGIN_MS;
+}
+
 static osjob_t timeoutjob;
 static void txtimeout_func(osjob_t *job) {
   if (LMIC.opmode & OP_JOINING) {
@@ -72,57 +164,186 @@ static void txtimeout_func(osjob_t *job) {
      return;
   }
   digitalWrite(LED_BUILTIN, LOW); // off
-  Log.Debug(F("Transmit Timeout" CR));
-  //txActive = false;
+  TLOG_DEBUG("Transmit Timeout" CR);
+  DIAG_COUNT(DiagTxTimeouts);
+  lastTx.completeAt = os_getTime();
+  if (lastTx.attempts==0) {
+    lastTx.startAt = lastTx.completeAt; // Never left LMIC
+  }
   LMIC_clrTxData ();
+  updateDataRate(false, false); // Stuck locally (e.g. duty cycle). Says nothing about the link.
+  restoreDataRate();
+  if (onTransmitCb) {
+    // Release the caller's pending packet so queued work can proceed
+    onTransmitCb(TX_ERROR_TIMEOUT, LMIC_getSeqnoUp()-1, NULL, 0);
+  }
 }
 
-bool loraSendBytes(uint8_t *data, uint16_t len) {
+bool loraHasSession() {
+  return mode==Ready;
+}
+
+bool loraReadyToSend() {
+  return mode==Ready && !(LMIC.opmode & OP_TXRXPEND);
+}
+
+bool loraSendBytes(uint8_t port, uint8_t *data, uint16_t len, bool confirmed) {
   if (mode!=Ready) {
-    Log.Debug(F("mode not ready, not sending" CR));
+    TLOG_DEBUG("mode not ready, not sending" CR);
     return false; // Did not enqueue
   }
   ostime_t t = os_getTime();
   //os_setTimedCallback(&txjob, t + ms2osticks(100), tx_func);
   // Check if there is not a current TX/RX job running
     if (LMIC.opmode & OP_TXRXPEND) {
-        Log.Debug(F("OP_TXRXPEND, not sending" CR));
+        TLOG_DEBUG("OP_TXRXPEND, not sending" CR);
         return false; // Did not enqueue
     } else {
         // Prepare upstream data transmission at the next possible time.
-        Log.Debug(F("Packet queued" CR));
+        TLOG_DEBUG("Packet queued" CR);
         digitalWrite(LED_BUILTIN, HIGH); // off
-        LMIC_setTxData2(1, data, len, 0);
+        channelPlanBeforeTx();
+        LMIC_setTxData2(port, data, len, confirmed);
+        lastPayloadLen = len;
+        lastTx.confirmed = confirmed;
+        lastTx.acked = false;
+        lastTx.attempts = 0;
+        lastTx.sentAt = os_getTime();
         if (! (LMIC.opmode & OP_JOINING)) {
-          // connection is up, message is queued:
-          // Timeout TX after 20 seconds
-          os_setTimedCallback(&timeoutjob, t + ms2osticks(20000), txtimeout_func);
+          // connection is up, message is queued. LMIC holds it until the duty
+          // cycle allows; EV_TXSTART rearms the timeout for the frame itself.
+          uint32_t ms = airtimeUntilNextTxMs(millis()) + txTimeoutMs(len);
+          os_setTimedCallback(&timeoutjob, t + ms2osticks(ms), txtimeout_func);
         }
         return true;
     }
 }
 
+/* OTAA join engine. LMIC runs a round of join requests from fast to robust
+ * data rate and raises EV_JOIN_FAILED when the most robust one fails too.
+ * Between rounds we back off so that join requests keep to the LoRaWAN
+ * aggregate join duty cycle: 1% in the first hour, 0.1% for the next ten
+ * hours, 0.01% after that.
+ */
+#define JOIN_HOUR_MS 3600000UL
+#define JOIN_MIN_BACKOFF_MS 5000
+// Join airtime the duty cycle allows in the first hour, and in the first 11 hours.
+// Places a node that rebooted mid-join, whose elapsed time is lost.
+#define JOIN_FIRST_HOUR_AIRTIME_MS 36000UL
+#define JOIN_FIRST_11H_AIRTIME_MS (2*36000UL)
+
+static LoraJoinState joinState;
+static uint32_t joinSeqNo;
+static uint32_t joinStartMs;    // millis() at loraJoin
+static uint32_t joinResumeMs;   // millis() when the next round may start
+static uint32_t roundStartMs;
+static uint32_t roundAirtimeMs;
+static osjob_t joinjob;
+
+static void configureLora(uint32_t seq_no);
+
+static void reportJoin(LoraJoinPhase phase, uint32_t waitMs) {
+  if (onJoinProgressCb) {
+    onJoinProgressCb(phase, &joinState, drToSf(LMIC.datarate), waitMs, millis() - joinStartMs);
+  }
+}
+
+static void startJoinRound(osjob_t *job) {
+  int32_t waitMs = joinResumeMs - millis();
+  if (waitMs>0) {
+    // Long waits go in steps: LMIC time wraps after a few hours of ticks
+    uint32_t stepMs = (uint32_t)waitMs<JOIN_HOUR_MS ? waitMs : JOIN_HOUR_MS;
+    os_setTimedCallback(&joinjob, os_getTime() + ms2osticks(stepMs), startJoinRound);
+    return;
+  }
+  configureLora(joinSeqNo);
+  if (joinState.devNonce!=0) {
+    // LMIC_reset picked a random DevNonce, which may repeat one already sent
+    LMIC.devNonce = joinState.devNonce;
+  }
+  roundStartMs = millis();
+  roundAirtimeMs = 0;
+  if (!LMIC_startJoining()) {
+    debugPrint("Error: Expected to start joining, but did not!");
+  }
+}
+
+// Inverse of the join duty cycle that applies now
+static uint32_t joinDutyFactor() {
+  uint32_t elapsed = millis() - joinStartMs;
+  if (elapsed>=11*JOIN_HOUR_MS || joinState.airtimeMs>=JOIN_FIRST_11H_AIRTIME_MS) {
+    return 10000;
+  }
+  if (elapsed>=JOIN_HOUR_MS || joinState.airtimeMs>=JOIN_FIRST_HOUR_AIRTIME_MS) {
+    return 1000;
+  }
+  return 100;
+}
+
+// Wait after a failed round so that the round's airtime stays within the join duty cycle
+static uint32_t joinBackoffMs() {
+  uint32_t now = millis();
+  uint32_t periodMs = roundAirtimeMs * joinDutyFactor();
+  uint32_t spentMs = now - roundStartMs;
+  uint32_t waitMs = periodMs>spentMs ? periodMs - spentMs : 0;
+  return waitMs>JOIN_MIN_BACKOFF_MS ? waitMs : JOIN_MIN_BACKOFF_MS;
+}
+
+// Wait before the first round of a node that rebooted mid-join. When its last
+// request went out is lost, so assume just now and wait out the off time of an
+// average request. A node in a reboot loop then still keeps the duty cycle.
+static uint32_t joinResumeBackoffMs() {
+  if (joinState.attempts==0) {
+    return 0;
+  }
+  uint32_t waitMs = joinState.airtimeMs / joinState.attempts * joinDutyFactor();
+  return waitMs>JOIN_MIN_BACKOFF_MS ? waitMs : JOIN_MIN_BACKOFF_MS;
+}
+
+static void onJoinRequestSent(uint16_t airtimeMs) {
+  joinState.attempts++;
+  joinState.airtimeMs += airtimeMs;
+  roundAirtimeMs += airtimeMs;
+  // LMIC versions differ on whether devNonce already moved past the nonce
+  // just sent. One more is unused either way.
+  joinState.devNonce = LMIC.devNonce + 1;
+  reportJoin(JoinAttempt, 0);
+}
+
+static void onJoinRoundFailed() {
+  LMIC_reset(); // Otherwise LMIC starts the next round right away
+  uint32_t waitMs = joinBackoffMs();
+  TLOG_INFO("Join failed after %d attempts. Retrying in %d s" CR, joinState.attempts, waitMs / 1000);
+  joinResumeMs = millis() + waitMs;
+  startJoinRound(&joinjob);
+  reportJoin(JoinBackoff, waitMs);
+}
+
 void onEvent (ev_t ev) {
-    Log.Debug("%d: ", os_getTime());
+    TLOG_DEBUG("%d: ", os_getTime());
     switch(ev) {
         case EV_SCAN_TIMEOUT:
-            Log.Debug(F("EV_SCAN_TIMEOUT"));
+            TLOG_DEBUG("EV_SCAN_TIMEOUT" CR);
             break;
         case EV_BEACON_FOUND:
-            Log.Debug(F("EV_BEACON_FOUND"));
+            TLOG_DEBUG("EV_BEACON_FOUND" CR);
             break;
         case EV_BEACON_MISSED:
-            Log.Debug(F("EV_BEACON_MISSED"));
+            TLOG_DEBUG("EV_BEACON_MISSED" CR);
             break;
         case EV_BEACON_TRACKED:
-            Log.Debug(F("EV_BEACON_TRACKED"));
+            TLOG_DEBUG("EV_BEACON_TRACKED" CR);
             break;
         case EV_JOINING:
-            Log.Debug(F("EV_JOINING"));
+            TLOG_DEBUG("EV_JOINING" CR);
             break;
         case EV_JOINED:
-            Log.Debug(F("EV_JOINED"));
+            TLOG_DEBUG("EV_JOINED" CR);
             mode = Ready;
+            TLOG_INFO("Joined after %d attempts in %d s" CR, joinState.attempts, (millis() - joinStartMs) / 1000);
+            joinState.attempts = 0;
+            joinState.airtimeMs = 0;
+            reportJoin(JoinJoined, 0);
             if (onJoinCb) {
               u4_t netid = 0;
               devaddr_t devaddr = 0;
@@ -134,119 +355,170 @@ void onEvent (ev_t ev) {
             }
             break;
         case EV_RFU1:
-            Log.Debug(F("EV_RFU1"));
+            TLOG_DEBUG("EV_RFU1" CR);
             break;
         case EV_JOIN_FAILED:
-            Log.Debug(F("EV_JOIN_FAILED"));
-            if (onJoinCb) {
-              onJoinCb(NULL, NULL, NULL);
-            }
+            TLOG_DEBUG("EV_JOIN_FAILED" CR);
+            onJoinRoundFailed();
             break;
         case EV_REJOIN_FAILED:
-            Log.Debug(F("EV_REJOIN_FAILED"));
+            TLOG_DEBUG("EV_REJOIN_FAILED" CR);
             break;
-        case EV_TXCOMPLETE:
+        case EV_TXCOMPLETE: {
+            // Time spent handling TX completion, including logging. Shows the cost
+            // of log transport on the LMIC event path.
+            static uint32_t maxHandlingUs = 0;
+            uint32_t handlingStartUs = micros();
+
             os_clearCallback(&timeoutjob);
-            Log.Debug(F("EV_TXCOMPLETE (includes waiting for RX windows)" CR));
+            lastTx.completeAt = os_getTime();
+            DIAG_SPAN_END(DiagTxStartToComplete);
+            TLOG_DEBUG("EV_TXCOMPLETE (includes waiting for RX windows)" CR);
             digitalWrite(LED_BUILTIN, LOW); // off
+            {
+              // Anything heard in an RX window proves the uplink got through
+              bool heard = LMIC.txrxFlags & (TXRX_ACK | TXRX_DNW1 | TXRX_DNW2);
+              if (heard) {
+                drcRecordDownlink(LMIC.snr / 4, LMIC.rssi); // LMIC.snr is in quarter dB
+              }
+              updateDataRate(heard || (LMIC.txrxFlags & TXRX_NACK), heard);
+              channelPlanRecord(LMIC.txChnl, heard || (LMIC.txrxFlags & TXRX_NACK), heard);
+              lastTx.acked = lastTx.confirmed && (LMIC.txrxFlags & TXRX_ACK);
+              bool ownSF = restoreDataRate(); // Back to the rate before a loraSetNextSF uplink
+              if (!ownSF && !autoSF && LMIC.datarate!=currentDr) {
+                // Retries stepped the rate down. A fixed SF stays fixed for the next uplink.
+                LMIC_setDrTxpow(currentDr, 20);
+              }
+            }
             if (onTransmitCb) {
-              Log.Debug(F("Calling transmit callback..." CR));
+              TLOG_DEBUG("Calling transmit callback..." CR);
               u1_t *received = NULL;
               u1_t len = 0;
               if (LMIC.dataLen>0) {
                 received = LMIC.frame+LMIC.dataBeg;
                 len = LMIC.dataLen;
 
-                // Log received data.
-                u1_t *p = received;
-                for (int i=0; i<LMIC.dataLen; ++i) {
-                  Log.Debug("%x", *p++);
-                }
-                // Log.Debug("%*h", LMIC.dataLen, LMIC.frame+LMIC.dataBeg);
-                Log.Debug(CR);
+                debugLogData("Received", received, len);
               }
               uint32_t tx_seq_no = LMIC_getSeqnoUp()-1; // LMIC_getSeqnoUp returns the NEXT one. We want to return the one used.
-              onTransmitCb(0 /* success */, tx_seq_no, received, len);
+              uint16_t error = (lastTx.confirmed && !lastTx.acked) ? TX_ERROR_NOT_ACKED : TX_ERROR_NONE;
+              onTransmitCb(error, tx_seq_no, received, len);
             }
 
+            uint32_t handlingUs = micros() - handlingStartUs;
+            if (handlingUs>maxHandlingUs) {
+              maxHandlingUs = handlingUs;
+            }
+            TLOG_DEBUG("EV_TXCOMPLETE handled in %d us (max %d us)" CR, handlingUs, maxHandlingUs);
             break;
+        }
         case EV_LOST_TSYNC:
-            Log.Debug(F("EV_LOST_TSYNC"));
+            TLOG_DEBUG("EV_LOST_TSYNC" CR);
             break;
         case EV_RESET:
-            Log.Debug(F("EV_RESET"));
+            TLOG_DEBUG("EV_RESET" CR);
             break;
         case EV_RXCOMPLETE:
             // data received in ping slot
-            Log.Debug(F("EV_RXCOMPLETE"));
+            TLOG_DEBUG("EV_RXCOMPLETE" CR);
             break;
         case EV_LINK_DEAD:
-            Log.Debug(F("EV_LINK_DEAD"));
+            TLOG_DEBUG("EV_LINK_DEAD" CR);
             break;
         case EV_LINK_ALIVE:
-            Log.Debug(F("EV_LINK_ALIVE"));
+            TLOG_DEBUG("EV_LINK_ALIVE" CR);
             break;
         case EV_SCAN_FOUND:
-            Log.Debug(F("EV_SCAN_FOUND"));
+            TLOG_DEBUG("EV_SCAN_FOUND" CR);
             break;
-        case EV_TXSTART:
-            Log.Debug(F("EV_TXSTART"));
+        case EV_TXSTART: {
+            TLOG_DEBUG("EV_TXSTART" CR);
+            DIAG_SPAN_END(DiagTxWriteToStart);
+            DIAG_SPAN_BEGIN_AT(DiagTxStartToComplete, micros());
+            // Join requests carry no FRMPayload but a 10 byte larger header
+            uint8_t len = (LMIC.opmode & OP_JOINING) ? 10 : lastPayloadLen;
+            uint8_t sf = drToSf(LMIC.datarate);
+            if (sf!=0) {
+              lastAirtimeMs = airtimeUs(sf, 125000, len) / 1000;
+              airtimeRecordTx(millis(), lastAirtimeMs, channelPlanBand(LMIC.txChnl));
+            }
+            if (LMIC.opmode & OP_JOINING) {
+              onJoinRequestSent(sf!=0 ? lastAirtimeMs : 0);
+            }
+            else {
+              if (lastTx.attempts==0) {
+                lastTx.startAt = os_getTime();
+              }
+              lastTx.attempts++;
+              lastTx.sf = sf;
+              uint32_t ms = txTimeoutMs(len);
+              if (lastTx.confirmed) {
+                if (lastTx.attempts>=LORA_CONFIRMED_MAX_ATTEMPTS) {
+                  // LMIC gives up, with TXRX_NACK, once its retry count reaches TXCONF_ATTEMPTS
+                  LMIC.txCnt = TXCONF_ATTEMPTS;
+                }
+                else {
+                  // A retry may follow. Its EV_TXSTART rearms the timeout again.
+                  ms += RETRY_DELAY_MAX_MS + airtimeUntilNextTxMs(millis());
+                }
+              }
+              os_setTimedCallback(&timeoutjob, os_getTime() + ms2osticks(ms), txtimeout_func);
+            }
             break;
+        }
         default:
-            Log.Debug(F("Unknown event: %d"), (int)ev);
+            TLOG_DEBUG("Unknown event: %d" CR, (int)ev);
             break;
     }
-    Log.Debug(CR);
 }
 
 static void configureLora(uint32_t seq_no) {
-  #if defined(CFG_eu868)
-    // Set up the channels used by the Things Network, which corresponds
-    // to the defaults of most gateways. Without this, only three base
-    // channels from the LoRaWAN specification are used, which certainly
-    // works, so it is good for debugging, but can overload those
-    // frequencies, so be sure to configure the full frequency range of
-    // your network here (unless your network autoconfigures them).
     // Setting up channels should happen after LMIC_setSession, as that
     // configures the minimal channel set.
-    LMIC_setupChannel(0, 868100000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
-    LMIC_setupChannel(1, 868300000, DR_RANGE_MAP(DR_SF12, DR_SF7B), BAND_CENTI);      // g-band
-    LMIC_setupChannel(2, 868500000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
-    LMIC_setupChannel(3, 867100000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
-    LMIC_setupChannel(4, 867300000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
-    LMIC_setupChannel(5, 867500000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
-    LMIC_setupChannel(6, 867700000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
-    LMIC_setupChannel(7, 867900000, DR_RANGE_MAP(DR_SF12, DR_SF7),  BAND_CENTI);      // g-band
-    LMIC_setupChannel(8, 868800000, DR_RANGE_MAP(DR_FSK,  DR_FSK),  BAND_MILLI);      // g2-band
-    // TTN defines an additional channel at 869.525Mhz using SF9 for class B
-    // devices' ping slots. LMIC does not have an easy way to define set this
-    // frequency and support for class B is spotty and untested, so this
-    // frequency is not configured here.
-    #endif
-
-    LMIC_selectSubBand(1);
+    channelPlanConfigure();
 
     // Disable link check validation
     LMIC_setLinkCheckMode(0);
 
     // Set data rate and transmit power (note: txpow seems to be ignored by the library)
-    LMIC_setDrTxpow(DR_SF10,20);
+    LMIC_setDrTxpow(currentDr,20);
 
     debugLog("Set LoRa seq no:", seq_no);
     LMIC_setSeqnoUp(seq_no);
 }
 
+// Jobs posted through loraRunSoon that os_runloop_once has not had a pass for yet.
+// A job cleared before it ran only costs one pass without sleep.
+static uint8_t runnablePosted = 0;
+
+void loraRunSoon(osjob_t *job, osjobcb_t cb) {
+  os_setCallback(job, cb);
+  ++runnablePosted;
+}
+
 void resetLora() {
+  if (LMIC.opmode & (OP_TXDATA | OP_TXRXPEND)) {
+    // The frame is lost and os_init() drops its timeout job. Release the caller's packet now.
+    txtimeout_func(&timeoutjob);
+  }
   // LMIC init
   os_init();
+  runnablePosted = 0;
   // Reset the MAC state. Session and pending data transfers will be discarded.
   LMIC_reset();
+  restoreDr = DR_NONE;
 }
 
 bool setupLora(TransmitResultCallbackFn txcb) {
-    Log.Info(F("Initializing LoRa radio module" CR));
+    TLOG_INFO("Initializing LoRa radio module" CR);
 
     onTransmitCb = txcb;
+    drcInit(7, MAX_SF, 125000);
+    #if defined(CFG_eu868)
+    airtimeSetDutyCycle(BAND_CENTI, DUTY_CYCLE_CENTI_PERMILLE);
+    airtimeSetDutyCycle(BAND_MILLI, DUTY_CYCLE_MILLI_PERMILLE);
+    airtimeSetDutyCycle(BAND_DECI, DUTY_CYCLE_DECI_PERMILLE);
+    #endif
 
     #ifdef VCC_ENABLE
     // For Pinoccio Scout boards
@@ -264,27 +536,69 @@ bool setupLora(TransmitResultCallbackFn txcb) {
 
 void loopLora() {
   if (mode!=NeedsConfiguration) {
+    if (runnablePosted) {
+      --runnablePosted; // Each pass runs at most one runnable job
+    }
+    DIAG_BEGIN(DiagLmicRunloop);
     os_runloop_once();
+    DIAG_END(DiagLmicRunloop);
+  }
+}
+
+bool loraBusyWithin(uint32_t ms) {
+  return mode!=NeedsConfiguration && os_queryTimeCriticalJobs(ms2osticks(ms));
+}
+
+// LMIC keeps its job queue private, so find the next deadline by bisecting
+// with os_queryTimeCriticalJobs. At most ~8 probes for limits up to 250 ms.
+uint32_t loraIdleMs(uint32_t limitMs) {
+  if (mode==NeedsConfiguration) {
+    return limitMs;
+  }
+  if (LMIC.opmode & OP_TXRXPEND) {
+    return 0; // TX and RX completion are seen by polling DIO lines
+  }
+  if (runnablePosted) {
+    return 0;
+  }
+  if (!loraBusyWithin(limitMs)) {
+    return limitMs;
+  }
+  uint32_t free = 0;
+  uint32_t busy = limitMs;
+  while (busy - free > 1) {
+    uint32_t mid = (free + busy) / 2;
+    if (loraBusyWithin(mid)) {
+      busy = mid;
+    }
+    else {
+      free = mid;
+    }
   }
+  return free;
 }
 
-void loraJoin(uint32_t seq_no, u1_t *appkey, u1_t *appeui, u1_t *deveui, JoinResultCallbackFn joincb) {
+void loraJoin(uint32_t seq_no, u1_t *appkey, u1_t *appeui, u1_t *deveui, JoinResultCallbackFn joincb,
+  const LoraJoinState *resume, JoinProgressCallbackFn progresscb) {
   onJoinCb = joincb;
+  onJoinProgressCb = progresscb;
 
   memcpy(join_appkey, appkey, sizeof(join_appkey));
   memcpy(join_appeui, appeui, sizeof(join_appeui));
   memcpy(join_deveui, deveui, sizeof(join_deveui));
 
-  resetLora();
+  joinState = *resume;
+  joinSeqNo = seq_no;
+  joinStartMs = millis();
+  joinResumeMs = joinStartMs + joinResumeBackoffMs();
+  if (joinResumeMs!=joinStartMs) {
+    TLOG_INFO("Resuming join after %d attempts in %d s" CR, joinState.attempts, (joinResumeMs - joinStartMs) / 1000);
+  }
 
-  configureLora(seq_no);
+  resetLora();
 
-  if (LMIC_startJoining()) {
-    debugPrint("Started joining.");
-  }
-  else {
-    debugPrint("Error: Expected to start joining, but did not!");
-  }
+  startJoinRound(&joinjob);
+  debugPrint("Started joining.");
 
   mode = ReadyToJoin;
 }
@@ -306,16 +620,109 @@ void loraSetSessionKeys(uint32_t seq_no, u1_t *appskey, u1_t *nwkskey, u1_t *dev
 }
 
 void loraSetSF(uint sf) {
-  dr_t dr;
-  switch (sf) {
-    case 7: dr = DR_SF7; break;
-    case 8: dr = DR_SF8; break;
-    case 9: dr = DR_SF9; break;
-    case 10: dr = DR_SF10; break;
-    default:
-      dr = DR_SF10;
-      Log.Debug(F("Invalid SF value: %d" CR), sf);
-      break;
+  if (sf==0) {
+    TLOG_DEBUG("Automatic SF selection" CR);
+    autoSF = true;
+    drcInit(7, MAX_SF, 125000);
+    return;
   }
+  dr_t dr = sfToDr(sf);
+  if (dr==DR_NONE) {
+    dr = DR_SF10;
+    TLOG_DEBUG("Invalid SF value: %d" CR, sf);
+  }
+  autoSF = false;
+  currentDr = dr;
   LMIC_setDrTxpow(dr,20);
 }
+
+void loraSetNextSF(uint8_t sf) {
+  dr_t dr = sfToDr(sf);
+  if (dr==DR_NONE || dr==LMIC.datarate) {
+    return;
+  }
+  if (restoreDr==DR_NONE) {
+    restoreDr = LMIC.datarate;
+  }
+  LMIC_setDrTxpow(dr, 20);
+}
+
+bool loraSetChannelPlan(uint8_t index) {
+  if (!channelPlanSelect(index)) {
+    return false;
+  }
+  if (mode!=NeedsConfiguration) {
+    channelPlanConfigure();
+  }
+  return true;
+}
+
+uint8_t loraCurrentSF() {
+  return drToSf(LMIC.datarate);
+}
+
+uint16_t loraLastAirtimeMs() {
+  return lastAirtimeMs;
+}
+
+// Regional maximum, capped by the LMIC frame buffer
+static uint8_t maxPayload(uint8_t sf) {
+  #if defined(CFG_eu868)
+  uint16_t max = sf>=10 ? 51 : sf==9 ? 115 : 222;
+  #else
+  uint16_t max = sf==10 ? 11 : sf==9 ? 53 : sf==8 ? 125 : 242;
+  #endif
+  return max<MAX_LEN_PAYLOAD ? max : MAX_LEN_PAYLOAD;
+}
+
+uint8_t loraMaxPayload() {
+  return maxPayload(drToSf(LMIC.datarate));
+}
+
+uint8_t loraSfFor(uint8_t len) {
+  for (uint8_t sf=MAX_SF; sf>=7; --sf) {
+    if (maxPayload(sf)>=len) {
+      return sf;
+    }
+  }
+  return 0;
+}
+
+void loraLastRxInfo(LoraRxInfo *info) {
+  info->port = LMIC.dataLen ? LMIC.frame[LMIC.dataBeg-1] : 0;
+  info->rssi = LMIC.rssi;
+  info->snr = LMIC.snr;
+  info->fcnt = LMIC.seqnoDn - 1; // LMIC holds the next expected counter
+}
+
+void loraLastTxInfo(LoraTxInfo *info) {
+  *info = lastTx;
+}
+
+void loraGetSessionState(LoraSessionState *state) {
+  uint32_t now = millis();
+  state->seqnoDn = LMIC.seqnoDn;
+  state->dn2Freq = LMIC.dn2Freq;
+  state->airtimeUsedMs = AIRTIME_DAILY_BUDGET_MS - airtimeBudgetRemainingMs(now);
+  state->datarate = LMIC.datarate;
+  state->adrTxPow = LMIC.adrTxPow;
+  state->rx1DrOffset = LMIC.rx1DrOffset;
+  state->dn2Dr = LMIC.dn2Dr;
+  state->rxDelay = LMIC.rxDelay;
+  channelPlanGetMask(state->channelMap); // Without the channels steered out for now
+}
+
+void loraRestoreSessionState(const LoraSessionState *state) {
+  LMIC.seqnoDn = state->seqnoDn;
+  LMIC.dn2Freq = state->dn2Freq;
+  LMIC.rx1DrOffset = state->rx1DrOffset;
+  LMIC.dn2Dr = state->dn2Dr;
+  LMIC.rxDelay = state->rxDelay;
+  channelPlanRestoreMask(state->channelMap);
+  if (drToSf(state->datarate)!=0) {
+    currentDr = state->datarate;
+    LMIC_setDrTxpow(currentDr, state->adrTxPow);
+  }
+  airtimeRestoreUsed(millis(), state->airtimeUsedMs);
+  TLOG_INFO("Restored MAC session: SF%d, downlink counter %d" CR, drToSf(LMIC.datarate), LMIC.seqnoDn);
+}
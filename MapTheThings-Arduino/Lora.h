@@ -10,12 +10,97 @@ extern "C"{
   void debugLogData(const char *msg, uint8_t data[], uint16_t len);
 }
 
+// Error values passed to TransmitResultCallbackFn
+#define TX_ERROR_NONE 0
+#define TX_ERROR_TIMEOUT 1 // Gave up waiting for EV_TXCOMPLETE
+#define TX_ERROR_NOT_ACKED 2 // Confirmed uplink got no ACK in any attempt
+#define TX_ERROR_STORED 3 // Not sent yet: kept in the flash backlog for later (TX results only)
+
+// Attempts per confirmed uplink, the first one included. LMIC lowers the data
+// rate every second retry. At most TXCONF_ATTEMPTS.
+#define LORA_CONFIRMED_MAX_ATTEMPTS 4
+
 typedef void (*JoinResultCallbackFn) (u1_t *appskey, u1_t *nwkskey, u1_t *devaddr);
+
+// OTAA attempt state, saved so that a rebooted node neither reuses a DevNonce
+// the network has seen nor falls back to the most permissive join back-off.
+typedef struct __attribute__((packed)) {
+  uint16_t devNonce;  // Next DevNonce to send. Never used before.
+  uint16_t attempts;  // Join requests sent since the last successful join
+  uint32_t airtimeMs; // Join request airtime spent since the last successful join
+} LoraJoinState;
+
+typedef enum LoraJoinPhaseEnum {
+  JoinAttempt,  // A join request just went out
+  JoinBackoff,  // A round from fast to robust data rate failed. Waiting to retry.
+  JoinJoined,
+} LoraJoinPhase;
+
+// waitMs is the back-off before the next round, elapsedMs the time since loraJoin.
+// Called with JoinJoined, elapsedMs is the time to join.
+typedef void (*JoinProgressCallbackFn) (LoraJoinPhase phase, const LoraJoinState *state, uint8_t sf, uint32_t waitMs, uint32_t elapsedMs);
+// received points into the LMIC frame buffer and is valid until the callback returns.
 typedef void (*TransmitResultCallbackFn) (uint16_t error, uint32_t seq_no, u1_t *received, u1_t length);
 
+// Metadata of the downlink passed with the last transmit result
+typedef struct {
+  uint8_t port;
+  int8_t rssi;
+  int8_t snr;     // Quarter dB
+  uint32_t fcnt;
+} LoraRxInfo;
+
 bool setupLora(TransmitResultCallbackFn txcb);
 void loopLora(void);
-void loraJoin(uint32_t seq_no, u1_t *appkey, u1_t *appeui, u1_t *deveui, JoinResultCallbackFn joincb);
+bool loraBusyWithin(uint32_t ms); // True if an LMIC job is due within ms
+uint32_t loraIdleMs(uint32_t limitMs); // Time until LMIC needs to run, at most limitMs
+// os_setCallback for the sketch's own jobs. LMIC keeps runnable jobs private, and
+// loraIdleMs only sees those posted here.
+void loraRunSoon(osjob_t *job, osjobcb_t cb);
+// Keeps trying until joined. resume is the last state passed to progresscb, zeroed if none.
+void loraJoin(uint32_t seq_no, u1_t *appkey, u1_t *appeui, u1_t *deveui, JoinResultCallbackFn joincb,
+  const LoraJoinState *resume, JoinProgressCallbackFn progresscb);
 void loraSetSessionKeys(uint32_t seq_no, u1_t *appskey, u1_t *nwkskey, u1_t *devaddr);
-bool loraSendBytes(uint8_t *data, uint16_t len);
-void loraSetSF(uint sf);
+bool loraHasSession(void); // Joined, or session keys set
+bool loraReadyToSend(void);
+bool loraSendBytes(uint8_t port, uint8_t *data, uint16_t len, bool confirmed);
+uint8_t loraMaxPayload(void); // Largest payload at the current data rate
+uint8_t loraSfFor(uint8_t len); // Most robust SF that carries len bytes. 0 if none.
+void loraLastRxInfo(LoraRxInfo *info);
+
+// Outcome of the last uplink passed with the last transmit result
+typedef struct {
+  bool confirmed;
+  bool acked;
+  uint8_t attempts; // Transmissions, retries of a confirmed uplink included
+  uint8_t sf;       // Of the last attempt. 0 if not a 125 kHz LoRa rate.
+  ostime_t sentAt;     // LMIC_setTxData2
+  ostime_t startAt;    // First EV_TXSTART. On timeout before any, the timeout.
+  ostime_t completeAt; // EV_TXCOMPLETE or the timeout
+} LoraTxInfo;
+void loraLastTxInfo(LoraTxInfo *info);
+
+// MAC session state beyond keys and uplink counter, saved so that a rebooted
+// node resumes where the network left it instead of converging again.
+// Duty cycle off times are not kept: LMIC time restarts at boot.
+typedef struct __attribute__((packed)) {
+  uint32_t seqnoDn;
+  uint32_t dn2Freq;       // Set by the network
+  uint32_t airtimeUsedMs; // Daily airtime budget spent
+  uint8_t datarate;       // Moved by SF selection and survey pings as well as the network
+  int8_t adrTxPow;
+  uint8_t rx1DrOffset;    // From here on set by the network only
+  uint8_t dn2Dr;
+  uint8_t rxDelay;
+  uint8_t channelMap[sizeof(LMIC.channelMap)];
+} LoraSessionState;
+
+void loraGetSessionState(LoraSessionState *state);
+// Call after loraSetSessionKeys and before the first uplink
+void loraRestoreSessionState(const LoraSessionState *state);
+void loraSetSF(uint sf); // 0 selects SF automatically
+// SF of the next uplink only. The SF setting, fixed or automatic, applies again after it.
+void loraSetNextSF(uint8_t sf);
+uint8_t loraCurrentSF(void);
+bool loraSetChannelPlan(uint8_t index); // See ChannelPlan.h. False if there is no such plan.
+uint16_t loraLastAirtimeMs(void); // Airtime of the most recent frame sent
@@ -9,10 +9,19 @@
  *
  *******************************************************************************/
 
+#if !defined(LOG_LEVEL)
 #define LOG_LEVEL LOG_LEVEL_INFOS //  _INFOS, _DEBUG, _VERBOSE, _NOOUTPUT
+#endif
 // Set to LOG_LEVEL_VERBOSE to see low level AT communication with BT module
+// TLOG_* calls below LOG_LEVEL are compiled out. Define LOG_LEVEL in build_flags to set it for all files.
+// #define TOKENIZED_LOGGING // Log format strings as 32 bit tokens. Decode with tools/tokenlog.py. Set in build_flags to cover all files.
 
 #define DEBUG_SERIAL_LOGGING // Waits for Serial monitor before startup
+// #define DEBUG_LOOP_LATENCY // Logs loop() pass times every 10 seconds
+// Build with -DBLE_BLOCKING_POLL to measure the old ble.update(200) polling for comparison
+// Build with -DDIAGNOSTICS for hot path timing histograms (see Diag.h)
+// Frame counter is persisted once every FCNT_CHECKPOINT_INTERVAL uplinks rather than after each one.
+#define FCNT_CHECKPOINT_INTERVAL 16
 // #define DEBUG_FORGET_SESSION_VARS // Stored settings include session keys - uncomment and run once to erase
 
 // If you want to statically define ABP parameters, put them below and uncomment the lines
@@ -31,18 +40,30 @@
 
 #include "Lora.h"
 #include "Bluetooth.h"
+#include "TxQueue.h"
+#include "Airtime.h"
+#include "Survey.h"
+#include "LocationCodec.h"
+#include "Fragment.h"
+#include "Battery.h"
+#include "Idle.h"
+#include "Diag.h"
+#include "Latency.h"
+#include "Backlog.h"
+#include "SettingsStore.h"
 #include "Adafruit_BLE.h" // Define TimeoutTimer
 #include "Logging.h"
+#include "TokenLog.h"
 
-#define offset(s, field) ((u1_t *)(&s.field) - (u1_t *)&s)
-
+// In-memory settings. Persisted field by field through SettingsStore.
+// The layout is also the V1 on-NVM format, which is migrated on first boot.
 typedef struct {
 #define PERSISTENT_FORMAT_UNINITIALIZED 0
 #define PERSISTENT_FORMAT_V1 1
-  uint32_t format;
+  uint32_t format; // Only meaningful in a V1 image
   uint32_t flags; // Bit flags indicating what values in structure are set
 
-  uint32_t seq_no;
+  uint32_t seq_no; // Frame counter reservation: every counter used so far is below this value
 
 // Flag bit #0 used to mean something. To reuse it, bump the format number.
 #define FLAG_DEV_ADDR_SET (1 << 4)
@@ -61,37 +82,139 @@ typedef struct {
 #define FLAG_DEV_EUI_SET (1 << 3)
   u1_t DevEUI[8];
 #define FLAG_JOIN_VARS_SET (FLAG_APP_KEY_SET | FLAG_APP_EUI_SET | FLAG_DEV_EUI_SET)
+
+// Not part of this structure, which doubles as the V1 layout
+#define FLAG_MAC_STATE_SET (1 << 7)
 } PersistentSettings;
 
 PersistentSettings settings;
 
-// Otherwise, this value connects a sendPacket request with tx result notification
+// MAC state of the current session, as last saved. Valid if FLAG_MAC_STATE_SET.
+static LoraSessionState macState;
+
+// OTAA DevNonce and back-off state. Zero until the first join request.
+static LoraJoinState joinState;
+
+// Index of the channel plan in use. See ChannelPlan.h.
+static uint8_t channelPlan = 0;
+
+// Incremented at each boot. Tells backlog samples stored before this boot, whose millis() mean nothing now.
+static uint16_t bootCount = 0;
+
+// Incremented at each successful join. Starts the frame counter reservation over. See SettingsStore.h.
+static uint32_t joinCount = 0;
+
+// Store record ids. Never reuse an id for a different field.
+#define RECORD_seq_no  1
+#define RECORD_DevAddr 2
+#define RECORD_NwkSKey 3
+#define RECORD_AppSKey 4
+#define RECORD_AppKey  5
+#define RECORD_AppEUI  6
+#define RECORD_DevEUI  7
+#define RECORD_MacState 8
+#define RECORD_JoinState 9
+#define RECORD_ChannelPlan 10
+#define RECORD_BootCount 11
+#define RECORD_JoinCount 12
+
+#define SETTINGS_FIELD(name, flag) { RECORD_##name, (uint8_t *)&settings.name, sizeof(settings.name), flag }
+static const SettingsField settingsFields[] = {
+  // Ahead of seq_no, whose generation it is, so that compaction writes it first
+  { RECORD_JoinCount, (uint8_t *)&joinCount, sizeof(joinCount), 0, true },
+  { RECORD_seq_no, (uint8_t *)&settings.seq_no, sizeof(settings.seq_no), 0, true, RECORD_JoinCount },
+  SETTINGS_FIELD(DevAddr, FLAG_DEV_ADDR_SET),
+  SETTINGS_FIELD(NwkSKey, FLAG_NWK_SKEY_SET),
+  SETTINGS_FIELD(AppSKey, FLAG_APP_SKEY_SET),
+  SETTINGS_FIELD(AppKey, FLAG_APP_KEY_SET),
+  SETTINGS_FIELD(AppEUI, FLAG_APP_EUI_SET),
+  SETTINGS_FIELD(DevEUI, FLAG_DEV_EUI_SET),
+  { RECORD_MacState, (uint8_t *)&macState, sizeof(macState), FLAG_MAC_STATE_SET },
+  { RECORD_JoinState, (uint8_t *)&joinState, sizeof(joinState), 0 },
+  { RECORD_ChannelPlan, &channelPlan, sizeof(channelPlan), 0 },
+  { RECORD_BootCount, (uint8_t *)&bootCount, sizeof(bootCount), 0 },
+};
+
+// Next uplink frame counter. Runs ahead of the last checkpoint in settings.seq_no
+// until it reaches it, at which point a new block of counters is reserved.
+static uint32_t nextSeqNo = 0;
+
+// Frame handed to LMIC and awaiting EV_TXCOMPLETE. Others wait in TxQueue.
+// This value connects sendPacket requests with tx result notifications:
+// an aggregated frame carries several samples, each reported under its BLE seq.
 static struct {
   bool active;
-  u1_t bleSeq;
+  uint8_t count;
+  u1_t bleSeqs[TXQUEUE_CAPACITY];
+  ostime_t writeAt[TXQUEUE_CAPACITY];  // Latency stamps of each sample
+  ostime_t queuedAt[TXQUEUE_CAPACITY];
+  bool locationKey; // The frame carries a location key frame
 } CurrentTx = {false, 0};
 
 extern "C" {
   void debugPrint(const char *msg) {
-    Log.Debug(msg);
-    Log.Debug(CR);
+    TLOG_DEBUG("%s" CR, msg);
   }
 
   void debugLog(const char *msg, uint32_t value) {
-    Log.Debug(F("%s %x" CR), msg, value);
+    TLOG_DEBUG("%s %x" CR, msg, value);
   }
 
   void debugLogData(const char *msg, uint8_t data[], uint16_t len) {
+    #if LOG_LEVEL>=LOG_LEVEL_DEBUG
+    #if defined(TOKENIZED_LOGGING)
+    TokenLogBytes bytes = { data, len };
+    TLOG_DEBUG("%s (Length: %d): %H" CR, msg, len, bytes);
+    #else
     char buffer[200+1];
+    buffer[0] = 0;
     Log.Debug(F("%s (Length: %d): "), msg, len);
     for(uint i=0; i<min(len, sizeof(buffer)/2); ++i) {
       snprintf(buffer+2*i, sizeof(buffer)-2*i, "%02x", data[i]);
     }
     Log.Debug_(F("%s" CR), buffer);
+    #endif
+    #endif
   }
 } // extern "C".
 
 #define CMD_DISCONNECT 1
+#define CMD_QUEUE_DROP_NEWEST 2
+#define CMD_QUEUE_DROP_OLDEST 3
+#define CMD_AGGREGATE_OFF 4
+#define CMD_AGGREGATE_ON 5
+#define CMD_DIAG_DUMP 6
+
+/* Uplink aggregation. Queued samples are packed into one frame on
+  AGGREGATE_PORT as [len][sample] pairs, up to the maximum payload of the
+  current data rate. A partial frame is held while the oldest sample is younger
+  than AGGREGATE_MAX_AGE_MS or the duty cycle blocks sending, so more samples
+  can join. Priority samples flush at once. A frame with a single sample goes
+  out unchanged on SINGLE_PORT.
+*/
+#define SINGLE_PORT 1
+#define AGGREGATE_PORT 2
+#define AGGREGATE_MAX_AGE_MS 2000
+
+/* Offline backlog. Plain samples that arrive without a session, or with the
+  queue full, are stored in flash (Backlog.h) instead of being dropped. When the
+  radio and the duty cycle are free and nothing else waits, they go out on
+  BACKLOG_PORT as [len][age][sample] entries, up to the maximum payload. An
+  entry too long for the current data rate goes out at a faster one.
+  age is the 16bit little endian seconds between storing and sending,
+  BACKLOG_AGE_UNKNOWN if the sample is from an earlier boot.
+*/
+#define BACKLOG_PORT 3
+#define BACKLOG_ENTRY_HEADER 3
+#define BACKLOG_AGE_UNKNOWN 0xFFFF
+
+/* Location frames (LocationCodec.h) go out one per frame on LOCATION_PORT. They
+  are never aggregated or stored in the backlog, where the network could not
+  tell them from the phone's own payloads. Key frames jump the queue, so that
+  the deltas behind them can be decoded.
+*/
+#define LOCATION_PORT 4
+static bool aggregateSamples = true;
 
 void sendCommandCallback(uint8_t data[], uint16_t len) {
   uint16_t command = *(uint16_t *)data;
@@ -100,59 +223,303 @@ void sendCommandCallback(uint8_t data[], uint16_t len) {
     case CMD_DISCONNECT:
       bluetoothDisconnect();
       break;
+    case CMD_QUEUE_DROP_NEWEST:
+      txQueueSetPolicy(DropNewest);
+      break;
+    case CMD_QUEUE_DROP_OLDEST:
+      txQueueSetPolicy(DropOldest);
+      break;
+    case CMD_AGGREGATE_OFF:
+      aggregateSamples = false;
+      break;
+    case CMD_AGGREGATE_ON:
+      aggregateSamples = true;
+      break;
+    #if defined(DIAGNOSTICS)
+    case CMD_DIAG_DUMP:
+      diagDump();
+      break;
+    #endif
   }
 }
 
-void enqueuePacket(uint8_t bleSeq, uint8_t data[], uint16_t len) {
+static void reportQueueStatus() {
+  sendQueueStatus(txQueueDepth(), TXQUEUE_CAPACITY, txQueuePolicy(), txQueueOverflows());
+}
+
+static void reportAirtimeStatus() {
+  uint32_t now = millis();
+  sendAirtimeStatus(airtimeUntilNextTxMs(now), airtimeBudgetRemainingMs(now), loraLastAirtimeMs());
+}
+
+// Hands the next frame of queued packets to LMIC if the radio is free. Returns true if one was sent.
+static bool sendNextPacket() {
+  if (CurrentTx.active || !loraReadyToSend()) {
+    return false;
+  }
+  TxPacket *first = txQueuePeek();
+  if (first==NULL) {
+    return false;
+  }
+
+  // Count the samples that fit one aggregated frame
+  uint8_t count = 1;
+  uint16_t frameLen = 0;
+  if (aggregateSamples) {
+    uint8_t maxLen = loraMaxPayload();
+    count = 0;
+    TxPacket *p;
+    // A frame is confirmed or not as a whole, so it stops at a sample that differs.
+    // Location frames have a port of their own.
+    while ((p = txQueuePeekAt(count))!=NULL && p->confirmed==first->confirmed
+      && !p->location && !first->location && frameLen + 1 + p->len <= maxLen) {
+      frameLen += 1 + p->len;
+      ++count;
+    }
+    bool full = (p!=NULL);
+    uint32_t now = millis();
+    bool young = now - first->queuedMs < AGGREGATE_MAX_AGE_MS;
+    if (!full && !first->priority && (young || airtimeUntilNextTxMs(now)>0)) {
+      return false; // Hold for more samples
+    }
+  }
+
+  bool sent;
+  if (count<=1) {
+    // Single sample, location frame, or one too long to share a frame
+    count = 1;
+    uint8_t port = first->location ? LOCATION_PORT : SINGLE_PORT;
+    sent = loraSendBytes(port, first->data, first->len, first->confirmed);
+  }
+  else {
+    uint8_t frame[MAX_LEN_PAYLOAD];
+    uint8_t pos = 0;
+    for (uint8_t i=0; i<count; ++i) {
+      TxPacket *p = txQueuePeekAt(i);
+      frame[pos++] = p->len;
+      memcpy(&frame[pos], p->data, p->len);
+      pos += p->len;
+    }
+    debugLog("Aggregated samples: ", count);
+    sent = loraSendBytes(AGGREGATE_PORT, frame, pos, first->confirmed);
+  }
+  if (!sent) {
+    return false;
+  }
+  DIAG_SPAN_BEGIN_AT(DiagTxWriteToStart, first->queuedMs * 1000); // micros() runs in step with millis()
+  CurrentTx.active = true;
+  CurrentTx.count = count;
+  CurrentTx.locationKey = false;
+  for (uint8_t i=0; i<count; ++i) {
+    TxPacket *p = txQueuePeek();
+    CurrentTx.bleSeqs[i] = p->bleSeq;
+    CurrentTx.writeAt[i] = p->writeAt;
+    CurrentTx.queuedAt[i] = p->queuedAt;
+    CurrentTx.locationKey |= p->location && locationIsKey(p->data);
+    txQueuePop();
+  }
+  return true;
+}
+
+// location marks a LocationCodec frame. Losing a key frame starts a new key.
+void enqueuePacket(uint8_t bleSeq, bool priority, bool confirmed, uint8_t data[], uint16_t len, bool location) {
   debugLog("sendPacket with BLE seq: ", bleSeq);
   debugLogData("sendPacket: ", data, len);
-  if (!CurrentTx.active) {
-    CurrentTx.active = true;
-    CurrentTx.bleSeq = bleSeq;
-    loraSendBytes(data, len);
+  // Backlog entries are unconfirmed and go after everything queued, so priority and
+  // confirmed packets stay with the queue, as do location frames. Every region has
+  // a data rate that carries a stored entry.
+  bool store = !priority && !confirmed && !location && BACKLOG_ENTRY_HEADER + len <= MAX_LEN_PAYLOAD
+    && (!loraHasSession() || txQueueDepth()==TXQUEUE_CAPACITY);
+  uint32_t dropped = backlogDropped();
+  if (store && backlogAppend(data, len, millis())) {
+    debugLog("Stored in backlog. BLE seq: ", bleSeq);
+    if (backlogDropped()!=dropped) {
+      TLOG_WARN("Backlog full. Dropped %d samples" CR, backlogDropped() - dropped);
+    }
+    static const uint16_t noLatencyMs[LATENCY_STAGES] = {0};
+    sendTxResult(bleSeq, TX_ERROR_STORED, 0, 0, 0, 0, noLatencyMs);
+    return;
+  }
+  TxPacket *p = txQueuePush(bleSeq, priority, confirmed, data, len);
+  if (p==NULL) {
+    debugPrint("Send dropped - transmit queue full");
+    if (location && locationIsKey(data)) {
+      locationReset();
+    }
   }
   else {
-    debugPrint("Send ignored - active transmission not completed");
+    p->writeAt = latencyLastGattWrite();
+    p->queuedAt = os_getTime();
+    p->location = location;
   }
+  sendNextPacket();
+  reportQueueStatus();
 }
 void sendPacketCallback(uint8_t data[], uint16_t len) {
-  enqueuePacket(0, data, len);
+  enqueuePacket(0, false, false, data, len, false);
 }
 
 void sendPacketWithAckCallback(uint8_t data[], uint16_t len) {
   // Includes ble seq as first byte of packet. Don't send that out.
-  enqueuePacket(data[0], data+1, len-1);
+  enqueuePacket(data[0], false, false, data+1, len-1, false);
 }
 
-void saveSettingBytes(uint8_t offset, uint8_t *bytes, uint8_t length) {
-  bool success = writeNVBytes(offset, bytes, length);
-  if (!success) {
-    debugPrint("ERROR: Failed to write settings bytes!");
-    debugLog("Offset:", offset);
-    debugLog("Length:", length);
-    debugLogData("Data:", bytes, length);
+void sendPriorityPacketCallback(uint8_t data[], uint16_t len) {
+  // Same format as sendPacketWithAck, but jumps ahead of normal queued packets.
+  enqueuePacket(data[0], true, false, data+1, len-1, false);
+}
+
+void sendConfirmedPacketCallback(uint8_t data[], uint16_t len) {
+  // Same format as sendPacketWithAck. Sent as a confirmed uplink, retried until
+  // the network acknowledges it or LORA_CONFIRMED_MAX_ATTEMPTS run out.
+  enqueuePacket(data[0], false, true, data+1, len-1, false);
+}
+
+// Survey pings only take an idle radio. Packets from the phone go first.
+static bool surveyPing(uint8_t seq, uint8_t sf, uint8_t data[], uint8_t len) {
+  if (CurrentTx.active || txQueueDepth() || !loraReadyToSend()) {
+    return false;
+  }
+  loraSetNextSF(sf);
+  if (!loraSendBytes(SINGLE_PORT, data, len, false)) {
+    return false;
+  }
+  DIAG_SPAN_BEGIN_AT(DiagTxWriteToStart, micros());
+  CurrentTx.active = true;
+  CurrentTx.count = 1;
+  CurrentTx.locationKey = false;
+  CurrentTx.bleSeqs[0] = seq;
+  CurrentTx.writeAt[0] = CurrentTx.queuedAt[0] = os_getTime(); // Not from the phone: no BLE or queue stage
+  return true;
+}
+
+// Backlog records in the frame handed to LMIC. Marked sent on success.
+static uint16_t backlogInFlight = 0;
+
+// Sends the oldest backlog samples when the radio would otherwise idle. Returns true if a frame was sent.
+static bool drainBacklog() {
+  uint32_t now = millis();
+  if (backlogCount()==0 || CurrentTx.active || txQueueDepth() || !loraReadyToSend()
+    || airtimeUntilNextTxMs(now)>0) {
+    return false;
+  }
+  BacklogRecord r;
+  if (!backlogPeekAt(0, &r)) {
+    return false; // Records given up as damaged
+  }
+  if (BACKLOG_ENTRY_HEADER + r.len > loraMaxPayload()) {
+    // Too long for this data rate. This frame goes at the most robust rate that carries it.
+    uint8_t sf = loraSfFor(BACKLOG_ENTRY_HEADER + r.len);
+    if (sf==0) {
+      // enqueuePacket stores nothing this long. It would hold up the backlog forever.
+      TLOG_WARN("Backlog sample too long for any frame. Dropped." CR);
+      backlogMarkSent(1);
+      return false;
+    }
+    loraSetNextSF(sf);
+  }
+  uint8_t maxLen = loraMaxPayload();
+  uint8_t frame[MAX_LEN_PAYLOAD];
+  uint8_t pos = 0;
+  uint16_t count = 0;
+  while (backlogPeekAt(count, &r) && pos + BACKLOG_ENTRY_HEADER + r.len <= maxLen) {
+    uint16_t age = BACKLOG_AGE_UNKNOWN;
+    if (r.bootId==bootCount) {
+      uint32_t s = (now - r.timeMs) / 1000;
+      age = s<BACKLOG_AGE_UNKNOWN ? s : BACKLOG_AGE_UNKNOWN - 1;
+    }
+    frame[pos++] = r.len;
+    frame[pos++] = age & 0xFF;
+    frame[pos++] = age >> 8;
+    memcpy(&frame[pos], r.data, r.len);
+    pos += r.len;
+    ++count;
+  }
+  if (count==0 || !loraSendBytes(BACKLOG_PORT, frame, pos, false)) {
+    return false;
+  }
+  debugLog("Backlog samples sent: ", count);
+  CurrentTx.active = true;
+  CurrentTx.count = 0; // No BLE seqs to report
+  CurrentTx.locationKey = false;
+  backlogInFlight = count;
+  return true;
+}
+
+// A key frame dropped from the queue orphans the deltas against it. Start a new key.
+static void onQueueDrop(const TxPacket *p) {
+  if (p->location && locationIsKey(p->data)) {
+    locationReset();
+  }
+}
+
+// [ble seq][lat int32 1e-7 deg][lon int32 1e-7 deg][alt int16 m], little endian
+void sendLocationCallback(uint8_t data[], uint16_t len) {
+  LocationFix fix;
+  memcpy(&fix.lat, &data[1], sizeof(fix.lat));
+  memcpy(&fix.lon, &data[5], sizeof(fix.lon));
+  memcpy(&fix.alt, &data[9], sizeof(fix.alt));
+  uint8_t frame[LOCATION_MAX_FRAME];
+  uint8_t frameLen = locationEncode(&fix, frame);
+  enqueuePacket(data[0], locationIsKey(frame), false, frame, frameLen, true);
+}
+
+// Notified on the Send fragment characteristic when a payload completes or is dropped:
+// 8bit ble seq, 8bit FragmentStatus, 8bit bytes reassembled
+static void reportFragmentStatus(FragmentStatus status);
+
+void sendFragmentCallback(uint8_t data[], uint16_t len) {
+  FragmentStatus status = fragmentReceive(data, len, millis());
+  if (status==FragmentPending) {
+    return;
+  }
+  if (status==FragmentComplete) {
+    FragmentPayload *p = fragmentPayload();
+    if (p->len>loraMaxPayload()) {
+      // LMIC would send an illegal frame. The phone may retry at a faster data rate.
+      status = FragmentOverRate;
+    }
+    else {
+      enqueuePacket(p->bleSeq, p->priority, false, p->data, p->len, false);
+    }
   }
+  reportFragmentStatus(status);
+}
+
+void surveyConfigCallback(uint8_t data[], uint16_t len) {
+  surveyConfigure(data, len);
 }
 
-void saveSettingValue(uint8_t offset, uint32_t value) {
-  bool success = writeNVInt(offset, value);
+// Writes all fields marked dirty. Each dirty field costs one appended record.
+void saveSettings() {
+  bool success = settingsStoreCommit();
   if (!success) {
-    debugPrint("ERROR: Failed to write settings value!");
-    debugLog("Offset:", offset);
-    debugLog("Value:", value);
+    debugPrint("ERROR: Failed to write settings!");
   }
 }
 
+void saveSetting(uint8_t id) {
+  settingsStoreMarkDirty(id);
+  saveSettings();
+}
+
+// A new session starts from LMIC defaults
+static void forgetMacState() {
+  settings.flags &= ~FLAG_MAC_STATE_SET;
+  settingsStoreMarkDirty(RECORD_MacState);
+}
+
 #define AssignSessionCallback(key, flag) \
 void assign##key##Callback(uint8_t data[], uint16_t len) { \
   debugLogData("assign" #key, data, len); \
   if (len==sizeof(settings.key)) {        \
     memcpy(settings.key, data, sizeof(settings.key)); \
-    saveSettingBytes(offset(settings, key), settings.key, sizeof(settings.key)); \
     settings.flags |= flag; \
-    saveSettingValue(offset(settings, flags), settings.flags); \
+    forgetMacState(); \
+    saveSetting(RECORD_##key); \
     if ((settings.flags & FLAG_SESSION_VARS_SET)==FLAG_SESSION_VARS_SET) { \
-      loraSetSessionKeys(settings.seq_no, settings.AppSKey, settings.NwkSKey, settings.DevAddr); \
+      loraSetSessionKeys(nextSeqNo, settings.AppSKey, settings.NwkSKey, settings.DevAddr); \
+      surveyResume(); \
     } \
   } \
 }
@@ -162,17 +529,18 @@ AssignSessionCallback(NwkSKey, FLAG_NWK_SKEY_SET)
 AssignSessionCallback(AppSKey, FLAG_APP_SKEY_SET)
 
 void onJoin(u1_t *appskey, u1_t *nwkskey, u1_t *devaddr);
+void onJoinProgress(LoraJoinPhase phase, const LoraJoinState *state, uint8_t sf, uint32_t waitMs, uint32_t elapsedMs);
 
 #define AssignAppCallback(key, flag) \
 void assign##key##Callback(uint8_t data[], uint16_t len) { \
   debugLogData("assign" #key, data, len); \
   if (len==sizeof(settings.key)) {        \
     memcpy(settings.key, data, sizeof(settings.key)); \
-    saveSettingBytes(offset(settings, key), settings.key, sizeof(settings.key)); \
     settings.flags |= flag; \
-    saveSettingValue(offset(settings, flags), settings.flags); \
+    saveSetting(RECORD_##key); \
     if ((settings.flags & FLAG_JOIN_VARS_SET)==FLAG_JOIN_VARS_SET) { \
-      loraJoin(settings.seq_no, settings.AppKey, settings.AppEUI, settings.DevEUI, onJoin); \
+      loraJoin(nextSeqNo, settings.AppKey, settings.AppEUI, settings.DevEUI, onJoin, &joinState, onJoinProgress); \
+      surveyResume(); \
     } \
   } \
 }
@@ -181,6 +549,30 @@ AssignAppCallback(AppKey, FLAG_APP_KEY_SET)
 AssignAppCallback(AppEUI, FLAG_APP_EUI_SET)
 AssignAppCallback(DevEUI, FLAG_DEV_EUI_SET)
 
+static void reportChannelPlan();
+
+// [plan index]. Unknown plans are refused. The characteristic reads back the plan in use.
+void channelPlanCallback(uint8_t data[], uint16_t len) {
+  if (len==1 && loraSetChannelPlan(data[0])) {
+    channelPlan = data[0];
+    saveSetting(RECORD_ChannelPlan);
+  }
+  else {
+    TLOG_WARN("No channel plan %d" CR, data[0]);
+  }
+  reportChannelPlan();
+}
+
+static void reportLatency(uint8_t stage);
+
+// [LatencyStage]. The characteristic then reads back that stage's summary.
+void latencyCallback(uint8_t data[], uint16_t len) {
+  if (data[0]<LATENCY_STAGES) {
+    reportLatency(data[0]);
+  }
+}
+
+// 7-10 (7-12 in EU868) fixes SF. 0 lets the node pick SF from link quality.
 void assignSpreadingFactorCallback(uint8_t data[], uint16_t len) {
   if (len==1) {
     uint sf = data[0];
@@ -250,8 +642,74 @@ CharacteristicConfigType charConfigs[] = {
   "AT+GATTADDCHAR=UUID=0x2ADB,PROPERTIES=0x08,MIN_LEN=1,MAX_LEN=20,DATATYPE=2,DESCRIPTION=Send acknowledged packet",
   sendPacketWithAckCallback
 },
+#define GattSendPriorityPacket (charConfigs[10])
+{
+  UNINITIALIZED,
+  "AT+GATTADDCHAR=UUID=0x2ADD,PROPERTIES=0x08,MIN_LEN=1,MAX_LEN=20,DATATYPE=2,DESCRIPTION=Send priority packet",
+  sendPriorityPacketCallback
+},
+#define GattSurveyConfig (charConfigs[11])
+{
+  UNINITIALIZED,
+  "AT+GATTADDCHAR=UUID=0x2ADF,PROPERTIES=0x0A,MIN_LEN=5,MAX_LEN=20,DATATYPE=2,DESCRIPTION=Survey config",
+  surveyConfigCallback
+},
+#define GattSendLocation (charConfigs[12])
+{
+  UNINITIALIZED,
+  "AT+GATTADDCHAR=UUID=0x2AE0,PROPERTIES=0x08,MIN_LEN=11,MAX_LEN=11,DATATYPE=2,DESCRIPTION=Send location",
+  sendLocationCallback
+},
+#define GattSendFragment (charConfigs[13])
+{
+  UNINITIALIZED,
+  // 0x18 write and notify: completion is notified on the same characteristic
+  "AT+GATTADDCHAR=UUID=0x2AE2,PROPERTIES=0x18,MIN_LEN=2,MAX_LEN=20,DATATYPE=2,DESCRIPTION=Send fragment",
+  sendFragmentCallback
+},
+#define GattSendConfirmedPacket (charConfigs[14])
+{
+  UNINITIALIZED,
+  "AT+GATTADDCHAR=UUID=0x2AE6,PROPERTIES=0x08,MIN_LEN=1,MAX_LEN=20,DATATYPE=2,DESCRIPTION=Send confirmed packet",
+  sendConfirmedPacketCallback
+},
+#define GattChannelPlan (charConfigs[15])
+{
+  UNINITIALIZED,
+  "AT+GATTADDCHAR=UUID=0x2AE7,PROPERTIES=0x0A,MIN_LEN=1,MAX_LEN=1,DESCRIPTION=Channel plan",
+  channelPlanCallback
+},
+#define GattLatency (charConfigs[16])
+{
+  UNINITIALIZED,
+  "AT+GATTADDCHAR=UUID=0x2AE8,PROPERTIES=0x0A,MIN_LEN=1,MAX_LEN=8,DATATYPE=2,DESCRIPTION=Latency summary",
+  latencyCallback
+},
 };
 
+// 8bit stage, 8bit uplinks in window, 16bit min ms, 16bit median ms, 16bit 95th percentile ms
+static void reportLatency(uint8_t stage) {
+  LatencySummary summary;
+  latencySummary((LatencyStage)stage, &summary);
+  uint8_t buffer[8];
+  buffer[0] = stage;
+  buffer[1] = summary.count;
+  memcpy(&buffer[2], (uint8_t *)&summary.minMs, sizeof(summary.minMs));
+  memcpy(&buffer[4], (uint8_t *)&summary.medianMs, sizeof(summary.medianMs));
+  memcpy(&buffer[6], (uint8_t *)&summary.p95Ms, sizeof(summary.p95Ms));
+  setBluetoothCharData(GattLatency.charId, buffer, sizeof(buffer));
+}
+
+static void reportChannelPlan() {
+  setBluetoothCharData(GattChannelPlan.charId, &channelPlan, sizeof(channelPlan));
+}
+
+static void reportFragmentStatus(FragmentStatus status) {
+  FragmentPayload *p = fragmentPayload();
+  uint8_t buffer[3] = {p->bleSeq, (uint8_t)status, p->len};
+  sendBluetoothCharEvent(GattSendFragment.charId, buffer, sizeof(buffer));
+}
+
 static void logToBluetooth(const char *s) {
   if (Serial) {
     Serial.print(s);
@@ -261,9 +719,20 @@ static void logToBluetooth(const char *s) {
 static char logBuffer[200];
 LogBufferedPrinter BluetoothPrinter(logToBluetooth, logBuffer, sizeof(logBuffer));
 
-bool loadStaticLoraDefines(PersistentSettings &settings) {
+#if defined(TOKENIZED_LOGGING)
+// Binary records go wherever text logging goes
+void tokenLogWrite(uint8_t const *data, uint16_t len) {
+  if (Serial) {
+    Serial.write(data, len);
+  }
+  #if !defined(DEBUG_SERIAL_LOGGING)
+  sendLogBytes(data, len);
+  #endif
+}
+#endif
+
+void loadStaticLoraDefines(PersistentSettings &settings) {
   debugPrint("loadStaticLoraDefines");
-  bool write = false; // Can't just compare old and new flags because we may be changing a value already set - flag would stay the same
   #ifdef PROGMEM
     #define _memcpy memcpy_P
   #else
@@ -278,7 +747,7 @@ bool loadStaticLoraDefines(PersistentSettings &settings) {
     settings.flags |= flag; \
     Log.Info(F("Overriding " #name " with static initializer: " #bytes CR)); \
     debugLogData("Static " #name, settings.name, sizeof(settings.name)); \
-    write = true;
+    settingsStoreMarkDirty(RECORD_##name); /* Value may change while flag stays the same */
 
   #if defined(DEVADDR)
     STATIC_INIT(DEVADDR, DevAddr, FLAG_DEV_ADDR_SET)
@@ -301,7 +770,6 @@ bool loadStaticLoraDefines(PersistentSettings &settings) {
   #endif
 
   debugLog("Following static initialization, Flags: ", settings.flags);
-  return write;
 }
 
 void reportSessionVars() {
@@ -329,18 +797,72 @@ void reportJoinVars() {
 }
 
 void onJoin(u1_t *appskey, u1_t *nwkskey, u1_t *devaddr) {
-  if (appskey==NULL) {
-    debugPrint("Join failed");
+  TLOG_INFO("Join succeeded" CR);
+  memcpy(settings.AppSKey, appskey, sizeof(settings.AppSKey));
+  memcpy(settings.NwkSKey, nwkskey, sizeof(settings.NwkSKey));
+  memcpy(settings.DevAddr, devaddr, sizeof(settings.DevAddr));
+  settings.flags |= FLAG_SESSION_VARS_SET;
+  settingsStoreMarkDirty(RECORD_AppSKey);
+  settingsStoreMarkDirty(RECORD_NwkSKey);
+  settingsStoreMarkDirty(RECORD_DevAddr);
+  // LMIC starts the new session's frame counter at 0. Keeping the old reservation
+  // would open a gap the network refuses. The join count makes the store take the
+  // smaller reservation over the old session's larger ones.
+  nextSeqNo = 0;
+  settings.seq_no = FCNT_CHECKPOINT_INTERVAL;
+  settingsStoreMarkDirty(RECORD_seq_no);
+  ++joinCount;
+  settingsStoreMarkDirty(RECORD_JoinCount);
+  forgetMacState();
+  saveSettings(); // Keys and counters in one append
+  reportSessionVars();
+}
+
+// Each join request's DevNonce is saved before the network can answer it,
+// so a reboot never sends it again. The reset after joining goes out with
+// the session keys.
+void onJoinProgress(LoraJoinPhase phase, const LoraJoinState *state, uint8_t sf, uint32_t waitMs, uint32_t elapsedMs) {
+  joinState = *state;
+  if (phase==JoinAttempt) {
+    saveSetting(RECORD_JoinState);
   }
   else {
-    Log.Info(F("Join succeeded" CR));
-    memcpy(settings.AppSKey, appskey, sizeof(settings.AppSKey));
-    memcpy(settings.NwkSKey, nwkskey, sizeof(settings.NwkSKey));
-    memcpy(settings.DevAddr, devaddr, sizeof(settings.DevAddr));
-    settings.flags |= FLAG_SESSION_VARS_SET;
-    saveSettingBytes(0, (u1_t *)(&settings), sizeof(settings));
-    reportSessionVars();
+    settingsStoreMarkDirty(RECORD_JoinState);
   }
+  sendJoinStatus(phase, state->attempts, sf, state->devNonce, waitMs, elapsedMs);
+}
+
+// Takes a snapshot of the MAC state and marks it for saving
+static void snapshotMacState() {
+  loraGetSessionState(&macState);
+  settings.flags |= FLAG_MAC_STATE_SET;
+  settingsStoreMarkDirty(RECORD_MacState);
+}
+
+// True if the network changed a setting the saved snapshot holds. Counters,
+// airtime, data rate and power move with the node's own SF selection, up to
+// every uplink, and are saved with checkpoints only.
+static bool macStateChanged() {
+  if (!(settings.flags & FLAG_MAC_STATE_SET)) {
+    return true;
+  }
+  LoraSessionState current;
+  loraGetSessionState(&current);
+  return current.dn2Freq!=macState.dn2Freq
+    || current.rx1DrOffset!=macState.rx1DrOffset
+    || current.dn2Dr!=macState.dn2Dr
+    || current.rxDelay!=macState.rxDelay
+    || memcmp(current.channelMap, macState.channelMap, sizeof(current.channelMap))!=0;
+}
+
+// Persists a new frame counter reservation FCNT_CHECKPOINT_INTERVAL ahead of seq_no,
+// together with the MAC state, in one append.
+static void checkpointSeqNo(uint32_t seq_no) {
+  settings.seq_no = seq_no + FCNT_CHECKPOINT_INTERVAL;
+  debugLog("Checkpoint lora seq reservation:", settings.seq_no);
+  settingsStoreMarkDirty(RECORD_seq_no);
+  snapshotMacState();
+  saveSettings();
 }
 
 void onTransmit(uint16_t error, uint32_t tx_seq_no, u1_t *received, u1_t length) {
@@ -349,16 +871,76 @@ void onTransmit(uint16_t error, uint32_t tx_seq_no, u1_t *received, u1_t length)
   }
   else {
     CurrentTx.active = false;
-    if (!error) {
-      // Success!
-      settings.seq_no = tx_seq_no + 1;
-      debugLog("Successful transmission. Storing NEXT lora seq:", settings.seq_no);
-      saveSettingValue(offset(settings, seq_no), settings.seq_no);
-
-      debugLog("Successful transmission. Returning BLE seq:", CurrentTx.bleSeq);
-      sendTxResult(CurrentTx.bleSeq, error, tx_seq_no);
+    if (error && CurrentTx.locationKey) {
+      locationReset(); // Deltas would name a key frame that never went out
+    }
+    if (backlogInFlight) {
+      if (!error) {
+        backlogMarkSent(backlogInFlight);
+      }
+      backlogInFlight = 0;
+    }
+    batteryRecordPing();
+    // LMIC may have consumed a counter even if the transmission failed
+    nextSeqNo = tx_seq_no + 1;
+    if (nextSeqNo>=settings.seq_no) {
+      checkpointSeqNo(nextSeqNo);
     }
+    else if (macStateChanged()) {
+      snapshotMacState();
+      saveSettings();
+    }
+    LoraTxInfo tx;
+    loraLastTxInfo(&tx);
+    uint8_t flags = 0;
+    if (tx.confirmed) {
+      flags |= TX_RESULT_CONFIRMED;
+    }
+    if (tx.acked) {
+      flags |= TX_RESULT_ACKED;
+    }
+    if (tx.acked || length) {
+      flags |= TX_RESULT_HEARD;
+    }
+    ostime_t now = os_getTime();
+    for (uint8_t i=0; i<CurrentTx.count; ++i) {
+      uint16_t latencyMs[LATENCY_STAGES];
+      latencyMs[LatencyBle] = latencyDeltaMs(CurrentTx.writeAt[i], CurrentTx.queuedAt[i]);
+      latencyMs[LatencyQueue] = latencyDeltaMs(CurrentTx.queuedAt[i], tx.sentAt);
+      latencyMs[LatencyLmic] = latencyDeltaMs(tx.sentAt, tx.startAt);
+      latencyMs[LatencyRadio] = latencyDeltaMs(tx.startAt, tx.completeAt);
+      latencyMs[LatencyResult] = latencyDeltaMs(tx.completeAt, now);
+      latencyRecord(latencyMs);
+      if (!error) {
+        // Success!
+        debugLog("Successful transmission. Returning BLE seq:", CurrentTx.bleSeqs[i]);
+      }
+      else {
+        debugLog("Failed transmission. Returning BLE seq:", CurrentTx.bleSeqs[i]);
+      }
+      sendTxResult(CurrentTx.bleSeqs[i], error, tx_seq_no, flags, tx.attempts, tx.sf, latencyMs);
+    }
+  }
+
+  // Automatic SF selection may have moved
+  static uint8_t reportedSF = 0;
+  uint8_t sf = loraCurrentSF();
+  if (sf!=reportedSF) {
+    reportedSF = sf;
+    setBluetoothCharData(GattSF.charId, &sf, sizeof(sf));
+  }
+
+  if (length) {
+    LoraRxInfo rx;
+    loraLastRxInfo(&rx);
+    sendDownlink(received, length, rx.port, rx.rssi, rx.snr, rx.fcnt);
   }
+
+  reportAirtimeStatus();
+
+  // Keep the radio busy while work is waiting
+  sendNextPacket();
+  reportQueueStatus();
 }
 
 static bool checkBytesSameValue(uint8_t *bytes, uint size, uint16_t flag, uint8_t value, const char *name) {
@@ -373,13 +955,13 @@ static bool checkBytesSameValue(uint8_t *bytes, uint size, uint16_t flag, uint8_
   return same;
 }
 
-static bool checkValidSettings() {
-  bool write = false;
-
+static void checkValidSettings() {
   #define CHECK_BYTES(name, flag)   \
     if (settings.flags & flag) {    \
-      write = write || checkBytesSameValue(settings.name, sizeof(settings.name), flag, 0x00, #name);  \
-      write = write || checkBytesSameValue(settings.name, sizeof(settings.name), flag, 0xFF, #name);  \
+      if (checkBytesSameValue(settings.name, sizeof(settings.name), flag, 0x00, #name)    \
+          || checkBytesSameValue(settings.name, sizeof(settings.name), flag, 0xFF, #name)) { \
+        settingsStoreMarkDirty(RECORD_##name);  \
+      }  \
     }
 
   CHECK_BYTES(DevAddr, FLAG_DEV_ADDR_SET)
@@ -388,40 +970,48 @@ static bool checkValidSettings() {
   CHECK_BYTES(AppKey, FLAG_APP_KEY_SET)
   CHECK_BYTES(AppEUI, FLAG_APP_EUI_SET)
   CHECK_BYTES(DevEUI, FLAG_DEV_EUI_SET)
+}
 
-  return write;
+// Called by the settings store for an image that is not in record format
+static bool migrateSettings(uint32_t format, uint8_t *image, uint16_t size) {
+  if (format==PERSISTENT_FORMAT_UNINITIALIZED) {
+    debugPrint("Initializing empty settings");
+    return true;
+  }
+  if (format==PERSISTENT_FORMAT_V1 && size>=sizeof(settings)) {
+    debugLogData("Migrating V1 settings", image, sizeof(settings));
+    memcpy(&settings, image, sizeof(settings));
+    return true;
+  }
+  return false;
 }
 
 static void loadSettings() {
   Log.Info(F("Loading saved settings" CR));
-  if (readNVBytes(0, (u1_t *)(&settings), sizeof(settings))) {
-    debugLogData("Read bytes from NVRAM", (u1_t *)(&settings), sizeof(settings));
-    // int i = offset(settings, AppEUI);
-    bool write = false;
-    if (settings.format==PERSISTENT_FORMAT_UNINITIALIZED) {
-      debugPrint("Updating uninitialized to V1");
-      settings.format = PERSISTENT_FORMAT_V1;
-      settings.flags = 0;
-      write = true;
-    }
-
-    if (settings.format==PERSISTENT_FORMAT_V1) {
-      write = write || loadStaticLoraDefines(settings);
-      #if defined(DEBUG_FORGET_SESSION_VARS)
-      settings.flags &= ~FLAG_SESSION_VARS_SET;  // Debug erase session vars set
-      write = true;
-      #endif
-    }
-    write = write || checkValidSettings();
-    if (write) {
-      debugLogData("Writing updated settings", (u1_t *)(&settings), sizeof(settings));
-      saveSettingBytes(0, (u1_t *)(&settings), sizeof(settings));
-    }
-  }
-  else {
+  settingsStoreInit(settingsFields, COUNT(settingsFields), &settings.flags);
+  if (!settingsStoreLoad(migrateSettings)) {
     Log.Debug(F("Failed to read settings" CR));
     return;
   }
+  debugLog("Loaded settings, Flags: ", settings.flags);
+
+  loadStaticLoraDefines(settings);
+  #if defined(DEBUG_FORGET_SESSION_VARS)
+  settings.flags &= ~FLAG_SESSION_VARS_SET;  // Debug erase session vars set
+  settingsStoreMarkDirty(RECORD_DevAddr);
+  settingsStoreMarkDirty(RECORD_NwkSKey);
+  settingsStoreMarkDirty(RECORD_AppSKey);
+  #endif
+  checkValidSettings();
+
+  // Counters between the last checkpoint and power loss may have been used,
+  // so resume at the reservation and reserve the next block.
+  nextSeqNo = settings.seq_no;
+  settings.seq_no = nextSeqNo + FCNT_CHECKPOINT_INTERVAL;
+  settingsStoreMarkDirty(RECORD_seq_no);
+  ++bootCount;
+  settingsStoreMarkDirty(RECORD_BootCount);
+  saveSettings(); // All boot time changes go out in one append
 
   reportSessionVars();
   reportJoinVars();
@@ -453,7 +1043,21 @@ void setup() {
       loadSettings();
     }
 
+    if (!backlogInit(bootCount)) {
+      TLOG_ERROR("***** Failed to initialize the offline backlog." CR);
+    }
+    else {
+      TLOG_INFO("Backlog: %d samples waiting" CR, backlogCount());
+    }
+
     bool loraok = setupLora(onTransmit);
+    surveySetup(surveyPing);
+    txQueueSetDropCallback(onQueueDrop);
+    if (!loraSetChannelPlan(channelPlan)) {
+      channelPlan = 0; // Saved by a build with more plans
+      loraSetChannelPlan(channelPlan);
+    }
+    reportChannelPlan();
     if (!loraok) {
       Log.Error(F("***** Failed to initialize LoRa radio subsystem." CR));
     }
@@ -461,11 +1065,14 @@ void setup() {
     if (btok && loraok) {
       if ((settings.flags & FLAG_SESSION_VARS_SET)==FLAG_SESSION_VARS_SET) {
         Log.Info(F("Session vars set - LoRa comms ready"));
-        loraSetSessionKeys(settings.seq_no, settings.AppSKey, settings.NwkSKey, settings.DevAddr);
+        loraSetSessionKeys(nextSeqNo, settings.AppSKey, settings.NwkSKey, settings.DevAddr);
+        if (settings.flags & FLAG_MAC_STATE_SET) {
+          loraRestoreSessionState(&macState);
+        }
       }
       else if ((settings.flags & FLAG_JOIN_VARS_SET)==FLAG_JOIN_VARS_SET) {
         Log.Info(F("Join keys set - Starting LoRa join"));
-        loraJoin(settings.seq_no, settings.AppKey, settings.AppEUI, settings.DevEUI, onJoin);
+        loraJoin(nextSeqNo, settings.AppKey, settings.AppEUI, settings.DevEUI, onJoin, &joinState, onJoinProgress);
       }
       else {
         Log.Warn(F("LoRa comms unavailable. Needs session vars or join keys." CR));
@@ -475,38 +1082,110 @@ void setup() {
     }
 }
 
-void readBatteryLevel() {
-    #define VBATPIN A7
+// Notifies only when the estimate moved, sparing an AT round trip per sample
+static void checkBattery() {
+  if (!batterySample(millis())) {
+    return;
+  }
+  uint8_t level = batteryLevel();
+  static uint8_t notifiedLevel = 0xFF;
+  if (level!=notifiedLevel) {
+    notifiedLevel = level;
+    sendBatteryLevel(level);
+  }
+  sendBatteryStatus(level, batteryMillivolts(), batteryTrendMvPerHour(), batteryRemainingPings());
+}
+
+// Skip BLE polling when an LMIC job is this close, so AT round trips
+// don't delay radio timing (RX windows in particular).
+#define LMIC_GUARD_MS 50
 
-    float measuredvbat = analogRead(VBATPIN);
-    measuredvbat *= 2;    // we divided by 2, so multiply back
-    measuredvbat *= 3.3;  // Multiply by 3.3V, our reference voltage
-    measuredvbat /= 1024; // convert to voltage
-    Log.Debug("VBat: %f", measuredvbat);
+#if defined(DEBUG_LOOP_LATENCY)
+static struct {
+  uint32_t passes;
+  uint32_t totalUs;
+  uint32_t maxUs;
+} loopStats = {0, 0, 0};
+static TimeoutTimer loopStatsTimer(10000);
 
-    // Normalize to 0-100
-    float minv = 3.2;
-    float maxv = 4.2;
-    int level = 100 * (measuredvbat - minv) / (maxv - minv);
-    Log.Debug_(" [VBat int: %d]" CR, level);
-    if (level<0) {
-      level = 0;
-    }
-    else if (level>100) {
-      level = 100;
-    }
-    sendBatteryLevel(level);
+static void recordLoopLatency(uint32_t startUs) {
+  uint32_t us = micros() - startUs;
+  ++loopStats.passes;
+  loopStats.totalUs += us;
+  if (us>loopStats.maxUs) {
+    loopStats.maxUs = us;
+  }
+  if (loopStatsTimer.expired()) {
+    loopStatsTimer.set(10000);
+    TLOG_INFO("Loop latency: %d passes, avg %d us, max %d us" CR,
+      loopStats.passes, loopStats.totalUs / loopStats.passes, loopStats.maxUs);
+    loopStats.passes = loopStats.totalUs = loopStats.maxUs = 0;
+  }
 }
+#endif
 
-const static long batCheckInterval = 60000; // Every minute
-static TimeoutTimer batCheckTimer;
+// Time until queued packets may be sent: held for aggregation, or waiting for the radio
+static uint32_t queueIdleMs(uint32_t now) {
+  TxPacket *first = txQueuePeek();
+  if (first==NULL || CurrentTx.active || !loraReadyToSend()) {
+    return IDLE_MAX_SLEEP_MS; // Lora events wake the queue, not the clock
+  }
+  if (!aggregateSamples) {
+    return 0;
+  }
+  uint32_t age = now - first->queuedMs;
+  uint32_t holdMs = age<AGGREGATE_MAX_AGE_MS ? AGGREGATE_MAX_AGE_MS - age : 0;
+  uint32_t dutyMs = airtimeUntilNextTxMs(now);
+  return dutyMs>holdMs ? dutyMs : holdMs;
+}
+
+// Time until the backlog may be drained: waiting for the duty cycle
+static uint32_t backlogIdleMs(uint32_t now) {
+  if (backlogCount()==0 || CurrentTx.active || txQueueDepth() || !loraReadyToSend()) {
+    return IDLE_MAX_SLEEP_MS;
+  }
+  return airtimeUntilNextTxMs(now);
+}
+
+// Sleeps until the earliest piece of pending work
+static void sleepUntilWork() {
+  uint32_t now = millis();
+  uint32_t ms = loraIdleMs(IDLE_MAX_SLEEP_MS);
+  ms = min(ms, bluetoothIdleMs(now));
+  ms = min(ms, batteryIdleMs(now));
+  ms = min(ms, queueIdleMs(now));
+  ms = min(ms, backlogIdleMs(now));
+  idleSleep(ms);
+}
 
 void loop() {
-    loopBluetooth();
+    #if defined(DEBUG_LOOP_LATENCY)
+    uint32_t loopStartUs = micros();
+    #endif
+
     loopLora();
+    if (!loraBusyWithin(LMIC_GUARD_MS)) {
+      DIAG_BEGIN(DiagLoopBluetooth);
+      loopBluetooth();
+      DIAG_END(DiagLoopBluetooth);
+    }
 
-    if (batCheckTimer.expired()) {
-        batCheckTimer.set(batCheckInterval);
-        readBatteryLevel();
+    if (fragmentCheckTimeout(millis())==FragmentTimedOut) {
+      reportFragmentStatus(FragmentTimedOut);
     }
+
+    // Packets may be waiting for join to complete or for LMIC to become free
+    if (txQueueDepth() && sendNextPacket()) {
+      reportQueueStatus();
+    }
+    // Stored samples go out once joined and only when nothing newer waits
+    drainBacklog();
+
+    checkBattery();
+
+    #if defined(DEBUG_LOOP_LATENCY)
+    recordLoopLatency(loopStartUs);
+    #endif
+
+    sleepUntilWork();
 }
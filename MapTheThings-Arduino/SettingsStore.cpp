@@ -0,0 +1,215 @@
+#include <string.h>
+#include "SettingsStore.h"
+#include "Bluetooth.h"
+#include "Logging.h"
+#include "TokenLog.h"
+
+#define HEADER_SIZE sizeof(uint32_t)
+#define RECORD_OVERHEAD 3 // id, len, crc
+#define RECORD_END 0x00
+#define RECORD_ERASED 0xFF
+#define MAX_FIELDS 32 // Bits in dirty and loaded
+
+static const SettingsField *fields = NULL;
+static uint8_t fieldCount = 0;
+static uint32_t *flags = NULL;
+
+static uint32_t dirty = 0;          // Bit per field index
+static uint32_t loaded = 0;         // Bit per field index with a record replayed by settingsStoreLoad
+static bool compact = false;        // Rewrite the whole image on next commit
+static uint16_t tail = HEADER_SIZE; // Offset of the next record
+static uint8_t image[NV_USER_SIZE]; // Mirror of the NVM contents up to tail
+
+static uint8_t crc8(uint8_t const *data, uint16_t len) {
+  uint8_t crc = 0;
+  while (len--) {
+    crc ^= *data++;
+    for (uint8_t i=0; i<8; ++i) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+static int fieldIndex(uint8_t id) {
+  for (int i=0; i<fieldCount; ++i) {
+    if (fields[i].id==id) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static bool isSet(const SettingsField *f) {
+  return f->flag==0 || (*flags & f->flag);
+}
+
+static uint8_t recordLength(const SettingsField *f) {
+  return (isSet(f) ? f->size : 0) + RECORD_OVERHEAD;
+}
+
+// Writes the record for field f into buf and returns its length
+static uint8_t encodeRecord(uint8_t *buf, const SettingsField *f) {
+  uint8_t len = isSet(f) ? f->size : 0;
+  buf[0] = f->id;
+  buf[1] = len;
+  memcpy(buf+2, f->value, len);
+  buf[2+len] = crc8(buf, 2+len);
+  return len + RECORD_OVERHEAD;
+}
+
+static uint32_t counterValue(uint8_t const *v, uint8_t size) {
+  uint32_t value = 0;
+  for (uint8_t i=size; i-- > 0; ) {
+    value = (value << 8) | v[i];
+  }
+  return value;
+}
+
+// Generations while replaying the log, per field index
+typedef struct {
+  uint32_t inLog[MAX_FIELDS];  // Value of the field's last record so far, in log order
+  uint32_t loaded[MAX_FIELDS]; // Generation of the record a monotonic field was loaded from
+} Generations;
+
+// Generation the log is in for monotonic field f: the last record of its generation field so far
+static uint32_t logGeneration(const SettingsField *f, const Generations *g) {
+  int gi = f->generation ? fieldIndex(f->generation) : -1;
+  return gi>=0 ? g->inLog[gi] : 0;
+}
+
+static void applyRecord(uint8_t const *r, Generations *g) {
+  int i = fieldIndex(r[0]);
+  if (i<0) {
+    return; // Written by a newer firmware. Dropped at next compaction.
+  }
+  const SettingsField *f = &fields[i];
+  uint8_t len = r[1];
+  if (len==0) {
+    *flags &= ~f->flag;
+  }
+  else if (len==f->size) {
+    if (f->monotonic) {
+      uint32_t value = counterValue(r+2, len);
+      uint32_t generation = logGeneration(f, g);
+      g->inLog[i] = value;
+      if ((loaded & (1UL << i)) && (generation<g->loaded[i]
+        || (generation==g->loaded[i] && value<=counterValue(f->value, f->size)))) {
+        return; // Older record replayed after a newer one by a torn compaction
+      }
+      g->loaded[i] = generation;
+    }
+    memcpy(f->value, r+2, len);
+    *flags |= f->flag;
+    loaded |= (1UL << i);
+  }
+}
+
+void settingsStoreInit(const SettingsField *fs, uint8_t count, uint32_t *fl) {
+  fields = fs;
+  fieldCount = count;
+  flags = fl;
+}
+
+bool settingsStoreLoad(SettingsMigrateFn migrate) {
+  if (!readNVBytes(0, image, NV_USER_SIZE)) {
+    return false;
+  }
+  dirty = 0;
+  loaded = 0;
+  compact = false;
+  tail = HEADER_SIZE;
+
+  uint32_t format;
+  memcpy(&format, image, sizeof(format));
+  if (format==SETTINGS_FORMAT_RECORDS) {
+    Generations generations;
+    memset(&generations, 0, sizeof(generations));
+    while (tail + RECORD_OVERHEAD <= NV_USER_SIZE) {
+      uint8_t *r = image + tail;
+      if (r[0]==RECORD_END || r[0]==RECORD_ERASED) {
+        break;
+      }
+      uint8_t len = r[1];
+      if (tail + len + RECORD_OVERHEAD > NV_USER_SIZE || crc8(r, 2+len)!=r[2+len]) {
+        // Torn write. Everything after this point is suspect.
+        TLOG_WARN("Corrupt settings record at %d. Ignoring the rest." CR, tail);
+        compact = true;
+        break;
+      }
+      applyRecord(r, &generations);
+      tail += len + RECORD_OVERHEAD;
+    }
+  }
+  else {
+    if (migrate && migrate(format, image, NV_USER_SIZE)) {
+      TLOG_INFO("Migrated settings from format %d" CR, format);
+    }
+    else {
+      TLOG_WARN("Unknown settings format %d. Starting empty." CR, format);
+    }
+    compact = true;
+  }
+  return true;
+}
+
+void settingsStoreMarkDirty(uint8_t id) {
+  int i = fieldIndex(id);
+  if (i>=0) {
+    dirty |= (1UL << i);
+  }
+}
+
+static bool compactStore() {
+  memset(image, 0, NV_USER_SIZE);
+  uint32_t format = SETTINGS_FORMAT_RECORDS;
+  memcpy(image, &format, sizeof(format));
+  tail = HEADER_SIZE;
+  for (int i=0; i<fieldCount; ++i) {
+    // Absent fields read back as unset, so they need no record
+    if (isSet(&fields[i])) {
+      tail += encodeRecord(image+tail, &fields[i]);
+    }
+  }
+  // Whole image, so that stale records beyond the new tail are zeroed
+  if (!writeNVBytes(0, image, NV_USER_SIZE)) {
+    return false;
+  }
+  dirty = 0;
+  compact = false;
+  return true;
+}
+
+bool settingsStoreCommit() {
+  if (compact) {
+    return compactStore();
+  }
+  if (!dirty) {
+    return true;
+  }
+
+  uint16_t needed = 0;
+  for (int i=0; i<fieldCount; ++i) {
+    if (dirty & (1UL << i)) {
+      needed += recordLength(&fields[i]);
+    }
+  }
+  if (tail + needed > NV_USER_SIZE) {
+    TLOG_DEBUG("Settings log full. Compacting." CR);
+    return compactStore();
+  }
+
+  uint16_t start = tail;
+  for (int i=0; i<fieldCount; ++i) {
+    if (dirty & (1UL << i)) {
+      tail += encodeRecord(image+tail, &fields[i]);
+    }
+  }
+  if (!writeNVBytes(start, image+start, needed)) {
+    // NVM contents after start are unknown now. Rewrite everything next time.
+    compact = true;
+    return false;
+  }
+  dirty = 0;
+  return true;
+}
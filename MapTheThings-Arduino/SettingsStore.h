@@ -0,0 +1,45 @@
+#include <stdint.h>
+
+/*
+ Record-oriented settings store on the Bluefruit NVM.
+
+ Layout (after the NVM magic number):
+   uint32_t format   - SETTINGS_FORMAT_RECORDS. Anything else is handed to the migrate callback.
+   records...        - [id][len][len bytes of value][crc8 over id, len and value]
+   zero fill         - id 0 ends the log
+
+ Changing a field appends one record. The last record for an id wins. A record
+ with len 0 means the field is unset. When the log is full it is compacted to
+ one record per field.
+
+ A monotonic field loads as the largest value in the log instead. Compaction
+ rewrites the image in several NVM writes, and a reset partway leaves the new
+ records followed by older ones that still pass their CRC. Counters that must
+ never go back, like the frame counter reservation, survive that.
+
+ A monotonic field may name a generation: another monotonic field, such as a
+ session count, that restarts it. Each record belongs to the generation of
+ the last generation record before it in the log, and the largest value is
+ taken within the newest generation only. List the generation field first,
+ so that compaction writes it ahead of the records it governs.
+*/
+#define SETTINGS_FORMAT_RECORDS 2
+
+typedef struct {
+  uint8_t id;     // Record id, 1-254. Never reuse an id for a different meaning.
+  uint8_t *value;
+  uint8_t size;
+  uint32_t flag;  // Bit in flags that is set while the field has a value. 0 if always present.
+  bool monotonic; // Unsigned little endian counter, at most 4 bytes, that never decreases
+  uint8_t generation; // Record id of the monotonic field that starts this one over. 0 if none.
+} SettingsField;
+
+// Converts an image in an older format into the fields. Return false if format is unknown.
+typedef bool (*SettingsMigrateFn)(uint32_t format, uint8_t *image, uint16_t size);
+
+void settingsStoreInit(const SettingsField *fields, uint8_t count, uint32_t *flags);
+// Reads the whole store with a single NVM read and replays it into the fields.
+bool settingsStoreLoad(SettingsMigrateFn migrate);
+void settingsStoreMarkDirty(uint8_t id);
+// Appends one record per dirty field in a single NVM write.
+bool settingsStoreCommit();
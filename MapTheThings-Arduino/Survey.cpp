@@ -0,0 +1,129 @@
+#include <string.h>
+#include "Survey.h"
+#include "Lora.h"
+#include "Airtime.h"
+#include "Battery.h"
+#include "TokenLog.h"
+
+static SurveyPingFn pingFn = NULL;
+static osjob_t surveyJob;
+
+static bool active = false;
+static uint8_t flags = 0;
+static uint32_t intervalMs = 0;
+static uint8_t sfMask = 0;
+static uint8_t lastSf = 0;
+static uint16_t pingCount = 0;
+static uint8_t payload[SURVEY_MAX_TEMPLATE + sizeof(pingCount)];
+static uint8_t templateLen = 0;
+
+static void surveyPing(osjob_t *job);
+
+static void schedule(uint32_t ms) {
+  os_setTimedCallback(&surveyJob, os_getTime() + ms2osticks(ms), surveyPing);
+}
+
+// Next SF in the rotation after lastSf, wrapping around
+static uint8_t nextSf() {
+  for (uint8_t i=1; i<=6; ++i) {
+    uint8_t sf = 7 + (lastSf - 7 + i) % 6;
+    if (sfMask & (1 << (sf - 7))) {
+      return sf;
+    }
+  }
+  return 0;
+}
+
+static void surveyPing(osjob_t *job) {
+  if (!active) {
+    return;
+  }
+  uint32_t wait = airtimeUntilNextTxMs(millis());
+  if (wait) {
+    // LMIC would hold the frame anyway. Keep the radio free for phone traffic meanwhile.
+    schedule(wait);
+    return;
+  }
+
+  uint8_t len = templateLen;
+  if (flags & SURVEY_FLAG_COUNTER) {
+    memcpy(&payload[len], &pingCount, sizeof(pingCount));
+    len += sizeof(pingCount);
+  }
+  uint8_t sf = sfMask ? nextSf() : loraCurrentSF();
+  if (sf>loraSfFor(len)) {
+    sf = loraSfFor(len); // The SF setting is too slow for the ping. Only a rotation is checked up front.
+  }
+  if (!pingFn(pingCount & 0xFF, sf, payload, len)) {
+    schedule(SURVEY_RETRY_MS);
+    return;
+  }
+  TLOG_DEBUG("Survey ping %d at SF%d" CR, pingCount, sf);
+  lastSf = sf;
+  ++pingCount;
+  uint32_t next = intervalMs ? intervalMs : SURVEY_RETRY_MS;
+  if (batteryLow() && next<SURVEY_LOW_BATTERY_INTERVAL_MS) {
+    next = SURVEY_LOW_BATTERY_INTERVAL_MS;
+  }
+  schedule(next);
+}
+
+void surveySetup(SurveyPingFn ping) {
+  pingFn = ping;
+}
+
+// Slowest SF set in mask, 0 if none
+static uint8_t slowestSf(uint8_t mask) {
+  uint8_t slowest = 0;
+  for (uint8_t sf=7; sf<=12; ++sf) {
+    if (mask & (1 << (sf - 7))) {
+      slowest = sf;
+    }
+  }
+  return slowest;
+}
+
+bool surveyConfigure(uint8_t const config[], uint16_t len) {
+  if (len<SURVEY_HEADER_SIZE || config[0]!=SURVEY_FORMAT_V1
+    || len>SURVEY_HEADER_SIZE + SURVEY_MAX_TEMPLATE) {
+    TLOG_INFO("Invalid survey configuration" CR);
+    return false;
+  }
+  uint8_t pingLen = len - SURVEY_HEADER_SIZE + ((config[1] & SURVEY_FLAG_COUNTER) ? sizeof(pingCount) : 0);
+  uint8_t slowest = slowestSf(config[4] & 0x3F);
+  if (slowest>loraSfFor(pingLen)) {
+    TLOG_INFO("Survey ping of %d bytes does not fit SF%d" CR, pingLen, slowest);
+    return false;
+  }
+  flags = config[1];
+  intervalMs = (config[2] | (config[3] << 8)) * 1000UL;
+  sfMask = config[4] & 0x3F;
+  templateLen = len - SURVEY_HEADER_SIZE;
+  memcpy(payload, &config[SURVEY_HEADER_SIZE], templateLen);
+
+  bool enable = flags & SURVEY_FLAG_ENABLED;
+  if (enable && !active) {
+    pingCount = 0;
+    lastSf = 12; // Rotation starts at the lowest SF in the mask
+  }
+  active = enable;
+  if (active) {
+    TLOG_INFO("Survey started: every %d ms" CR, intervalMs);
+    loraRunSoon(&surveyJob, surveyPing);
+  }
+  else {
+    TLOG_INFO("Survey stopped after %d pings" CR, pingCount);
+    os_clearCallback(&surveyJob);
+  }
+  return true;
+}
+
+bool surveyActive() {
+  return active;
+}
+
+void surveyResume() {
+  if (active) {
+    loraRunSoon(&surveyJob, surveyPing);
+  }
+}
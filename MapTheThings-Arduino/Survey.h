@@ -0,0 +1,38 @@
+#include <stdint.h>
+
+/*
+ Survey mode: the node sends its own pings on a schedule, without a BLE write
+ per packet. Pings run as LMIC timed jobs, so they keep going through BLE
+ dropouts. Results come back through the normal TX result characteristic, with
+ the low byte of the ping counter as BLE seq.
+
+ Configuration, as written to the Survey config characteristic:
+   [0]     SURVEY_FORMAT_V1
+   [1]     flags - SURVEY_FLAG_*
+   [2..3]  interval between pings in seconds, little endian. 0 means as fast as
+           the duty cycle and airtime budget allow.
+   [4]     SF rotation mask, bit 0 = SF7 ... bit 5 = SF12. 0 leaves SF alone.
+           Pings cycle through the set SFs in ascending order. Each ping sets
+           its SF for itself only. Other uplinks keep the SF setting.
+   [5..]   payload template, up to SURVEY_MAX_TEMPLATE bytes
+ A configuration whose ping, template and counter, is longer than the slowest
+ SF in the rotation carries is rejected. Without a rotation, a ping too long
+ for the SF setting goes out at the slowest SF that carries it.
+*/
+#define SURVEY_FORMAT_V1 0x01
+#define SURVEY_FLAG_ENABLED 0x01
+#define SURVEY_FLAG_COUNTER 0x02  // Append 16 bit ping counter to the template
+#define SURVEY_HEADER_SIZE 5
+#define SURVEY_MAX_TEMPLATE 15
+#define SURVEY_RETRY_MS 500       // Recheck interval while the radio is busy
+#define SURVEY_LOW_BATTERY_INTERVAL_MS 60000 // Slowest pace while the battery is low
+
+// Hands a ping to the radio. Returns false if it could not be sent right now.
+typedef bool (*SurveyPingFn)(uint8_t seq, uint8_t sf, uint8_t data[], uint8_t len);
+
+void surveySetup(SurveyPingFn ping);
+// Applies a configuration write. Returns false if it is malformed or does not fit its SFs.
+bool surveyConfigure(uint8_t const config[], uint16_t len);
+bool surveyActive();
+// Reschedules the pings after resetLora(), whose os_init() empties the LMIC job queue
+void surveyResume();
@@ -0,0 +1,122 @@
+/*
+ Compile-time filtered, optionally tokenized logging.
+
+ TLOG_DEBUG("Sent %d bytes" CR, len) and friends take a string literal format.
+ - Calls above LOG_LEVEL compile to nothing: arguments are not evaluated and the
+   format string is not kept in flash.
+ - Without TOKENIZED_LOGGING they forward to Log.Debug(F(format), ...).
+ - With TOKENIZED_LOGGING the format is replaced at compile time by its 32 bit
+   FNV-1a hash and arguments are packed in binary. tools/tokenlog.py builds the
+   hash -> format table from the sources and turns captured output back into text.
+
+ Record format, little endian:
+   [TOKEN_LOG_SYNC][level][token:4][payload length][payload]
+ Payload holds one entry per argument, in order:
+   integer  - unsigned LEB128 of the value cast to 32 bits
+   float    - 4 byte IEEE 754
+   string   - bytes followed by 0
+   %H bytes - LEB128 length followed by the bytes (use TokenLogBytes)
+ Text output from plain Log calls is 7 bit ASCII, so records can share a stream with it.
+*/
+#include <stdint.h>
+#include <string.h>
+#include "Logging.h"
+
+// Define LOG_LEVEL in build_flags to apply one level to every source file
+#if !defined(LOG_LEVEL)
+#define LOG_LEVEL LOG_LEVEL_INFOS
+#endif
+
+#define TOKEN_LOG_SYNC 0xA5
+#define TOKEN_LOG_MAX_PAYLOAD 48
+
+#define TLOG_ERROR(...)   TLOG_AT(LOG_LEVEL_ERRORS, Error, __VA_ARGS__)
+#define TLOG_WARN(...)    TLOG_AT(LOG_LEVEL_ERRORS, Warn, __VA_ARGS__) // Same level as Log.Warn
+#define TLOG_INFO(...)    TLOG_AT(LOG_LEVEL_INFOS, Info, __VA_ARGS__)
+#define TLOG_DEBUG(...)   TLOG_AT(LOG_LEVEL_DEBUG, Debug, __VA_ARGS__)
+#define TLOG_VERBOSE(...) TLOG_AT(LOG_LEVEL_VERBOSE, Verbose, __VA_ARGS__)
+
+// Constant condition: the optimizer removes disabled calls entirely
+#define TLOG_AT(level, method, format, ...) \
+  do { \
+    if ((level)<=LOG_LEVEL) { \
+      TLOG_EMIT(level, method, format, ##__VA_ARGS__); \
+    } \
+  } while (0)
+
+// Hex dump argument for a %H conversion
+typedef struct {
+  const uint8_t *data;
+  uint16_t len;
+} TokenLogBytes;
+
+#if defined(TOKENIZED_LOGGING)
+
+constexpr uint32_t tokenLogHash(const char *s, uint32_t h = 2166136261UL) {
+  return *s ? tokenLogHash(s+1, (h ^ (uint8_t)*s) * 16777619UL) : h;
+}
+
+// Implemented by the sketch: sends a finished record to the log transport
+void tokenLogWrite(uint8_t const *data, uint16_t len);
+
+class TokenLogRecord {
+public:
+  TokenLogRecord(uint8_t level, uint32_t token) : len(7) {
+    buffer[0] = TOKEN_LOG_SYNC;
+    buffer[1] = level;
+    memcpy(&buffer[2], &token, sizeof(token));
+  }
+
+  template<typename T> void put(T value) { putVarint((uint32_t)value); }
+  void put(double value) { float f = value; putBytes((const uint8_t *)&f, sizeof(f)); }
+  void put(const char *s) { putBytes((const uint8_t *)s, strlen(s)+1); }
+  void put(char *s) { put((const char *)s); }
+  void put(TokenLogBytes bytes) { putVarint(bytes.len); putBytes(bytes.data, bytes.len); }
+
+  void pack() {}
+  template<typename T, typename... Rest> void pack(T first, Rest... rest) {
+    put(first);
+    pack(rest...);
+  }
+
+  void send() {
+    buffer[6] = len - 7;
+    tokenLogWrite(buffer, len);
+  }
+
+private:
+  void putVarint(uint32_t v) {
+    while (v>=0x80 && len<sizeof(buffer)) {
+      buffer[len++] = (v & 0x7F) | 0x80;
+      v >>= 7;
+    }
+    if (len<sizeof(buffer)) {
+      buffer[len++] = v;
+    }
+  }
+  void putBytes(const uint8_t *data, uint16_t n) {
+    // Truncated payloads still decode up to the cut
+    if (n>sizeof(buffer) - len) {
+      n = sizeof(buffer) - len;
+    }
+    memcpy(&buffer[len], data, n);
+    len += n;
+  }
+
+  uint8_t buffer[7 + TOKEN_LOG_MAX_PAYLOAD];
+  uint8_t len;
+};
+
+#define TLOG_EMIT(level, method, format, ...) \
+  do { \
+    constexpr uint32_t token = tokenLogHash(format); \
+    TokenLogRecord record(level, token); \
+    record.pack(__VA_ARGS__); \
+    record.send(); \
+  } while (0)
+
+#else
+
+#define TLOG_EMIT(level, method, format, ...) Log.method(F(format), ##__VA_ARGS__)
+
+#endif
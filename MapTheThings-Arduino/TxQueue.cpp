@@ -0,0 +1,124 @@
+/*
+ * Pending uplink queue.
+ *
+ * Packets live in a fixed pool of slots. The send order is kept separately
+ * as a short array of slot indices, so inserting a priority packet or
+ * dropping one only moves a few index bytes, never packet data.
+ * Priority packets occupy order[0..priorityCount-1].
+ */
+#include <string.h>
+#include <Arduino.h>
+#include "TxQueue.h"
+#include "Logging.h"
+#include "TokenLog.h"
+
+static TxPacket slots[TXQUEUE_CAPACITY];
+static uint16_t slotsUsed = 0; // Bit per slot
+static uint8_t order[TXQUEUE_CAPACITY];
+static uint8_t count = 0;
+static uint8_t priorityCount = 0;
+static uint32_t overflows = 0;
+static TxQueuePolicy policy = DropOldest;
+static TxQueueDropFn onDrop = NULL;
+
+void txQueueSetPolicy(TxQueuePolicy p) {
+  policy = p;
+}
+
+TxQueuePolicy txQueuePolicy() {
+  return policy;
+}
+
+static void removeAt(uint8_t pos) {
+  slotsUsed &= ~(1 << order[pos]);
+  memmove(&order[pos], &order[pos+1], count-pos-1);
+  --count;
+  if (pos<priorityCount) {
+    --priorityCount;
+  }
+}
+
+void txQueueSetDropCallback(TxQueueDropFn fn) {
+  onDrop = fn;
+}
+
+// Discards a waiting packet to make room
+static void dropAt(uint8_t pos) {
+  if (onDrop) {
+    onDrop(&slots[order[pos]]);
+  }
+  removeAt(pos);
+}
+
+static uint8_t allocSlot() {
+  uint8_t slot = 0;
+  while (slotsUsed & (1 << slot)) {
+    ++slot;
+  }
+  slotsUsed |= (1 << slot);
+  return slot;
+}
+
+TxPacket *txQueuePush(uint8_t bleSeq, bool priority, bool confirmed, uint8_t const data[], uint16_t len) {
+  if (len>MAX_LEN_PAYLOAD) {
+    TLOG_ERROR("Packet too long for queue: %d" CR, len);
+    return NULL;
+  }
+  if (count==TXQUEUE_CAPACITY) {
+    ++overflows;
+    bool allPriority = (priorityCount==count);
+    if (!priority && allPriority) {
+      // Never displace a priority packet with a normal one
+      return NULL;
+    }
+    if (policy==DropNewest) {
+      if (!priority) {
+        return NULL;
+      }
+      dropAt(count-1); // Priority packet displaces newest normal packet
+    }
+    else {
+      dropAt(allPriority ? 0 : priorityCount); // Oldest normal packet, if any
+    }
+  }
+
+  uint8_t slot = allocSlot();
+  TxPacket *p = &slots[slot];
+  p->bleSeq = bleSeq;
+  p->priority = priority;
+  p->confirmed = confirmed;
+  p->queuedMs = millis();
+  p->len = len;
+  memcpy(p->data, data, len);
+
+  uint8_t pos = priority ? priorityCount : count;
+  memmove(&order[pos+1], &order[pos], count-pos);
+  order[pos] = slot;
+  ++count;
+  if (priority) {
+    ++priorityCount;
+  }
+  return p;
+}
+
+TxPacket *txQueuePeek() {
+  return txQueuePeekAt(0);
+}
+
+TxPacket *txQueuePeekAt(uint8_t pos) {
+  return pos<count ? &slots[order[pos]] : NULL;
+}
+
+void txQueuePop() {
+  if (count) {
+    removeAt(0);
+  }
+}
+
+uint8_t txQueueDepth() {
+  return count;
+}
+
+uint32_t txQueueOverflows() {
+  return overflows;
+}
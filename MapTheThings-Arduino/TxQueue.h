@@ -0,0 +1,38 @@
+#include <stdint.h>
+#include "lmic.h"
+
+// Fixed pool of pending uplinks. No allocation - slots are reused in place.
+#define TXQUEUE_CAPACITY 8
+
+typedef enum TxQueuePolicyEnum {
+  DropNewest,   // When full, refuse the incoming packet
+  DropOldest,   // When full, discard the oldest waiting packet to make room
+} TxQueuePolicy;
+
+typedef struct {
+  uint8_t bleSeq;
+  bool priority;
+  bool confirmed;    // Send as a confirmed uplink
+  uint32_t queuedMs; // millis() when pushed
+  ostime_t writeAt;  // Latency stamps, see Latency.h. Set by the caller.
+  ostime_t queuedAt;
+  bool location;     // Carries a LocationCodec frame. Set by the caller.
+  uint8_t len;
+  uint8_t data[MAX_LEN_PAYLOAD];
+} TxPacket;
+
+void txQueueSetPolicy(TxQueuePolicy policy);
+TxQueuePolicy txQueuePolicy();
+
+// Returns NULL if the packet was dropped (too long or queue full under DropNewest).
+// Priority packets go ahead of all normal packets, but behind earlier priority packets.
+TxPacket *txQueuePush(uint8_t bleSeq, bool priority, bool confirmed, uint8_t const data[], uint16_t len);
+// Called with a packet that a full queue discards to make room for a new one
+typedef void (*TxQueueDropFn)(const TxPacket *p);
+void txQueueSetDropCallback(TxQueueDropFn fn);
+TxPacket *txQueuePeek();
+TxPacket *txQueuePeekAt(uint8_t pos); // pos-th packet in send order, NULL past the end
+void txQueuePop();
+
+uint8_t txQueueDepth();
+uint32_t txQueueOverflows();
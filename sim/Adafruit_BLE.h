@@ -0,0 +1,52 @@
+/*
+ Host stand-in for the Bluefruit LE module, driven by Sim.h. The module keeps
+ its NVM and GATT table across node reboots, like the real nRF51. AT round
+ trips cost virtual time, see SIM_*_US in Sim.h.
+*/
+#pragma once
+#include <Arduino.h>
+
+#define BLE_BUFSIZE 64
+
+class TimeoutTimer {
+public:
+  TimeoutTimer() : start(millis()), interval(0) {}
+  TimeoutTimer(uint32_t ms) : start(millis()), interval(ms) {}
+  void set(uint32_t ms) { start = millis(); interval = ms; }
+  bool expired() { return millis() - start >= interval; }
+  void reset() { start = millis(); }
+private:
+  uint32_t start;
+  uint32_t interval;
+};
+
+typedef void (*BLEGattRxCb)(int32_t charId, uint8_t data[], uint16_t len);
+
+class Adafruit_BLE {
+public:
+  bool begin(bool verbose = false);
+  bool factoryReset();
+  bool echo(bool enable) { return true; }
+  bool info() { return true; }
+  bool isVersionAtLeast(const char *version) { return true; }
+  void verbose(bool enable) {}
+  bool reset(bool blocking = true);
+  bool disconnect();
+
+  bool atcommand(const char *command) { return sendCommandCheckOK(command); }
+  bool atcommand(const __FlashStringHelper *command) { return atcommand((const char *)command); }
+  bool sendCommandCheckOK(const char *command);
+  bool sendCommandCheckOK(const __FlashStringHelper *command) { return sendCommandCheckOK((const char *)command); }
+  bool sendCommandWithIntReply(const char *command, int32_t *reply);
+  bool sendCommandWithIntReply(const __FlashStringHelper *command, int32_t *reply) {
+    return sendCommandWithIntReply((const char *)command, reply);
+  }
+
+  void update(uint32_t periodMs = 200);
+  void setBleGattRxCallback(int32_t charId, BLEGattRxCb callback);
+
+  bool readNVM(uint16_t offset, int32_t *number);
+  bool readNVM(uint16_t offset, uint8_t data[], uint16_t size);
+  bool writeNVM(uint16_t offset, int32_t number);
+  bool writeNVM(uint16_t offset, uint8_t const data[], uint16_t size);
+};
@@ -0,0 +1,9 @@
+#pragma once
+#include "Adafruit_BLE.h"
+
+class Adafruit_BLEGatt {
+public:
+  Adafruit_BLEGatt(Adafruit_BLE &ble) {}
+  bool setChar(uint8_t charId, uint8_t const data[], uint8_t size);
+  uint8_t getChar(uint8_t charId, uint8_t *buffer, uint8_t bufsize);
+};
@@ -0,0 +1,7 @@
+#pragma once
+#include "Adafruit_BLE.h"
+
+class Adafruit_BluefruitLE_SPI : public Adafruit_BLE {
+public:
+  Adafruit_BluefruitLE_SPI(int8_t csPin, int8_t irqPin, int8_t rstPin) {}
+};
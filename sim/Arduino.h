@@ -0,0 +1,74 @@
+/*
+ Host stand-in for the Arduino core (SAMD21). Time comes from the simulator's
+ virtual clock, see Sim.h. Only what the sketch uses is here.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <type_traits>
+
+typedef unsigned int uint;
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define CHANGE 2
+#define FALLING 3
+#define RISING 4
+#define LED_BUILTIN 13
+#define A7 7
+#define DEC 10
+#define HEX 16
+
+#define PROGMEM
+#define memcpy_P memcpy
+
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper *)(s))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin);
+int analogRead(int pin);
+int digitalPinToInterrupt(int pin);
+void attachInterrupt(int interrupt, void (*isr)(void), int mode);
+void noInterrupts();
+void interrupts();
+
+template<class A, class B> auto min(A a, B b) -> typename std::common_type<A,B>::type { return a<b ? a : b; }
+template<class A, class B> auto max(A a, B b) -> typename std::common_type<A,B>::type { return a>b ? a : b; }
+
+// Printed only with SIM_LOG set in the environment
+class SimSerial {
+public:
+  operator bool() const { return true; }
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *data, size_t len);
+  size_t print(const char *s);
+  size_t print(const __FlashStringHelper *s) { return print((const char *)s); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(int n, int base = DEC) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t println() { return print("\r\n"); }
+  template<class T> size_t println(T value) { return print(value) + println(); }
+  template<class T> size_t println(T value, int base) { return print(value, base) + println(); }
+};
+extern SimSerial Serial;
+
+// Cortex-M sleep registers, for code that is compiled out under IDLE_VIRTUAL_CLOCK
+typedef struct { volatile uint32_t SCR; } SCB_Type;
+extern SCB_Type *SCB;
+#define SCB_SCR_SLEEPDEEP_Msk (1UL << 2)
+inline void __DSB() {}
+inline void __WFI() {}
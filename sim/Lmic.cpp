@@ -0,0 +1,406 @@
+#include <lmic.h>
+#include "Sim.h"
+#include "../MapTheThings-Arduino/Airtime.h"
+
+struct lmic_t LMIC;
+
+static osjob_t *scheduledJobs = NULL;
+static osjob_t *runnableJobs = NULL;
+static osjob_t radioJob;
+
+static bool hasSession = false;
+static u4_t txFcnt = 0;
+static bool txHeard = false;
+static bool txAcked = false;
+static bool joinAccepted = false;
+
+#define RX_WINDOW_MS 50
+#define JOIN_ACCEPT_DELAY_S 5
+#define JOIN_REQUEST_LEN 10 // Beyond the data frame header Airtime.h counts
+
+/* Job queue, as in oslmic.c */
+
+static void unlinkFrom(osjob_t **pnext, osjob_t *job) {
+  for (; *pnext; pnext = &(*pnext)->next) {
+    if (*pnext==job) {
+      *pnext = job->next;
+      return;
+    }
+  }
+}
+
+static void unlink(osjob_t *job) {
+  unlinkFrom(&scheduledJobs, job);
+  unlinkFrom(&runnableJobs, job);
+}
+
+void os_init() {
+  scheduledJobs = NULL;
+  runnableJobs = NULL;
+}
+
+ostime_t os_getTime() {
+  return (ostime_t)(uint32_t)(simNowUs() / 16);
+}
+
+void os_clearCallback(osjob_t *job) {
+  unlink(job);
+}
+
+void os_setCallback(osjob_t *job, osjobcb_t cb) {
+  unlink(job);
+  job->func = cb;
+  job->next = NULL;
+  osjob_t **pnext = &runnableJobs;
+  while (*pnext) {
+    pnext = &(*pnext)->next;
+  }
+  *pnext = job;
+}
+
+void os_setTimedCallback(osjob_t *job, ostime_t time, osjobcb_t cb) {
+  unlink(job);
+  job->deadline = time;
+  job->func = cb;
+  osjob_t **pnext = &scheduledJobs;
+  while (*pnext && (*pnext)->deadline - time<=0) {
+    pnext = &(*pnext)->next;
+  }
+  job->next = *pnext;
+  *pnext = job;
+}
+
+void os_runloop_once() {
+  osjob_t *job = NULL;
+  if (runnableJobs) {
+    job = runnableJobs;
+    runnableJobs = job->next;
+  }
+  else if (scheduledJobs && scheduledJobs->deadline - os_getTime()<=0) {
+    job = scheduledJobs;
+    scheduledJobs = job->next;
+  }
+  if (job) {
+    job->func(job);
+  }
+}
+
+bit_t os_queryTimeCriticalJobs(ostime_t time) {
+  return scheduledJobs && scheduledJobs->deadline - os_getTime()<time;
+}
+
+uint64_t simRadioQuietUs() {
+  if (!(LMIC.opmode & OP_TXRXPEND) || runnableJobs || scheduledJobs==NULL) {
+    return 0;
+  }
+  int32_t ticks = scheduledJobs->deadline - os_getTime();
+  return ticks>0 ? (uint64_t)ticks * 16 : 0;
+}
+
+u1_t os_getRndU1() {
+  return simRandom(256);
+}
+
+u2_t os_getRndU2() {
+  return simRandom(65536);
+}
+
+/* Radio and MAC */
+
+static uint8_t drToSf(dr_t dr) {
+  #if defined(CFG_eu868)
+  return dr<=DR_SF7 ? 12 - dr : 0;
+  #else
+  return dr<=DR_SF7 ? 10 - dr : 0;
+  #endif
+}
+
+static bool channelEnabled(uint8_t ch) {
+  #if defined(CFG_eu868)
+  return (LMIC.channelMap & (1 << ch)) && LMIC.channelFreq[ch]!=0;
+  #else
+  return LMIC.channelMap[ch >> 4] & (1 << (ch & 15));
+  #endif
+}
+
+static void startTx(ostime_t at);
+
+static void txDone(osjob_t *job) {
+  if (LMIC.pendTxConf) {
+    if (txAcked) {
+      LMIC.txrxFlags = TXRX_ACK | TXRX_DNW1;
+    }
+    else if (++LMIC.txCnt<TXCONF_ATTEMPTS) {
+      if ((LMIC.txCnt & 1)==0 && LMIC.datarate>0) {
+        LMIC.datarate--; // Every second retry goes one data rate slower
+      }
+      startTx(os_getTime() + ms2osticks(1000 + simRandom(2000)));
+      return;
+    }
+    else {
+      LMIC.txrxFlags = TXRX_NACK;
+    }
+  }
+  else {
+    LMIC.txrxFlags = 0;
+  }
+  if (txHeard) {
+    LMIC.rssi = -100;
+    LMIC.snr = 5 * 4;
+  }
+  LMIC.dataLen = 0;
+  LMIC.opmode &= ~(OP_TXDATA | OP_TXRXPEND);
+  onEvent(EV_TXCOMPLETE);
+}
+
+static void txBegin(osjob_t *job) {
+  uint8_t channels[SIM_MAX_CHANNELS];
+  uint8_t count = 0;
+  #if defined(CFG_eu868)
+  uint8_t limit = MAX_CHANNELS;
+  #else
+  uint8_t limit = US915_125kHz_CHANNELS;
+  #endif
+  for (uint8_t ch=0; ch<limit; ++ch) {
+    if (channelEnabled(ch)) {
+      channels[count++] = ch;
+    }
+  }
+  if (count==0) {
+    return; // Nothing to send on. Stays pending, like LMIC waiting for a channel.
+  }
+  LMIC.txChnl = channels[simRandom(count)];
+  bool retry = LMIC.txCnt>0;
+  if (!retry) {
+    txFcnt = LMIC.seqnoUp++;
+  }
+  onEvent(EV_TXSTART);
+  uint8_t sf = drToSf(LMIC.datarate);
+  txHeard = simNetworkUplink(LMIC.pendTxPort, LMIC.pendTxData, LMIC.pendTxLen, txFcnt, retry,
+    sf, LMIC.txChnl, LMIC.pendTxConf, &txAcked);
+  // An ACK comes in RX1. Otherwise LMIC listens through RX2 too.
+  uint32_t ms = airtimeUs(sf, 125000, LMIC.pendTxLen) / 1000
+    + (LMIC.rxDelay + (txAcked ? 0 : 1)) * 1000UL + RX_WINDOW_MS;
+  os_setTimedCallback(&radioJob, os_getTime() + ms2osticks(ms), txDone);
+}
+
+static void startTx(ostime_t at) {
+  LMIC.opmode |= OP_TXRXPEND;
+  os_setTimedCallback(&radioJob, at, txBegin);
+}
+
+static void joinBegin(osjob_t *job);
+
+static void joinDone(osjob_t *job) {
+  if (joinAccepted) {
+    hasSession = true;
+    LMIC.devaddr = 0x26000000 | simRandom(0x1000000);
+    for (uint8_t i=0; i<16; ++i) {
+      LMIC.nwkKey[i] = os_getRndU1();
+      LMIC.artKey[i] = os_getRndU1();
+    }
+    LMIC.seqnoUp = 0;
+    LMIC.seqnoDn = 0;
+    LMIC.opmode &= ~OP_JOINING;
+    onEvent(EV_JOINED);
+    if (LMIC.opmode & OP_TXDATA) {
+      startTx(os_getTime() + ms2osticks(1));
+    }
+    return;
+  }
+  if (LMIC.datarate==0) {
+    onEvent(EV_JOIN_FAILED);
+    if (!(LMIC.opmode & OP_JOINING)) {
+      return; // Reset by the event handler
+    }
+    LMIC.datarate = DR_SF7; // LMIC starts another round
+  }
+  else {
+    LMIC.datarate--;
+  }
+  os_setTimedCallback(&radioJob, os_getTime() + ms2osticks(1000 + simRandom(2000)), joinBegin);
+}
+
+static void joinBegin(osjob_t *job) {
+  onEvent(EV_TXSTART);
+  LMIC.devNonce++;
+  uint8_t sf = drToSf(LMIC.datarate);
+  uint32_t requestUs = airtimeUs(sf, 125000, JOIN_REQUEST_LEN);
+  joinAccepted = simNetworkJoin(sf, requestUs);
+  uint32_t ms = requestUs / 1000
+    + (JOIN_ACCEPT_DELAY_S + (joinAccepted ? 0 : 1)) * 1000UL + RX_WINDOW_MS;
+  os_setTimedCallback(&radioJob, os_getTime() + ms2osticks(ms), joinDone);
+}
+
+static void defaultChannels() {
+  #if defined(CFG_eu868)
+  memset(LMIC.channelFreq, 0, sizeof(LMIC.channelFreq));
+  memset(LMIC.channelDrMap, 0, sizeof(LMIC.channelDrMap));
+  for (uint8_t ch=0; ch<3; ++ch) {
+    LMIC.channelFreq[ch] = 868100000 + ch * 200000;
+    LMIC.channelDrMap[ch] = DR_RANGE_MAP(DR_SF12, DR_SF7);
+  }
+  LMIC.channelMap = 0x0007;
+  #else
+  for (uint8_t i=0; i<4; ++i) {
+    LMIC.channelMap[i] = 0xFFFF;
+  }
+  LMIC.channelMap[4] = 0x00FF;
+  #endif
+}
+
+void LMIC_reset() {
+  os_clearCallback(&radioJob);
+  memset(&LMIC, 0, sizeof(LMIC));
+  hasSession = false;
+  LMIC.devNonce = os_getRndU2();
+  LMIC.adrTxPow = 14;
+  LMIC.adrEnabled = 1;
+  LMIC.rxDelay = 1;
+  #if defined(CFG_eu868)
+  LMIC.dn2Dr = DR_SF12;
+  LMIC.dn2Freq = 869525000;
+  #else
+  LMIC.dn2Dr = DR_SF12CR;
+  LMIC.dn2Freq = 923300000;
+  #endif
+  defaultChannels();
+}
+
+int LMIC_setTxData2(u1_t port, u1_t *data, u1_t dlen, u1_t confirmed) {
+  if (dlen>MAX_LEN_PAYLOAD) {
+    return -2;
+  }
+  LMIC.pendTxPort = port;
+  LMIC.pendTxConf = confirmed;
+  LMIC.pendTxLen = dlen;
+  memcpy(LMIC.pendTxData, data, dlen);
+  LMIC.opmode |= OP_TXDATA;
+  if (!(LMIC.opmode & OP_JOINING)) {
+    LMIC.txCnt = 0;
+    if (hasSession) {
+      startTx(os_getTime() + ms2osticks(1));
+    }
+  }
+  return 0;
+}
+
+void LMIC_clrTxData() {
+  LMIC.opmode &= ~(OP_TXDATA | OP_TXRXPEND | OP_POLL);
+  LMIC.pendTxLen = 0;
+  if (LMIC.opmode & OP_JOINING) {
+    return;
+  }
+  os_clearCallback(&radioJob);
+}
+
+bit_t LMIC_startJoining() {
+  if (hasSession || (LMIC.opmode & OP_JOINING)) {
+    return 0;
+  }
+  u1_t eui[8];
+  u1_t key[16];
+  os_getArtEui(eui);
+  os_getDevEui(eui);
+  os_getDevKey(key);
+  LMIC.opmode |= OP_JOINING;
+  LMIC.datarate = DR_SF7;
+  onEvent(EV_JOINING);
+  os_setTimedCallback(&radioJob, os_getTime() + ms2osticks(1 + simRandom(2000)), joinBegin);
+  return 1;
+}
+
+void LMIC_setSession(u4_t netid, devaddr_t devaddr, u1_t *nwkKey, u1_t *artKey) {
+  LMIC.netid = netid;
+  LMIC.devaddr = devaddr;
+  memcpy(LMIC.nwkKey, nwkKey, sizeof(LMIC.nwkKey));
+  memcpy(LMIC.artKey, artKey, sizeof(LMIC.artKey));
+  #if defined(CFG_eu868)
+  defaultChannels();
+  #endif
+  LMIC.seqnoUp = 0;
+  LMIC.seqnoDn = 0;
+  LMIC.opmode &= ~(OP_JOINING | OP_TXRXPEND);
+  hasSession = true;
+}
+
+void LMIC_getSessionKeys(u4_t *netid, devaddr_t *devaddr, u1_t *nwkKey, u1_t *artKey) {
+  *netid = LMIC.netid;
+  *devaddr = LMIC.devaddr;
+  memcpy(nwkKey, LMIC.nwkKey, sizeof(LMIC.nwkKey));
+  memcpy(artKey, LMIC.artKey, sizeof(LMIC.artKey));
+}
+
+void LMIC_setLinkCheckMode(bit_t enabled) {}
+
+void LMIC_setAdrMode(bit_t enabled) {
+  LMIC.adrEnabled = enabled;
+}
+
+void LMIC_setDrTxpow(dr_t dr, s1_t txpow) {
+  LMIC.datarate = dr;
+  LMIC.adrTxPow = txpow;
+}
+
+void LMIC_setSeqnoUp(u4_t seqno) {
+  LMIC.seqnoUp = seqno;
+}
+
+u4_t LMIC_getSeqnoUp() {
+  return LMIC.seqnoUp;
+}
+
+#if defined(CFG_eu868)
+bit_t LMIC_setupChannel(u1_t channel, u4_t freq, u2_t drmap, s1_t band) {
+  if (channel>=MAX_CHANNELS) {
+    return 0;
+  }
+  LMIC.channelFreq[channel] = freq;
+  LMIC.channelDrMap[channel] = drmap ? drmap : DR_RANGE_MAP(DR_SF12, DR_SF7);
+  LMIC.channelMap |= 1 << channel;
+  return 1;
+}
+
+void LMIC_disableChannel(u1_t channel) {
+  LMIC.channelFreq[channel] = 0;
+  LMIC.channelDrMap[channel] = 0;
+  LMIC.channelMap &= ~(1 << channel);
+}
+#else
+void LMIC_enableChannel(u1_t channel) {
+  if (channel<72) {
+    LMIC.channelMap[channel >> 4] |= 1 << (channel & 15);
+  }
+}
+
+void LMIC_disableChannel(u1_t channel) {
+  if (channel<72) {
+    LMIC.channelMap[channel >> 4] &= ~(1 << (channel & 15));
+  }
+}
+
+void LMIC_enableSubBand(u1_t band) {
+  for (uint8_t ch=band * 8; ch<band * 8 + 8; ++ch) {
+    LMIC_enableChannel(ch);
+  }
+  LMIC_enableChannel(64 + band);
+}
+
+void LMIC_disableSubBand(u1_t band) {
+  for (uint8_t ch=band * 8; ch<band * 8 + 8; ++ch) {
+    LMIC_disableChannel(ch);
+  }
+  LMIC_disableChannel(64 + band);
+}
+
+void LMIC_selectSubBand(u1_t band) {
+  for (uint8_t b=0; b<8; ++b) {
+    if (b==band) {
+      LMIC_enableSubBand(b);
+    }
+    else {
+      LMIC_disableSubBand(b);
+    }
+  }
+}
+#endif
@@ -0,0 +1,47 @@
+#include "Logging.h"
+
+Logging Log;
+
+static bool enabled() {
+  static int on = -1;
+  if (on<0) {
+    on = getenv("SIM_LOG")!=NULL;
+  }
+  return on;
+}
+
+// printf with arguments taken from list, so any conversion prints any argument sensibly
+void Logging::write(const char *format, const LogArg *args) {
+  if (!enabled()) {
+    return;
+  }
+  for (const char *c = format; *c; ++c) {
+    if (*c!='%' || c[1]==0) {
+      fputc(*c, stderr);
+      continue;
+    }
+    char conversion = *++c;
+    if (conversion=='%') {
+      fputc('%', stderr);
+      continue;
+    }
+    const LogArg *a = args;
+    if (a->kind!=LogArg::None) {
+      ++args;
+    }
+    switch (a->kind) {
+      case LogArg::Integer:
+        fprintf(stderr, (conversion=='x' || conversion=='X') ? "%llx" : "%lld", a->i);
+        break;
+      case LogArg::Real:
+        fprintf(stderr, "%g", a->d);
+        break;
+      case LogArg::String:
+        fputs(a->s ? a->s : "(null)", stderr);
+        break;
+      case LogArg::None:
+        fputs("(missing)", stderr);
+        break;
+    }
+  }
+}
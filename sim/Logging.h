@@ -0,0 +1,70 @@
+/*
+ Host stand-in for the Arduino logging library. Output goes to stderr, and only
+ with SIM_LOG set in the environment, so test runs stay quiet.
+*/
+#pragma once
+#include <Arduino.h>
+
+#define LOG_LEVEL_NOOUTPUT 0
+#define LOG_LEVEL_ERRORS 1
+#define LOG_LEVEL_INFOS 2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_VERBOSE 4
+#define CR "\r\n"
+
+typedef void (*LogPrintFn)(const char *s);
+
+class LogBufferedPrinter {
+public:
+  LogBufferedPrinter(LogPrintFn print, char *buffer, size_t size) : print(print) {}
+  LogPrintFn print;
+};
+
+// One printf argument, whatever its type
+class LogArg {
+public:
+  LogArg() : kind(None) {}
+  LogArg(const char *s) : kind(String), s(s) {}
+  LogArg(char *s) : kind(String), s(s) {}
+  LogArg(double d) : kind(Real), d(d) {}
+  template<class T, class = typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type>
+  LogArg(T i) : kind(Integer), i((long long)i) {}
+  template<class T> LogArg(T *p) : kind(Integer), i((long long)(uintptr_t)p) {}
+
+  enum { None, Integer, Real, String } kind;
+  union {
+    long long i;
+    double d;
+    const char *s;
+  };
+};
+
+class Logging {
+public:
+  void Init(int level, long baud) { this->level = level; }
+  void Init(int level, LogBufferedPrinter &printer) { this->level = level; }
+
+  #define LOGGING_METHOD(name, at) \
+    template<class... A> void name(const char *format, A... args) { print(at, format, args...); } \
+    template<class... A> void name(const __FlashStringHelper *format, A... args) { print(at, (const char *)format, args...); }
+  LOGGING_METHOD(Error, LOG_LEVEL_ERRORS)
+  LOGGING_METHOD(Warn, LOG_LEVEL_ERRORS)
+  LOGGING_METHOD(Info, LOG_LEVEL_INFOS)
+  LOGGING_METHOD(Debug, LOG_LEVEL_DEBUG)
+  LOGGING_METHOD(Debug_, LOG_LEVEL_DEBUG)
+  LOGGING_METHOD(Verbose, LOG_LEVEL_VERBOSE)
+  #undef LOGGING_METHOD
+
+private:
+  template<class... A> void print(int at, const char *format, A... args) {
+    if (at<=level) {
+      LogArg list[] = { LogArg(args)..., LogArg() };
+      write(format, list);
+    }
+  }
+  void write(const char *format, const LogArg *args);
+
+  int level = LOG_LEVEL_NOOUTPUT;
+};
+
+extern Logging Log;
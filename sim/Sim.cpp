@@ -0,0 +1,607 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <Arduino.h>
+#include "Adafruit_BLE.h"
+#include "Adafruit_BLEGatt.h"
+#include "Sim.h"
+#include "../MapTheThings-Arduino/Idle.h"
+#include "../MapTheThings-Arduino/Bluetooth.h"
+
+// Implemented by the sketch
+void setup();
+void loop();
+
+#define NVM_SIZE 256
+#define GATT_MAX_CHARS 48
+#define GATT_MAX_VALUE 20
+#define TX_RESULT_UUID 0x2ADA
+#define SEND_ACKD_PACKET_UUID 0x2ADB
+#define PHONE_WRITES 64
+#define BLE_IRQ_PIN 7
+#define VBAT_PIN A7
+
+typedef struct {
+  uint16_t uuid;
+  uint8_t len;
+  uint8_t value[GATT_MAX_VALUE];
+} GattChar;
+
+// Everything that outlives a boot
+typedef struct {
+  SimConfig config;
+  SimReport report;
+  uint32_t seed;
+  uint8_t nvm[NVM_SIZE];
+  uint8_t serviceCount;
+  uint8_t charCount;
+  GattChar chars[GATT_MAX_CHARS]; // By id - 1
+} SimShared;
+
+static SimShared *shared = NULL;
+SimConfig *simConfig = NULL;
+SimReport *simReport = NULL;
+
+// State of the current boot, fresh in each child
+static uint64_t nowUs = 0;
+static uint64_t sleptUs = 0;
+static uint32_t rng = 1;
+static void (*bleIsr)(void) = NULL;
+static BLEGattRxCb gattCallbacks[GATT_MAX_CHARS + 1];
+
+typedef struct {
+  uint64_t dueUs;
+  uint16_t uuid;
+  uint8_t len;
+  uint8_t data[GATT_MAX_VALUE];
+} PhoneWrite;
+static PhoneWrite phoneWrites[PHONE_WRITES];
+static uint8_t phoneWriteCount = 0;
+
+SimSerial Serial;
+static SCB_Type scb;
+SCB_Type *SCB = &scb;
+
+/* Harness */
+
+void simReset(uint32_t seed) {
+  if (shared==NULL) {
+    shared = (SimShared *)mmap(NULL, sizeof(SimShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared==MAP_FAILED) {
+      perror("mmap");
+      abort();
+    }
+    simConfig = &shared->config;
+    simReport = &shared->report;
+  }
+  memset(shared, 0, sizeof(*shared));
+  memset(shared->nvm, 0xFF, sizeof(shared->nvm));
+  shared->seed = seed;
+  for (uint8_t sf=0; sf<13; ++sf) {
+    simConfig->deliverPermille[sf] = 900;
+  }
+  for (uint8_t ch=0; ch<SIM_MAX_CHANNELS; ++ch) {
+    simConfig->channelPermille[ch] = 1000;
+  }
+  simConfig->ackPermille = 900;
+  simConfig->joinAcceptPermille = 500;
+  simConfig->batteryMv = 3900;
+  #if defined(FLASH_FILE)
+  remove(FLASH_FILE);
+  #endif
+}
+
+static uint64_t absoluteUs() {
+  return simReport->elapsedUs + nowUs;
+}
+
+static void endBoot() {
+  simReport->elapsedUs += nowUs;
+  simReport->awakeUs += nowUs - sleptUs;
+  fflush(stdout);
+  fflush(stderr);
+  _exit(0);
+}
+
+bool simBoot(void (*script)(void)) {
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid==0) {
+    rng = (shared->seed ^ (simReport->boots * 2654435761UL)) | 1;
+    simReport->boots++;
+    setup();
+    script();
+    endBoot();
+  }
+  int status = 0;
+  if (pid<0 || waitpid(pid, &status, 0)!=pid) {
+    return false;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status)==0;
+}
+
+static bool phoneWriteDue() {
+  return phoneWriteCount>0 && phoneWrites[0].dueUs<=nowUs;
+}
+
+static void raiseBleIrq() {
+  if (bleIsr && phoneWriteDue()) {
+    bleIsr();
+  }
+}
+
+/* A node that does not sleep while its radio is busy polls for the end of the
+  transmission. Passes until the next LMIC job, phone write or Bluetooth timer
+  find nothing to do, so the clock jumps over them. The time counts as awake,
+  as the passes would have.
+*/
+static void skipPolling(uint64_t endUs) {
+  uint64_t untilUs = nowUs + simRadioQuietUs();
+  if (untilUs==nowUs) {
+    return;
+  }
+  uint64_t bleUs = nowUs + (uint64_t)bluetoothIdleMs(millis()) * 1000;
+  if (bleUs<untilUs) {
+    untilUs = bleUs;
+  }
+  if (phoneWriteCount>0 && phoneWrites[0].dueUs<untilUs) {
+    untilUs = phoneWrites[0].dueUs;
+  }
+  if (endUs<untilUs) {
+    untilUs = endUs;
+  }
+  if (untilUs>nowUs) {
+    simAdvanceUs(untilUs - nowUs);
+  }
+}
+
+void simRun(uint32_t ms) {
+  uint64_t endUs = nowUs + (uint64_t)ms * 1000;
+  while (nowUs<endUs) {
+    raiseBleIrq();
+    uint64_t sleptBefore = sleptUs;
+    loop();
+    simAdvanceUs(SIM_LOOP_PASS_US);
+    if (sleptUs==sleptBefore) {
+      skipPolling(endUs);
+    }
+  }
+}
+
+uint64_t simNowUs() {
+  return nowUs;
+}
+
+void simAdvanceUs(uint64_t us) {
+  nowUs += us;
+}
+
+uint32_t simRandom(uint32_t limit) {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return limit ? rng % limit : 0;
+}
+
+void idleVirtualAdvance(uint32_t ms) {
+  uint64_t untilUs = nowUs + (uint64_t)ms * 1000;
+  bool wake = false;
+  if (phoneWriteCount>0 && phoneWrites[0].dueUs<untilUs) {
+    untilUs = phoneWrites[0].dueUs>nowUs ? phoneWrites[0].dueUs : nowUs;
+    wake = true;
+  }
+  sleptUs += untilUs - nowUs;
+  nowUs = untilUs;
+  if (wake) {
+    raiseBleIrq();
+  }
+}
+
+/* Phone */
+
+void simPhoneWrite(uint16_t uuid, const uint8_t data[], uint8_t len) {
+  if (phoneWriteCount==PHONE_WRITES || len>GATT_MAX_VALUE) {
+    fprintf(stderr, "simPhoneWrite: dropped write to 0x%04X\n", uuid);
+    return;
+  }
+  PhoneWrite *w = &phoneWrites[phoneWriteCount++];
+  w->dueUs = nowUs;
+  w->uuid = uuid;
+  w->len = len;
+  memcpy(w->data, data, len);
+}
+
+void simSendSample(uint16_t id, uint8_t len) {
+  uint8_t data[GATT_MAX_VALUE];
+  if (len<2 || len>=GATT_MAX_VALUE || id>=SIM_MAX_SAMPLES) {
+    return;
+  }
+  data[0] = id & 0xFF; // BLE seq
+  data[1] = id & 0xFF;
+  data[2] = id >> 8;
+  for (uint8_t i=2; i<len; ++i) {
+    data[1 + i] = 0xA0 + i;
+  }
+  simReport->written[id] = 1;
+  simReport->writtenAtUs[id] = absoluteUs();
+  simReport->samplesWritten++;
+  simPhoneWrite(SEND_ACKD_PACKET_UUID, data, 1 + len);
+}
+
+void simProvisionAbp() {
+  const uint8_t devAddr[4] = { 0x26, 0x01, 0x2B, 0x32 };
+  uint8_t key[16];
+  for (uint8_t i=0; i<sizeof(key); ++i) {
+    key[i] = 0x10 + i;
+  }
+  simPhoneWrite(0x2AD2, devAddr, sizeof(devAddr));
+  simPhoneWrite(0x2AD3, key, sizeof(key));
+  simPhoneWrite(0x2AD4, key, sizeof(key));
+}
+
+void simProvisionOtaa() {
+  uint8_t key[16];
+  uint8_t eui[8];
+  for (uint8_t i=0; i<sizeof(key); ++i) {
+    key[i] = 0x20 + i;
+  }
+  for (uint8_t i=0; i<sizeof(eui); ++i) {
+    eui[i] = 0x30 + i;
+  }
+  simPhoneWrite(0x2AD7, key, sizeof(key));
+  simPhoneWrite(0x2AD8, eui, sizeof(eui));
+  eui[0] = 0x77;
+  simPhoneWrite(0x2AD9, eui, sizeof(eui));
+}
+
+int simCharValue(uint16_t uuid, uint8_t data[]) {
+  for (uint8_t i=0; i<shared->charCount; ++i) {
+    if (shared->chars[i].uuid==uuid) {
+      memcpy(data, shared->chars[i].value, shared->chars[i].len);
+      return shared->chars[i].len;
+    }
+  }
+  return -1;
+}
+
+uint8_t *simNvm() {
+  return shared->nvm;
+}
+
+/* Network */
+
+static uint8_t maxPayload(uint8_t sf) {
+  #if defined(CFG_eu868)
+  return sf>=10 ? 51 : sf==9 ? 115 : 222;
+  #else
+  return sf==10 ? 11 : sf==9 ? 53 : sf==8 ? 125 : 242;
+  #endif
+}
+
+static void deliverSample(const uint8_t data[], uint8_t len) {
+  if (len<2) {
+    return;
+  }
+  uint16_t id = data[0] | (data[1] << 8);
+  if (id>=SIM_MAX_SAMPLES || !simReport->written[id] || simReport->delivered[id]) {
+    return;
+  }
+  simReport->delivered[id] = 1;
+  simReport->samplesDelivered++;
+  uint32_t ms = (absoluteUs() - simReport->writtenAtUs[id]) / 1000;
+  simReport->latencyTotalMs += ms;
+  if (ms>simReport->latencyMaxMs) {
+    simReport->latencyMaxMs = ms;
+  }
+}
+
+// Port 1 carries one sample, port 2 [len][sample] entries, port 3 [len][age:2][sample] entries,
+// port 4 one location frame
+static void deliverFrame(uint8_t port, const uint8_t data[], uint8_t len) {
+  if (port==4) {
+    simReport->locationFrames++;
+    return;
+  }
+  if (port==1) {
+    deliverSample(data, len);
+    return;
+  }
+  uint8_t header = port==3 ? 3 : 1;
+  for (uint8_t pos=0; pos + header<=len; ) {
+    uint8_t n = data[pos];
+    if (pos + header + n>len) {
+      return;
+    }
+    deliverSample(&data[pos + header], n);
+    pos += header + n;
+  }
+}
+
+bool simNetworkUplink(uint8_t port, const uint8_t data[], uint8_t len, uint32_t fcnt, bool retry,
+  uint8_t sf, uint8_t channel, bool confirmed, bool *acked) {
+  *acked = false;
+  simReport->uplinks++;
+  if (channel<SIM_MAX_CHANNELS) {
+    simReport->uplinksPerChannel[channel]++;
+  }
+  if (sf<13) {
+    simReport->uplinksPerSf[sf]++;
+  }
+  if (!retry) {
+    if (simReport->fcntSeen && fcnt<=simReport->fcntMax) {
+      simReport->fcntRepeats++;
+    }
+    if (!simReport->fcntSeen || fcnt>simReport->fcntMax) {
+      simReport->fcntMax = fcnt;
+    }
+    simReport->fcntSeen = true;
+  }
+  if (len>maxPayload(sf)) {
+    if (!retry) {
+      simReport->oversizeFrames++;
+    }
+    return false;
+  }
+  uint32_t permille = sf<13 ? simConfig->deliverPermille[sf] : 0;
+  if (channel<SIM_MAX_CHANNELS) {
+    permille = permille * simConfig->channelPermille[channel] / 1000;
+  }
+  if (simRandom(1000)>=permille) {
+    return false;
+  }
+  static uint32_t lastHeardFcnt = 0xFFFFFFFF;
+  if (!retry || fcnt!=lastHeardFcnt) {
+    simReport->framesHeard++;
+    deliverFrame(port, data, len);
+  }
+  lastHeardFcnt = fcnt;
+  *acked = confirmed && simRandom(1000)<simConfig->ackPermille;
+  return true;
+}
+
+bool simNetworkJoin(uint8_t sf, uint32_t airtimeUs) {
+  simReport->joinRequests++;
+  simReport->joinAirtimeUs += airtimeUs;
+  if (simRandom(1000)>=simConfig->joinAcceptPermille) {
+    return false;
+  }
+  simReport->joins++;
+  simReport->fcntSeen = false; // New session, counters start over
+  return true;
+}
+
+/* Arduino core */
+
+unsigned long millis() {
+  return (unsigned long)(uint32_t)(nowUs / 1000);
+}
+
+unsigned long micros() {
+  return (unsigned long)(uint32_t)nowUs;
+}
+
+void delay(unsigned long ms) {
+  simAdvanceUs((uint64_t)ms * 1000);
+}
+
+void pinMode(int pin, int mode) {}
+void digitalWrite(int pin, int value) {}
+
+int digitalRead(int pin) {
+  return pin==BLE_IRQ_PIN && phoneWriteDue() ? HIGH : LOW;
+}
+
+// The battery sits behind a halving divider on a 3.3 V, 10 bit ADC
+int analogRead(int pin) {
+  return pin==VBAT_PIN ? (uint32_t)simConfig->batteryMv * 1024 / 6600 : 0;
+}
+
+int digitalPinToInterrupt(int pin) {
+  return pin;
+}
+
+void attachInterrupt(int interrupt, void (*isr)(void), int mode) {
+  if (interrupt==BLE_IRQ_PIN) {
+    bleIsr = isr;
+  }
+}
+
+void noInterrupts() {}
+void interrupts() {}
+
+static bool serialEnabled() {
+  static int on = -1;
+  if (on<0) {
+    on = getenv("SIM_LOG")!=NULL;
+  }
+  return on;
+}
+
+size_t SimSerial::write(uint8_t c) {
+  if (serialEnabled()) {
+    fputc(c, stderr);
+  }
+  return 1;
+}
+
+size_t SimSerial::write(const uint8_t *data, size_t len) {
+  if (serialEnabled()) {
+    fwrite(data, 1, len, stderr);
+  }
+  return len;
+}
+
+size_t SimSerial::print(const char *s) {
+  return write((const uint8_t *)s, strlen(s));
+}
+
+size_t SimSerial::print(long n, int base) {
+  char buffer[24];
+  snprintf(buffer, sizeof(buffer), base==HEX ? "%lx" : "%ld", n);
+  return print(buffer);
+}
+
+size_t SimSerial::print(unsigned long n, int base) {
+  char buffer[24];
+  snprintf(buffer, sizeof(buffer), base==HEX ? "%lx" : "%lu", n);
+  return print(buffer);
+}
+
+/* Bluefruit module */
+
+static void atCost() {
+  simAdvanceUs(SIM_AT_COMMAND_US);
+}
+
+bool Adafruit_BLE::begin(bool verbose) {
+  atCost();
+  return true;
+}
+
+bool Adafruit_BLE::factoryReset() {
+  simAdvanceUs(SIM_MODULE_RESET_US);
+  memset(shared->nvm, 0, sizeof(shared->nvm));
+  shared->serviceCount = 0;
+  shared->charCount = 0;
+  return true;
+}
+
+bool Adafruit_BLE::reset(bool blocking) {
+  simAdvanceUs(SIM_MODULE_RESET_US);
+  return true;
+}
+
+bool Adafruit_BLE::disconnect() {
+  atCost();
+  return true;
+}
+
+// Parses hex after "UUID=0x" and the text after "VALUE=" of GATTADDCHAR
+static bool addChar(const char *command, int32_t *reply) {
+  const char *uuid = strstr(command, "UUID=0x");
+  if (uuid==NULL || shared->charCount==GATT_MAX_CHARS) {
+    return false;
+  }
+  GattChar *c = &shared->chars[shared->charCount++];
+  c->uuid = strtoul(uuid + 7, NULL, 16);
+  c->len = 0;
+  const char *value = strstr(command, "VALUE=");
+  if (value) {
+    value += 6;
+    while (value[c->len] && value[c->len]!=',' && c->len<GATT_MAX_VALUE) {
+      c->value[c->len] = value[c->len];
+      ++c->len;
+    }
+  }
+  *reply = shared->charCount;
+  return true;
+}
+
+bool Adafruit_BLE::sendCommandCheckOK(const char *command) {
+  atCost();
+  if (strcmp(command, "AT+GATTCLEAR")==0) {
+    shared->serviceCount = 0;
+    shared->charCount = 0;
+  }
+  return true;
+}
+
+bool Adafruit_BLE::sendCommandWithIntReply(const char *command, int32_t *reply) {
+  atCost();
+  if (strncmp(command, "AT+GATTADDSERVICE", 17)==0) {
+    *reply = ++shared->serviceCount;
+    return true;
+  }
+  if (strncmp(command, "AT+GATTADDCHAR", 14)==0) {
+    return addChar(command, reply);
+  }
+  *reply = 0;
+  return true;
+}
+
+// Delivers due phone writes, in order, to the callbacks of their characteristics
+void Adafruit_BLE::update(uint32_t periodMs) {
+  atCost();
+  while (phoneWriteDue()) {
+    PhoneWrite w = phoneWrites[0];
+    memmove(&phoneWrites[0], &phoneWrites[1], (--phoneWriteCount) * sizeof(PhoneWrite));
+    atCost();
+    for (uint8_t i=0; i<shared->charCount; ++i) {
+      if (shared->chars[i].uuid==w.uuid) {
+        memcpy(shared->chars[i].value, w.data, w.len);
+        shared->chars[i].len = w.len;
+        if (gattCallbacks[i + 1]) {
+          gattCallbacks[i + 1](i + 1, w.data, w.len);
+        }
+        break;
+      }
+    }
+  }
+}
+
+void Adafruit_BLE::setBleGattRxCallback(int32_t charId, BLEGattRxCb callback) {
+  if (charId>0 && charId<=GATT_MAX_CHARS) {
+    gattCallbacks[charId] = callback;
+  }
+}
+
+bool Adafruit_BLE::readNVM(uint16_t offset, int32_t *number) {
+  return readNVM(offset, (uint8_t *)number, sizeof(*number));
+}
+
+bool Adafruit_BLE::readNVM(uint16_t offset, uint8_t data[], uint16_t size) {
+  atCost();
+  if (offset + size>NVM_SIZE) {
+    return false;
+  }
+  memcpy(data, &shared->nvm[offset], size);
+  return true;
+}
+
+bool Adafruit_BLE::writeNVM(uint16_t offset, int32_t number) {
+  return writeNVM(offset, (const uint8_t *)&number, sizeof(number));
+}
+
+bool Adafruit_BLE::writeNVM(uint16_t offset, uint8_t const data[], uint16_t size) {
+  if (simConfig->nvmWritesToPowerLoss && --simConfig->nvmWritesToPowerLoss==0) {
+    endBoot(); // Power fails before this write reaches the module
+  }
+  simAdvanceUs(SIM_NVM_WRITE_US);
+  simReport->nvmWrites++;
+  if (offset + size>NVM_SIZE) {
+    return false;
+  }
+  memcpy(&shared->nvm[offset], data, size);
+  return true;
+}
+
+bool Adafruit_BLEGatt::setChar(uint8_t charId, uint8_t const data[], uint8_t size) {
+  atCost();
+  if (charId==0 || charId>shared->charCount || size>GATT_MAX_VALUE) {
+    return false;
+  }
+  GattChar *c = &shared->chars[charId - 1];
+  memcpy(c->value, data, size);
+  c->len = size;
+  if (c->uuid==TX_RESULT_UUID && size>=4) {
+    uint16_t error = data[2] | (data[3] << 8);
+    if (error<4) {
+      simReport->txResults[error]++;
+    }
+    memcpy(simReport->lastTxResult, data, size<sizeof(simReport->lastTxResult) ? size : sizeof(simReport->lastTxResult));
+  }
+  return true;
+}
+
+uint8_t Adafruit_BLEGatt::getChar(uint8_t charId, uint8_t *buffer, uint8_t bufsize) {
+  atCost();
+  if (charId==0 || charId>shared->charCount) {
+    return 0;
+  }
+  GattChar *c = &shared->chars[charId - 1];
+  uint8_t len = c->len<bufsize ? c->len : bufsize;
+  memcpy(buffer, c->value, len);
+  return len;
+}
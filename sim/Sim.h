@@ -0,0 +1,104 @@
+#include <stdint.h>
+
+/*
+ Whole-node simulator for the native build (env:native).
+
+ The sketch runs unchanged against the stand-ins in this directory: the
+ Arduino core, LMIC and the Bluefruit module. A virtual clock replaces
+ millis()/micros() and LMIC time. It moves only when the node sleeps
+ (idleSleep under IDLE_VIRTUAL_CLOCK), or when a stand-in charges for work,
+ so runs are deterministic and as fast as the host allows.
+
+ simBoot() runs one boot of the node, setup() and then a script, in a child
+ process. Every boot starts from fresh RAM, as after a reset, and a script
+ that returns is a power loss at that instant. What outlives a boot is shared
+ with the parent: the Bluefruit module's NVM and GATT table, the network's
+ view and the report. The backlog flash area is the FLASH_FILE.
+
+ The phone side writes characteristics by UUID. The network side hears
+ uplinks with the chances in SimConfig, decodes the samples they carry and
+ checks frame counters.
+*/
+
+// Virtual time charged for work. Awake time is what is not spent in idleSleep.
+#define SIM_LOOP_PASS_US 250    // One pass of loop(), besides the calls below
+#define SIM_AT_COMMAND_US 3000  // Bluefruit SPI AT round trip
+#define SIM_NVM_WRITE_US 20000  // Bluefruit NVM write
+#define SIM_MODULE_RESET_US 1000000
+
+#define SIM_MAX_SAMPLES 4096
+#define SIM_MAX_CHANNELS 72
+
+typedef struct {
+  uint16_t deliverPermille[13];  // Chance a gateway hears an uplink, by SF
+  uint16_t channelPermille[SIM_MAX_CHANNELS]; // Scales deliverPermille per channel
+  uint16_t ackPermille;          // Chance the ACK of a heard confirmed uplink gets back
+  uint16_t joinAcceptPermille;   // Chance a join request is heard and accepted
+  uint16_t batteryMv;
+  uint16_t nvmWritesToPowerLoss; // If not 0, power fails in place of this NVM write from now
+} SimConfig;
+
+typedef struct {
+  // Phone
+  uint32_t samplesWritten;
+  uint32_t txResults[4];      // TX result notifications by error code (TX_ERROR_*)
+  uint8_t lastTxResult[19];   // Latest TX result notification
+  // Network
+  uint32_t uplinks;           // Transmissions, confirmed retries included
+  uint32_t uplinksPerChannel[SIM_MAX_CHANNELS];
+  uint32_t uplinksPerSf[13];
+  uint32_t framesHeard;       // Distinct frames heard by a gateway
+  uint32_t oversizeFrames;    // Longer than the data rate allows. Never heard.
+  uint32_t samplesDelivered;  // Distinct samples in heard frames
+  uint32_t locationFrames;    // Heard on the location port
+  uint32_t joinRequests;
+  uint64_t joinAirtimeUs;     // Of the join requests
+  uint32_t joins;
+  uint32_t fcntRepeats;       // New frames whose counter did not exceed every earlier one in the session
+  uint64_t latencyTotalMs;    // Sample write to reception, over delivered samples
+  uint32_t latencyMaxMs;
+  // Node
+  uint32_t boots;
+  uint32_t nvmWrites;         // Bluefruit NVM write commands
+  uint64_t elapsedUs;         // Over all boots
+  uint64_t awakeUs;
+  uint32_t values[8];         // For scripts to hand results back from a boot
+  // Per sample id
+  uint64_t writtenAtUs[SIM_MAX_SAMPLES];
+  uint8_t written[SIM_MAX_SAMPLES];
+  uint8_t delivered[SIM_MAX_SAMPLES];
+  // Frame counter check state
+  bool fcntSeen;
+  uint32_t fcntMax;
+} SimReport;
+
+extern SimConfig *simConfig;
+extern SimReport *simReport;
+
+// Clears the module, the flash file, the network and the report. Sets default chances.
+void simReset(uint32_t seed);
+// One boot: setup(), then script. False if the boot crashed. Power loss set up with
+// nvmWritesToPowerLoss ends the boot early and counts as a clean one.
+bool simBoot(void (*script)(void));
+void simRun(uint32_t ms); // loop() for ms of virtual time
+
+uint64_t simNowUs(void);  // Since this boot
+void simAdvanceUs(uint64_t us); // Awake time spent in a stand-in
+
+// Phone side
+void simPhoneWrite(uint16_t uuid, const uint8_t data[], uint8_t len);
+// Sample with id in its first two bytes, written on Send acknowledged packet with BLE seq id & 0xFF
+void simSendSample(uint16_t id, uint8_t len);
+void simProvisionAbp(void);
+void simProvisionOtaa(void);
+int simCharValue(uint16_t uuid, uint8_t data[]); // Last value the node set. -1 if none.
+// The Bluefruit module's 256 byte NVM, for setting up what an interrupted write leaves behind
+uint8_t *simNvm(void);
+
+// Network side, called by the LMIC stand-in. Return true if heard.
+bool simNetworkUplink(uint8_t port, const uint8_t data[], uint8_t len, uint32_t fcnt, bool retry,
+  uint8_t sf, uint8_t channel, bool confirmed, bool *acked);
+bool simNetworkJoin(uint8_t sf, uint32_t airtimeUs);
+// While a transmission is pending and no LMIC job is runnable, time until the next one is due. Else 0.
+uint64_t simRadioQuietUs(void);
+uint32_t simRandom(uint32_t limit); // Deterministic, 0 to limit-1
@@ -0,0 +1,3 @@
+// The sketch as a translation unit of the native build, as the Arduino IDE would prepare it
+#include <Arduino.h>
+#include "../MapTheThings-Arduino/MapTheThings-Arduino.ino"
@@ -0,0 +1,147 @@
+/*
+ Host stand-in for the LMIC library: the job queue, MAC state the node reads
+ and writes, and a radio whose uplinks reach the simulated network in Sim.cpp.
+ Not modelled: MAC commands, band duty cycles and radio registers.
+ Field and function names follow arduino-lmic.
+*/
+#pragma once
+#include <Arduino.h>
+
+typedef uint8_t u1_t;
+typedef int8_t s1_t;
+typedef uint16_t u2_t;
+typedef int16_t s2_t;
+typedef uint32_t u4_t;
+typedef int32_t s4_t;
+typedef u1_t bit_t;
+typedef u1_t dr_t;
+typedef s4_t ostime_t;
+typedef u4_t devaddr_t;
+
+#define OSTICKS_PER_SEC 62500
+#define us2osticks(us) ((ostime_t)(((int64_t)(us) * OSTICKS_PER_SEC) / 1000000))
+#define ms2osticks(ms) ((ostime_t)(((int64_t)(ms) * OSTICKS_PER_SEC) / 1000))
+#define sec2osticks(s) ((ostime_t)((int64_t)(s) * OSTICKS_PER_SEC))
+#define osticks2ms(t) ((s4_t)(((t) * (int64_t)1000) / OSTICKS_PER_SEC))
+#define osticks2us(t) ((s4_t)(((t) * (int64_t)1000000) / OSTICKS_PER_SEC))
+
+struct osjob_t;
+typedef void (*osjobcb_t)(struct osjob_t *);
+struct osjob_t {
+  struct osjob_t *next;
+  ostime_t deadline;
+  osjobcb_t func;
+};
+
+enum { MAX_LEN_FRAME = 64 };
+enum { MAX_LEN_PAYLOAD = MAX_LEN_FRAME - 13 };
+
+enum _ev_t { EV_SCAN_TIMEOUT=1, EV_BEACON_FOUND, EV_BEACON_MISSED, EV_BEACON_TRACKED, EV_JOINING,
+  EV_JOINED, EV_RFU1, EV_JOIN_FAILED, EV_REJOIN_FAILED, EV_TXCOMPLETE, EV_LOST_TSYNC, EV_RESET,
+  EV_RXCOMPLETE, EV_LINK_DEAD, EV_LINK_ALIVE, EV_SCAN_FOUND, EV_TXSTART };
+typedef enum _ev_t ev_t;
+
+enum { OP_NONE=0x0000, OP_SCAN=0x0001, OP_TRACK=0x0002, OP_JOINING=0x0004, OP_TXDATA=0x0008,
+  OP_POLL=0x0010, OP_REJOIN=0x0020, OP_SHUTDOWN=0x0040, OP_TXRXPEND=0x0080, OP_RNDTX=0x0100,
+  OP_PINGINI=0x0200, OP_PINGABLE=0x0400, OP_NEXTCHNL=0x0800, OP_LINKDEAD=0x1000, OP_TESTMODE=0x2000,
+  OP_UNJOIN=0x4000 };
+enum { TXRX_ACK=0x80, TXRX_NACK=0x40, TXRX_NOPORT=0x20, TXRX_PORT=0x10, TXRX_DNW1=0x01,
+  TXRX_DNW2=0x02, TXRX_PING=0x04 };
+enum { TXCONF_ATTEMPTS = 8 };
+
+#define DR_RANGE_MAP(drlo, drhi) ((u2_t)((0xFFFF << (drlo)) & (0xFFFF >> (15 - (drhi)))))
+
+#if defined(CFG_eu868)
+enum _dr_eu868_t { DR_SF12=0, DR_SF11, DR_SF10, DR_SF9, DR_SF8, DR_SF7, DR_SF7B, DR_FSK, DR_NONE };
+enum { BAND_MILLI=0, BAND_CENTI=1, BAND_DECI=2, BAND_AUX=3 };
+enum { MAX_CHANNELS = 16, MAX_BANDS = 4 };
+#else
+enum _dr_us915_t { DR_SF10=0, DR_SF9, DR_SF8, DR_SF7, DR_SF8C, DR_NONE,
+  DR_SF12CR=8, DR_SF11CR, DR_SF10CR, DR_SF9CR, DR_SF8CR, DR_SF7CR };
+enum { MAX_XCHANNELS = 2 };
+enum { US915_125kHz_CHANNELS = 64, US915_500kHz_CHANNELS = 8 };
+#endif
+
+struct lmic_t {
+  u1_t frame[MAX_LEN_FRAME];
+  u1_t dataBeg;   // Downlink payload offset in frame
+  u1_t dataLen;   // Downlink payload length
+  u1_t txrxFlags;
+  u1_t txCnt;     // Confirmed uplink retries so far
+  u1_t txChnl;
+  s1_t rssi;
+  s1_t snr;       // Quarter dB
+  u2_t opmode;
+  u2_t devNonce;
+  u4_t netid;
+  devaddr_t devaddr;
+  u1_t nwkKey[16];
+  u1_t artKey[16];
+  u4_t seqnoUp;
+  u4_t seqnoDn;
+  dr_t datarate;
+  s1_t adrTxPow;
+  bit_t adrEnabled;
+  u1_t rxDelay;   // Seconds to RX1
+  u1_t rx1DrOffset;
+  dr_t dn2Dr;
+  u4_t dn2Freq;
+  u1_t pendTxPort;
+  u1_t pendTxConf;
+  u1_t pendTxLen;
+  u1_t pendTxData[MAX_LEN_PAYLOAD];
+#if defined(CFG_eu868)
+  u4_t channelFreq[MAX_CHANNELS];
+  u2_t channelDrMap[MAX_CHANNELS];
+  u2_t channelMap;
+#else
+  u2_t channelMap[(72 + MAX_XCHANNELS + 15) / 16];
+#endif
+};
+extern struct lmic_t LMIC;
+
+struct lmic_pinmap {
+  u1_t nss;
+  u1_t rxtx;
+  u1_t rst;
+  u1_t dio[3];
+};
+#define LMIC_UNUSED_PIN 0xff
+
+// Implemented by the sketch
+void onEvent(ev_t ev);
+void os_getArtEui(u1_t *buf);
+void os_getDevEui(u1_t *buf);
+void os_getDevKey(u1_t *buf);
+
+void os_init(void);
+void os_runloop_once(void);
+ostime_t os_getTime(void);
+bit_t os_queryTimeCriticalJobs(ostime_t time);
+void os_setCallback(struct osjob_t *job, osjobcb_t cb);
+void os_setTimedCallback(struct osjob_t *job, ostime_t time, osjobcb_t cb);
+void os_clearCallback(struct osjob_t *job);
+u1_t os_getRndU1(void);
+u2_t os_getRndU2(void);
+
+void LMIC_reset(void);
+int LMIC_setTxData2(u1_t port, u1_t *data, u1_t dlen, u1_t confirmed);
+void LMIC_clrTxData(void);
+bit_t LMIC_startJoining(void);
+void LMIC_setSession(u4_t netid, devaddr_t devaddr, u1_t *nwkKey, u1_t *artKey);
+void LMIC_getSessionKeys(u4_t *netid, devaddr_t *devaddr, u1_t *nwkKey, u1_t *artKey);
+void LMIC_setLinkCheckMode(bit_t enabled);
+void LMIC_setAdrMode(bit_t enabled);
+void LMIC_setDrTxpow(dr_t dr, s1_t txpow);
+void LMIC_setSeqnoUp(u4_t seqno);
+u4_t LMIC_getSeqnoUp(void);
+#if defined(CFG_eu868)
+bit_t LMIC_setupChannel(u1_t channel, u4_t freq, u2_t drmap, s1_t band);
+void LMIC_disableChannel(u1_t channel);
+#else
+void LMIC_enableChannel(u1_t channel);
+void LMIC_disableChannel(u1_t channel);
+void LMIC_enableSubBand(u1_t band);
+void LMIC_disableSubBand(u1_t band);
+void LMIC_selectSubBand(u1_t band);
+#endif
@@ -0,0 +1,128 @@
+/*
+ Flash backlog (Backlog.h) on the FLASH_FILE stand-in for the flash area:
+ torn appends, rescans at boot and the ring wrapping over its rows.
+ Run with: pio test -e native
+*/
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include "Backlog.h"
+#include "Flash.h"
+
+// Record layout from Backlog.cpp, to leave what a reset mid-append leaves
+#define ROW_HEADER_SIZE 4
+#define RECORD_HEADER_SIZE 8
+#define STATE_ALLOCATED 0xFE
+
+static uint16_t recordSize(uint8_t len) {
+  return RECORD_HEADER_SIZE + ((2 + len + 3) & ~3);
+}
+
+static void append(uint16_t id, uint8_t len) {
+  uint8_t data[BACKLOG_MAX_SAMPLE];
+  memset(data, 0xA0, len);
+  data[0] = id & 0xFF;
+  data[1] = id >> 8;
+  TEST_ASSERT_TRUE(backlogAppend(data, len, 1000UL * id));
+}
+
+static void assertOldest(uint16_t pos, uint16_t id, uint8_t len, uint16_t bootId) {
+  BacklogRecord r;
+  TEST_ASSERT_TRUE(backlogPeekAt(pos, &r));
+  TEST_ASSERT_EQUAL(len, r.len);
+  TEST_ASSERT_EQUAL(id, r.data[0] | (r.data[1] << 8));
+  TEST_ASSERT_EQUAL(1000UL * id, r.timeMs);
+  TEST_ASSERT_EQUAL(bootId, r.bootId);
+}
+
+void setUp(void) {
+  remove(FLASH_FILE);
+  TEST_ASSERT_TRUE(backlogInit(1));
+}
+
+void tearDown(void) {
+}
+
+// A reset after the header of a record, before its body, leaves an allocated
+// record. The rescan steps over it and appends go on after it.
+void test_torn_append_skipped(void) {
+  for (uint16_t id=1; id<=3; ++id) {
+    append(id, 6);
+  }
+  const uint8_t torn[4] = { STATE_ALLOCATED, 6, 0x00, (uint8_t)~6 };
+  TEST_ASSERT_TRUE(flashWrite(ROW_HEADER_SIZE + 3*recordSize(6), torn, sizeof(torn)));
+
+  TEST_ASSERT_TRUE(backlogInit(2));
+  TEST_ASSERT_EQUAL(3, backlogCount());
+  append(4, 6);
+  TEST_ASSERT_EQUAL(4, backlogCount());
+  assertOldest(2, 3, 6, 1);
+  assertOldest(3, 4, 6, 2);
+}
+
+// A damaged header ends its row. The next append starts a new row.
+void test_damaged_header_closes_row(void) {
+  append(1, 6);
+  const uint8_t damaged[4] = { STATE_ALLOCATED, 6, 0x00, 0x00 };
+  TEST_ASSERT_TRUE(flashWrite(ROW_HEADER_SIZE + recordSize(6), damaged, sizeof(damaged)));
+
+  TEST_ASSERT_TRUE(backlogInit(2));
+  TEST_ASSERT_EQUAL(1, backlogCount());
+  append(2, 6);
+  TEST_ASSERT_TRUE(backlogInit(3));
+  TEST_ASSERT_EQUAL(2, backlogCount());
+  assertOldest(0, 1, 6, 1);
+  assertOldest(1, 2, 6, 2);
+}
+
+// Unsent records, their times and boot ids are found again after a reboot
+void test_rescan_after_reboot(void) {
+  for (uint16_t id=1; id<=20; ++id) {
+    append(id, 1 + id % BACKLOG_MAX_SAMPLE);
+  }
+  backlogMarkSent(8);
+  TEST_ASSERT_TRUE(backlogInit(2));
+  TEST_ASSERT_EQUAL(12, backlogCount());
+  for (uint16_t pos=0; pos<12; ++pos) {
+    assertOldest(pos, 9 + pos, 1 + (9 + pos) % BACKLOG_MAX_SAMPLE, 1);
+  }
+  backlogMarkSent(12);
+  TEST_ASSERT_TRUE(backlogInit(3));
+  TEST_ASSERT_EQUAL(0, backlogCount());
+}
+
+// Past the last row the ring starts over, giving up the oldest row each time
+#define WRAP_APPENDS 1000
+#define WRAP_LEN 20
+
+void test_ring_wrap(void) {
+  for (uint16_t id=1; id<=WRAP_APPENDS; ++id) {
+    append(id, WRAP_LEN);
+  }
+  uint16_t count = backlogCount();
+  uint16_t perRow = (FLASH_ROW_SIZE - ROW_HEADER_SIZE) / recordSize(WRAP_LEN);
+  TEST_ASSERT_GREATER_OR_EQUAL((FLASH_ROWS - 1) * perRow, count);
+  TEST_ASSERT_EQUAL(WRAP_APPENDS, count + backlogDropped());
+  assertOldest(0, WRAP_APPENDS - count + 1, WRAP_LEN, 1);
+  assertOldest(count - 1, WRAP_APPENDS, WRAP_LEN, 1);
+
+  TEST_ASSERT_TRUE(backlogInit(2));
+  TEST_ASSERT_EQUAL(count, backlogCount());
+  assertOldest(0, WRAP_APPENDS - count + 1, WRAP_LEN, 1);
+
+  backlogMarkSent(count - 1);
+  append(WRAP_APPENDS + 1, WRAP_LEN);
+  TEST_ASSERT_TRUE(backlogInit(3));
+  TEST_ASSERT_EQUAL(2, backlogCount());
+  assertOldest(0, WRAP_APPENDS, WRAP_LEN, 1);
+  assertOldest(1, WRAP_APPENDS + 1, WRAP_LEN, 2);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_torn_append_skipped);
+  RUN_TEST(test_damaged_header_closes_row);
+  RUN_TEST(test_rescan_after_reboot);
+  RUN_TEST(test_ring_wrap);
+  return UNITY_END();
+}
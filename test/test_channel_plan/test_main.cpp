@@ -0,0 +1,121 @@
+/*
+ Channel plans (ChannelPlan.h) on the simulated node, with a channel mask
+ set by the network. Run with: pio test -e native
+*/
+#include <unity.h>
+#include "Sim.h"
+#include "lmic.h"
+
+#define SAMPLE_LEN 6
+#define SF_UUID 0x2AD5
+#define CHANNEL_PLAN_UUID 0x2AE7
+
+#if defined(CFG_eu868)
+// TTN plan, FSK channel included. The network keeps the three LoRaWAN default channels.
+#define PLAN_FIRST 0
+#define PLAN_LAST 8
+#define NETWORK_FIRST 0
+#define NETWORK_LAST 2
+#define SAMPLE_SPACING_MS 6000 // SF7 duty cycle wait
+#else
+// TTN sub-band 2. The network keeps its upper half.
+#define PLAN_FIRST 8
+#define PLAN_LAST 15
+#define NETWORK_FIRST 12
+#define NETWORK_LAST 15
+#define SAMPLE_SPACING_MS 3000
+#endif
+
+void setUp(void) {
+  simReset(5);
+  for (uint8_t sf=0; sf<13; ++sf) {
+    simConfig->deliverPermille[sf] = 1000;
+  }
+}
+
+void tearDown(void) {
+}
+
+static void provisionAbp() {
+  simProvisionAbp();
+  simRun(1000);
+}
+
+static void sendSamples(uint8_t count) {
+  const uint8_t sf = 7; // The SF setting does not outlive a boot
+  simPhoneWrite(SF_UUID, &sf, sizeof(sf));
+  for (uint8_t i=0; i<count; ++i) {
+    simSendSample(simReport->samplesWritten + 1, SAMPLE_LEN);
+    simRun(SAMPLE_SPACING_MS);
+  }
+}
+
+// As a LinkADRReq ChMask the node has acknowledged
+static void networkSetsMask() {
+  sendSamples(2);
+  for (uint8_t ch=PLAN_FIRST; ch<=PLAN_LAST; ++ch) {
+    if (ch<NETWORK_FIRST || ch>NETWORK_LAST) {
+      #if defined(CFG_eu868)
+      LMIC.channelMap &= ~(1 << ch);
+      #else
+      LMIC.channelMap[ch >> 4] &= ~(1 << (ch & 15));
+      #endif
+    }
+  }
+  for (uint8_t ch=0; ch<SIM_MAX_CHANNELS; ++ch) {
+    simReport->uplinksPerChannel[ch] = 0;
+  }
+  sendSamples(30);
+}
+
+static void sendAfterReboot() {
+  for (uint8_t ch=0; ch<SIM_MAX_CHANNELS; ++ch) {
+    simReport->uplinksPerChannel[ch] = 0;
+  }
+  sendSamples(30);
+}
+
+static void assertNetworkChannelsOnly() {
+  uint32_t onNetwork = 0;
+  for (uint8_t ch=0; ch<SIM_MAX_CHANNELS; ++ch) {
+    if (ch>=NETWORK_FIRST && ch<=NETWORK_LAST) {
+      onNetwork += simReport->uplinksPerChannel[ch];
+    }
+    else {
+      TEST_ASSERT_EQUAL(0, simReport->uplinksPerChannel[ch]);
+    }
+  }
+  TEST_ASSERT_EQUAL(30, onNetwork);
+}
+
+// Steering picks among the channels the network allows, and the saved MAC state keeps its mask
+void test_network_mask_kept(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  TEST_ASSERT_TRUE(simBoot(networkSetsMask));
+  assertNetworkChannelsOnly();
+  TEST_ASSERT_TRUE(simBoot(sendAfterReboot));
+  assertNetworkChannelsOnly();
+}
+
+// Selecting a plan enables all of its channels again
+static void selectPlanAgain() {
+  const uint8_t plan = 0;
+  simPhoneWrite(CHANNEL_PLAN_UUID, &plan, sizeof(plan));
+  sendAfterReboot();
+}
+
+void test_plan_select_restores_plan(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  TEST_ASSERT_TRUE(simBoot(networkSetsMask));
+  TEST_ASSERT_TRUE(simBoot(selectPlanAgain));
+  for (uint8_t ch=PLAN_FIRST; ch<=PLAN_LAST; ++ch) {
+    TEST_ASSERT_GREATER_THAN(0, simReport->uplinksPerChannel[ch]);
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_network_mask_kept);
+  RUN_TEST(test_plan_select_restores_plan);
+  return UNITY_END();
+}
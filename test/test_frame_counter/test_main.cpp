@@ -0,0 +1,191 @@
+/*
+ Frame counter checkpoints (FCNT_CHECKPOINT_INTERVAL in the sketch) across
+ power loss. Run with: pio test -e native
+
+ The simulated network flags any uplink whose counter does not exceed every
+ counter sent before it in the session.
+*/
+#include <unity.h>
+#include <string.h>
+#include "Sim.h"
+
+#define SAMPLE_LEN 6
+
+void setUp(void) {
+  simReset(7);
+  for (uint8_t sf=0; sf<13; ++sf) {
+    simConfig->deliverPermille[sf] = 1000;
+  }
+}
+
+void tearDown(void) {
+}
+
+// SF7 with samples further apart than the EU duty cycle wait, so every sample is one uplink
+#define SAMPLE_SPACING_MS 6000
+
+static void provisionAbp() {
+  simProvisionAbp();
+  simRun(1000);
+}
+
+// The SF setting does not outlive a boot
+static void useSf7() {
+  const uint8_t sf = 7;
+  simPhoneWrite(0x2AD5, &sf, sizeof(sf));
+}
+
+// A different number of uplinks each boot, so power fails all over the checkpoint interval
+static void sendThenLosePower() {
+  useSf7();
+  uint16_t count = 1 + simRandom(40);
+  for (uint16_t i=0; i<count; ++i) {
+    simSendSample(simReport->samplesWritten + 1, SAMPLE_LEN);
+    simRun(SAMPLE_SPACING_MS + simRandom(2000));
+  }
+  // Power fails at a random point of the next uplink
+  simSendSample(simReport->samplesWritten + 1, SAMPLE_LEN);
+  simRun(simRandom(SAMPLE_SPACING_MS));
+}
+
+void test_counters_monotonic_across_power_loss(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  for (uint8_t i=0; i<40; ++i) {
+    TEST_ASSERT_TRUE(simBoot(sendThenLosePower));
+  }
+  TEST_ASSERT_GREATER_THAN(400, simReport->uplinks);
+  TEST_ASSERT_EQUAL(0, simReport->fcntRepeats);
+}
+
+// Power fails in place of an NVM write: the checkpoint itself is lost or torn
+static void sendUntilNvmPowerLoss() {
+  useSf7();
+  simConfig->nvmWritesToPowerLoss = 1 + simRandom(6);
+  for (uint16_t i=0; i<100; ++i) {
+    simSendSample(simReport->samplesWritten + 1, SAMPLE_LEN);
+    simRun(SAMPLE_SPACING_MS);
+  }
+}
+
+void test_counters_monotonic_when_checkpoint_write_fails(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  for (uint8_t i=0; i<40; ++i) {
+    TEST_ASSERT_TRUE(simBoot(sendUntilNvmPowerLoss));
+  }
+  simConfig->nvmWritesToPowerLoss = 0;
+  TEST_ASSERT_TRUE(simBoot(sendThenLosePower));
+  TEST_ASSERT_GREATER_THAN(40, simReport->uplinks);
+  TEST_ASSERT_EQUAL(0, simReport->fcntRepeats);
+}
+
+// Settings records follow the NVM magic number and the store format (SettingsStore.h)
+#define SETTINGS_RECORDS_OFFSET 8
+#define SETTINGS_END 256
+#define RECORD_seq_no 1
+
+static uint8_t crc8(uint8_t const *data, uint16_t len) {
+  uint8_t crc = 0;
+  while (len--) {
+    crc ^= *data++;
+    for (uint8_t i=0; i<8; ++i) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+static void sendForty() {
+  useSf7();
+  for (uint16_t i=0; i<40; ++i) {
+    simSendSample(simReport->samplesWritten + 1, SAMPLE_LEN);
+    simRun(SAMPLE_SPACING_MS);
+  }
+}
+
+// A compaction goes out in several NVM writes. Power loss between them leaves
+// the new records followed by the old log, whose older seq_no records then come
+// last. Set that up by appending the oldest seq_no record to the log again.
+void test_counters_monotonic_when_compaction_torn(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  TEST_ASSERT_TRUE(simBoot(sendForty));
+
+  uint8_t *nvm = simNvm();
+  uint16_t pos = SETTINGS_RECORDS_OFFSET;
+  int oldest = -1;
+  while (pos<SETTINGS_END && nvm[pos]!=0x00 && nvm[pos]!=0xFF) {
+    if (nvm[pos]==RECORD_seq_no && oldest<0) {
+      oldest = pos;
+    }
+    pos += nvm[pos + 1] + 3;
+  }
+  TEST_ASSERT_TRUE(oldest>=0);
+  TEST_ASSERT_TRUE(pos + 7<=SETTINGS_END);
+  memcpy(&nvm[pos], &nvm[oldest], 6);
+  nvm[pos + 6] = crc8(&nvm[pos], 6);
+
+  TEST_ASSERT_TRUE(simBoot(sendThenLosePower));
+  TEST_ASSERT_EQUAL(0, simReport->fcntRepeats);
+}
+
+// Fewer NVM writes than uplinks: checkpoints take the write off most TX completions.
+// 64 uplinks stay inside the daily airtime budget.
+#define SPARE_UPLINKS 64
+
+static void sendMany() {
+  useSf7();
+  for (uint16_t i=0; i<SPARE_UPLINKS; ++i) {
+    simSendSample(simReport->samplesWritten + 1, SAMPLE_LEN);
+    simRun(SAMPLE_SPACING_MS);
+  }
+  simRun(10000);
+}
+
+void test_checkpoints_spare_nvm_writes(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  uint32_t setupWrites = simReport->nvmWrites;
+  TEST_ASSERT_TRUE(simBoot(sendMany));
+  TEST_ASSERT_EQUAL(SPARE_UPLINKS, simReport->uplinks);
+  TEST_ASSERT_LESS_THAN(SPARE_UPLINKS / 4, simReport->nvmWrites - setupWrites);
+  TEST_ASSERT_EQUAL(0, simReport->fcntRepeats);
+}
+
+// A join starts the session's counters over, and a reboot keeps them there
+// although records of the old session's reservation are still in the log.
+// The reboot resumes at the block reserved with the join.
+#define FCNT_CHECKPOINT_INTERVAL 16 // As in the sketch
+
+static void joinNow() {
+  simProvisionOtaa();
+  simRun(60000);
+}
+
+static void sendOne() {
+  useSf7();
+  simSendSample(simReport->samplesWritten + 1, SAMPLE_LEN);
+  simRun(SAMPLE_SPACING_MS);
+}
+
+void test_counters_restart_after_join(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  for (uint8_t i=0; i<3; ++i) {
+    TEST_ASSERT_TRUE(simBoot(sendForty));
+  }
+  TEST_ASSERT_GREATER_THAN(100, simReport->fcntMax);
+  simConfig->joinAcceptPermille = 1000;
+  TEST_ASSERT_TRUE(simBoot(joinNow));
+  TEST_ASSERT_EQUAL(1, simReport->joins);
+  TEST_ASSERT_TRUE(simBoot(sendOne));
+  TEST_ASSERT_TRUE(simReport->fcntSeen);
+  TEST_ASSERT_LESS_OR_EQUAL(FCNT_CHECKPOINT_INTERVAL, simReport->fcntMax);
+  TEST_ASSERT_EQUAL(0, simReport->fcntRepeats);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_counters_monotonic_across_power_loss);
+  RUN_TEST(test_counters_monotonic_when_checkpoint_write_fails);
+  RUN_TEST(test_counters_monotonic_when_compaction_torn);
+  RUN_TEST(test_checkpoints_spare_nvm_writes);
+  RUN_TEST(test_counters_restart_after_join);
+  return UNITY_END();
+}
@@ -0,0 +1,159 @@
+/*
+ LocationCodec round trip: frames decoded the way tools/locationcodec.py
+ does give back every fix to within the 1e-5 degree rounding.
+ Run with: pio test -e native
+*/
+#include <unity.h>
+#include <stdlib.h>
+#include <string.h>
+#include "LocationCodec.h"
+
+#define ROUNDING 50 // Largest rounding error in 1e-7 degrees
+
+typedef struct {
+  bool have;
+  int32_t lat, lon, alt; // Frame units
+} Key;
+
+static Key keys[32];
+
+static int32_t readBits(const uint8_t frame[], uint8_t *pos, uint8_t bits, bool isSigned) {
+  uint32_t v = 0;
+  for (uint8_t i=0; i<bits; ++i, ++*pos) {
+    v = (v << 1) | ((frame[*pos / 8] >> (7 - *pos % 8)) & 1);
+  }
+  if (isSigned && (v & (1UL << (bits - 1)))) {
+    return (int32_t)v - (int32_t)(1UL << bits);
+  }
+  return v;
+}
+
+// Returns false if a delta frame names a key frame not seen
+static bool decode(const uint8_t frame[], uint8_t len, LocationFix *fix) {
+  uint8_t pos = 0;
+  bool delta = readBits(frame, &pos, 1, false);
+  TEST_ASSERT_EQUAL(LOCATION_FORMAT_V1, readBits(frame, &pos, 2, false));
+  uint8_t keyId = readBits(frame, &pos, 5, false);
+  Key *k = &keys[keyId];
+  int32_t lat, lon, alt;
+  if (delta) {
+    TEST_ASSERT_EQUAL(5, len);
+    if (!k->have) {
+      return false;
+    }
+    lat = k->lat + readBits(frame, &pos, 12, true);
+    lon = k->lon + readBits(frame, &pos, 12, true);
+    alt = k->alt + readBits(frame, &pos, 6, true);
+  }
+  else {
+    TEST_ASSERT_EQUAL(LOCATION_MAX_FRAME, len);
+    lat = readBits(frame, &pos, 25, false);
+    lon = readBits(frame, &pos, 26, false);
+    alt = readBits(frame, &pos, 14, false);
+    k->have = true;
+    k->lat = lat;
+    k->lon = lon;
+    k->alt = alt;
+  }
+  fix->lat = (lat - 9000000) * 100;
+  fix->lon = (lon - 18000000) * 100;
+  fix->alt = alt - LOCATION_ALT_OFFSET;
+  return true;
+}
+
+static void assertRoundTrip(const LocationFix *fix, uint8_t *keyFrames) {
+  uint8_t frame[LOCATION_MAX_FRAME];
+  uint8_t len = locationEncode(fix, frame);
+  if (locationIsKey(frame)) {
+    ++*keyFrames;
+  }
+  LocationFix out;
+  TEST_ASSERT_TRUE(decode(frame, len, &out));
+  TEST_ASSERT_INT32_WITHIN(ROUNDING, fix->lat, out.lat);
+  TEST_ASSERT_INT32_WITHIN(ROUNDING, fix->lon, out.lon);
+  TEST_ASSERT_EQUAL(fix->alt, out.alt);
+}
+
+void setUp(void) {
+  locationReset();
+  memset(keys, 0, sizeof(keys));
+  srand(3);
+}
+
+void tearDown(void) {
+}
+
+// A walk of a few metres per fix: mostly delta frames, a key frame every LOCATION_KEY_INTERVAL
+void test_walk_round_trip(void) {
+  LocationFix fix = { 407128000, -740060000, 10 };
+  uint8_t keyFrames = 0;
+  for (int i=0; i<800; ++i) {
+    fix.lat += rand() % 2001 - 1000;
+    fix.lon += rand() % 2001 - 1000;
+    fix.alt += rand() % 3 - 1;
+    assertRoundTrip(&fix, &keyFrames);
+  }
+  TEST_ASSERT_EQUAL(800 / LOCATION_KEY_INTERVAL, keyFrames);
+}
+
+// Jumps too large for a delta, the extremes of the ranges and key ids past 32
+void test_jumps_round_trip(void) {
+  uint8_t keyFrames = 0;
+  for (int i=0; i<100; ++i) {
+    LocationFix fix;
+    fix.lat = (int32_t)(rand() % 1800001 - 900000) * 1000;
+    fix.lon = (int32_t)(rand() % 3600001 - 1800000) * 1000;
+    fix.alt = rand() % 9000 - 500;
+    assertRoundTrip(&fix, &keyFrames);
+  }
+  const LocationFix extremes[] = {
+    { 900000000, 1800000000, 15000 },
+    { -900000000, -1800000000, -1000 },
+    { 0, 0, 0 },
+  };
+  for (uint8_t i=0; i<sizeof(extremes)/sizeof(extremes[0]); ++i) {
+    assertRoundTrip(&extremes[i], &keyFrames);
+  }
+  TEST_ASSERT_EQUAL(103, keyFrames);
+}
+
+// Out of range altitudes are clamped rather than wrapped
+void test_altitude_clamped(void) {
+  LocationFix fix = { 0, 0, -2000 };
+  uint8_t frame[LOCATION_MAX_FRAME];
+  LocationFix out;
+  TEST_ASSERT_TRUE(decode(frame, locationEncode(&fix, frame), &out));
+  TEST_ASSERT_EQUAL(-LOCATION_ALT_OFFSET, out.alt);
+  locationReset();
+  fix.alt = 20000;
+  TEST_ASSERT_TRUE(decode(frame, locationEncode(&fix, frame), &out));
+  TEST_ASSERT_EQUAL((1 << 14) - 1 - LOCATION_ALT_OFFSET, out.alt);
+}
+
+// After a lost key frame, locationReset() makes the next fix decodable on its own
+void test_reset_after_lost_key(void) {
+  LocationFix fix = { 515000000, -1200000, 30 };
+  uint8_t frame[LOCATION_MAX_FRAME];
+  LocationFix out;
+  locationEncode(&fix, frame); // Key frame, lost
+  fix.lat += 500;
+  uint8_t len = locationEncode(&fix, frame);
+  TEST_ASSERT_FALSE(locationIsKey(frame));
+  TEST_ASSERT_FALSE(decode(frame, len, &out)); // Orphaned delta
+
+  locationReset();
+  fix.lat += 500;
+  len = locationEncode(&fix, frame);
+  TEST_ASSERT_TRUE(locationIsKey(frame));
+  TEST_ASSERT_TRUE(decode(frame, len, &out));
+  TEST_ASSERT_INT32_WITHIN(ROUNDING, fix.lat, out.lat);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_walk_round_trip);
+  RUN_TEST(test_jumps_round_trip);
+  RUN_TEST(test_altitude_clamped);
+  RUN_TEST(test_reset_after_lost_key);
+  return UNITY_END();
+}
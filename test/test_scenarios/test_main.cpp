@@ -0,0 +1,298 @@
+/*
+ Whole-node scenarios on the simulator (sim/Sim.h). Run with: pio test -e native
+
+ Each scenario prints a line of results, so the suite doubles as the
+ regression benchmark for throughput and latency work:
+   delivered/written samples, TX results by error, uplinks, latency and
+   simulated hours per wall clock second.
+*/
+#include <unity.h>
+#include <string.h>
+#include <sys/time.h>
+#include "Sim.h"
+
+#define SAMPLE_LEN 6 // Fits US915 SF10 alone, and aggregates
+
+static double started;
+
+static double wallSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void setUp(void) {
+  simReset(1);
+  started = wallSeconds();
+}
+
+void tearDown(void) {
+}
+
+static void report(const char *name) {
+  double wallS = wallSeconds() - started;
+  double simH = simReport->elapsedUs / 3600e6;
+  printf("%s: delivered %u/%u, results ok %u timeout %u not acked %u stored %u, uplinks %u, "
+    "joins %u/%u, fcnt repeats %u, latency avg %u max %u ms, awake %u permille, %.0f sim h/s\n",
+    name, simReport->samplesDelivered, simReport->samplesWritten,
+    simReport->txResults[0], simReport->txResults[1], simReport->txResults[2], simReport->txResults[3],
+    simReport->uplinks, simReport->joins, simReport->joinRequests, simReport->fcntRepeats,
+    (unsigned)(simReport->samplesDelivered ? simReport->latencyTotalMs / simReport->samplesDelivered : 0),
+    simReport->latencyMaxMs,
+    (unsigned)(simReport->elapsedUs ? simReport->awakeUs * 1000 / simReport->elapsedUs : 0),
+    wallS>0 ? simH / wallS : 0);
+}
+
+static void provisionAbp() {
+  simProvisionAbp();
+  simRun(1000);
+}
+
+static void provisionOtaa() {
+  simProvisionOtaa();
+  simRun(1000);
+}
+
+// One sample every intervalMs, then time to drain. Ids go on across boots.
+static void sendBurst(uint16_t count, uint32_t intervalMs, uint32_t drainMs = 60000) {
+  for (uint16_t i=0; i<count; ++i) {
+    simSendSample(simReport->samplesWritten + 1, SAMPLE_LEN);
+    simRun(intervalMs);
+  }
+  simRun(drainMs);
+}
+
+static void abpBurst() {
+  sendBurst(60, 5000);
+}
+
+void test_abp_burst_on_clean_link(void) {
+  for (uint8_t sf=0; sf<13; ++sf) {
+    simConfig->deliverPermille[sf] = 1000;
+  }
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  TEST_ASSERT_TRUE(simBoot(abpBurst));
+  report("abp clean");
+  TEST_ASSERT_EQUAL(60, simReport->samplesWritten);
+  TEST_ASSERT_EQUAL(60, simReport->samplesDelivered);
+  TEST_ASSERT_EQUAL(0, simReport->oversizeFrames);
+  TEST_ASSERT_EQUAL(0, simReport->fcntRepeats);
+  TEST_ASSERT_EQUAL(60, simReport->txResults[0]);
+}
+
+// Faster than one uplink per sample. At SF7 several samples share a frame.
+static void fastBurst() {
+  const uint8_t sf = 7;
+  simPhoneWrite(0x2AD5, &sf, sizeof(sf));
+  sendBurst(60, 200, 600000);
+}
+
+void test_fast_burst_aggregates(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  TEST_ASSERT_TRUE(simBoot(fastBurst));
+  report("abp fast burst");
+  TEST_ASSERT_LESS_THAN(60, simReport->uplinks);
+  // Every sample gets a result, whether it went out, timed out or was stored
+  TEST_ASSERT_EQUAL(60, simReport->txResults[0] + simReport->txResults[1] + simReport->txResults[3]);
+  TEST_ASSERT_EQUAL(0, simReport->fcntRepeats);
+}
+
+void test_lossy_link(void) {
+  for (uint8_t sf=0; sf<13; ++sf) {
+    simConfig->deliverPermille[sf] = 500;
+  }
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  TEST_ASSERT_TRUE(simBoot(abpBurst));
+  report("abp lossy");
+  TEST_ASSERT_GREATER_THAN(10, simReport->samplesDelivered);
+  TEST_ASSERT_LESS_THAN(60, simReport->samplesDelivered);
+}
+
+static void otaaJoinAndSend() {
+  simProvisionOtaa();
+  simRun(3600000);
+  sendBurst(20, 5000);
+}
+
+void test_otaa_join_then_send(void) {
+  simConfig->joinAcceptPermille = 300;
+  TEST_ASSERT_TRUE(simBoot(otaaJoinAndSend));
+  report("otaa");
+  TEST_ASSERT_EQUAL(1, simReport->joins);
+  TEST_ASSERT_GREATER_THAN(10, simReport->samplesDelivered);
+}
+
+static void joinBriefly() {
+  simRun(20000);
+}
+
+// A node that keeps rebooting mid-join resumes its back-off rather than
+// starting each boot with a round of join requests. Join airtime stays
+// within the 1% duty cycle of the first hour.
+void test_join_reboot_loop_keeps_duty_cycle(void) {
+  simConfig->joinAcceptPermille = 0;
+  TEST_ASSERT_TRUE(simBoot(provisionOtaa));
+  for (uint8_t i=0; i<90; ++i) {
+    TEST_ASSERT_TRUE(simBoot(joinBriefly));
+  }
+  report("join reboot loop");
+  TEST_ASSERT_GREATER_THAN(20, simReport->joinRequests);
+  TEST_ASSERT_LESS_OR_EQUAL(simReport->elapsedUs / 100, simReport->joinAirtimeUs);
+}
+
+static void sendFew() {
+  sendBurst(5, 3000);
+}
+
+void test_reboots_keep_counters_and_keys(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  for (uint8_t i=0; i<10; ++i) {
+    TEST_ASSERT_TRUE(simBoot(sendFew));
+  }
+  report("abp reboots");
+  TEST_ASSERT_EQUAL(11, simReport->boots);
+  TEST_ASSERT_EQUAL(0, simReport->fcntRepeats);
+  TEST_ASSERT_GREATER_THAN(30, simReport->samplesDelivered);
+}
+
+static void idleDay() {
+  simRun(24 * 3600000UL);
+}
+
+void test_idle_day(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  TEST_ASSERT_TRUE(simBoot(idleDay));
+  report("idle day");
+  TEST_ASSERT_EQUAL(0, simReport->uplinks);
+}
+
+// Confirmed packets written before the session wait in the queue rather than
+// the backlog, which would send them unconfirmed
+static void confirmedBeforeSession() {
+  for (uint8_t i=1; i<=3; ++i) {
+    const uint8_t packet[] = { i, i, 0, 0xA2, 0xA3, 0xA4, 0xA5 }; // BLE seq, then a sample with id i
+    simPhoneWrite(0x2AE6, packet, sizeof(packet));
+    simRun(1000);
+  }
+  simProvisionAbp();
+  simRun(120000);
+}
+
+void test_confirmed_not_stored(void) {
+  for (uint8_t sf=0; sf<13; ++sf) {
+    simConfig->deliverPermille[sf] = 1000;
+  }
+  simConfig->ackPermille = 1000;
+  TEST_ASSERT_TRUE(simBoot(confirmedBeforeSession));
+  report("confirmed before session");
+  TEST_ASSERT_EQUAL(0, simReport->txResults[3]); // TX_ERROR_STORED
+  TEST_ASSERT_EQUAL(3, simReport->txResults[0]);
+}
+
+// Fixes written before the session wait in the queue and go out on the location
+// port, apart from the samples stored in the backlog next to them
+static void locationBeforeSession() {
+  for (uint8_t i=1; i<=3; ++i) {
+    const uint8_t fix[11] = { (uint8_t)(100 + i), 0x80, 0x3A, 0x4C, 0x18, 0x00, 0xC6, 0xE7, 0xD3, 0x0A, 0x00 };
+    simPhoneWrite(0x2AE0, fix, sizeof(fix));
+    simSendSample(simReport->samplesWritten + 1, SAMPLE_LEN);
+    simRun(1000);
+  }
+  simProvisionAbp();
+  simRun(120000);
+}
+
+void test_location_frames_on_own_port(void) {
+  for (uint8_t sf=0; sf<13; ++sf) {
+    simConfig->deliverPermille[sf] = 1000;
+  }
+  TEST_ASSERT_TRUE(simBoot(locationBeforeSession));
+  report("location before session");
+  TEST_ASSERT_EQUAL(3, simReport->txResults[3]); // TX_ERROR_STORED, the samples only
+  TEST_ASSERT_EQUAL(3, simReport->locationFrames);
+  TEST_ASSERT_EQUAL(3, simReport->samplesDelivered);
+}
+
+#if defined(CFG_us915)
+// A 30 byte payload in two fragments: over the US915 SF10 maximum of 11 bytes, within SF7's.
+// In EU868 every data rate takes the largest payload LMIC reassembles.
+static void sendFragments(uint8_t sf, uint8_t bleSeq) {
+  const uint8_t lens[] = { 18, 12 };
+  simPhoneWrite(0x2AD5, &sf, sizeof(sf));
+  for (uint8_t i=0; i<sizeof(lens); ++i) {
+    uint8_t fragment[20] = { bleSeq, (uint8_t)(i | (i==sizeof(lens) - 1 ? 0x80 : 0)) };
+    memset(&fragment[2], 0xF0 + i, lens[i]);
+    simPhoneWrite(0x2AE2, fragment, 2 + lens[i]);
+  }
+  simRun(60000);
+}
+
+static void sendFragmentsSf10() {
+  sendFragments(10, 1);
+}
+
+static void sendFragmentsSf7() {
+  sendFragments(7, 2);
+}
+
+void test_fragments_over_data_rate_rejected(void) {
+  uint8_t status[20];
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  TEST_ASSERT_TRUE(simBoot(sendFragmentsSf10));
+  TEST_ASSERT_EQUAL(3, simCharValue(0x2AE2, status));
+  TEST_ASSERT_EQUAL(1, status[0]);
+  TEST_ASSERT_EQUAL(5, status[1]); // FragmentOverRate
+  TEST_ASSERT_EQUAL(0, simReport->uplinks);
+
+  TEST_ASSERT_TRUE(simBoot(sendFragmentsSf7));
+  TEST_ASSERT_EQUAL(3, simCharValue(0x2AE2, status));
+  TEST_ASSERT_EQUAL(2, status[0]);
+  TEST_ASSERT_EQUAL(1, status[1]); // FragmentComplete
+  TEST_ASSERT_EQUAL(30, status[2]);
+  TEST_ASSERT_EQUAL(1, simReport->framesHeard);
+  TEST_ASSERT_EQUAL(0, simReport->oversizeFrames);
+}
+
+// Stored before the session, 15 byte samples make backlog entries over the SF10 maximum.
+// With SF10 set they go out at SF9 instead.
+static void storeLongSamples() {
+  for (uint8_t i=0; i<5; ++i) {
+    simSendSample(simReport->samplesWritten + 1, 15);
+    simRun(1000);
+  }
+  simProvisionAbp();
+  const uint8_t sf = 10;
+  simPhoneWrite(0x2AD5, &sf, sizeof(sf));
+  simRun(120000);
+}
+
+void test_backlog_long_samples_sent_faster(void) {
+  for (uint8_t sf=0; sf<13; ++sf) {
+    simConfig->deliverPermille[sf] = 1000;
+  }
+  TEST_ASSERT_TRUE(simBoot(storeLongSamples));
+  report("backlog long samples");
+  TEST_ASSERT_EQUAL(5, simReport->txResults[3]); // TX_ERROR_STORED
+  TEST_ASSERT_EQUAL(5, simReport->samplesDelivered);
+  TEST_ASSERT_EQUAL(0, simReport->uplinksPerSf[10]);
+  TEST_ASSERT_EQUAL(0, simReport->oversizeFrames);
+}
+#endif
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_abp_burst_on_clean_link);
+  RUN_TEST(test_fast_burst_aggregates);
+  RUN_TEST(test_lossy_link);
+  RUN_TEST(test_otaa_join_then_send);
+  RUN_TEST(test_join_reboot_loop_keeps_duty_cycle);
+  RUN_TEST(test_reboots_keep_counters_and_keys);
+  RUN_TEST(test_idle_day);
+  RUN_TEST(test_confirmed_not_stored);
+  RUN_TEST(test_location_frames_on_own_port);
+  #if defined(CFG_us915)
+  RUN_TEST(test_fragments_over_data_rate_rejected);
+  RUN_TEST(test_backlog_long_samples_sent_faster);
+  #endif
+  return UNITY_END();
+}
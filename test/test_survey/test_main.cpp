@@ -0,0 +1,187 @@
+/*
+ Survey mode (Survey.h) on the simulated node. Run with: pio test -e native
+*/
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include "Sim.h"
+#include "Idle.h"
+
+#define SF_UUID 0x2AD5
+#define SURVEY_CONFIG_UUID 0x2ADF
+#define CONFIRMED_PACKET_UUID 0x2AE6
+#define SURVEY_CONFIG_HEADER 5
+
+void setUp(void) {
+  simReset(11);
+  for (uint8_t sf=0; sf<13; ++sf) {
+    simConfig->deliverPermille[sf] = 1000;
+  }
+}
+
+void tearDown(void) {
+}
+
+static void provisionAbp() {
+  simProvisionAbp();
+  simRun(1000);
+}
+
+static void setSf(uint8_t sf) {
+  simPhoneWrite(SF_UUID, &sf, sizeof(sf));
+}
+
+// Pings every intervalS seconds, rotating through sfMask (bit 0 = SF7). flags 0 stops.
+static void configureSurvey(uint8_t flags, uint16_t intervalS, uint8_t sfMask) {
+  const uint8_t config[] = { 0x01, flags, (uint8_t)(intervalS & 0xFF), (uint8_t)(intervalS >> 8), sfMask, 'S', 'V' };
+  simPhoneWrite(SURVEY_CONFIG_UUID, config, sizeof(config));
+}
+
+// Writing session keys resets LMIC, which empties its job queue
+static void surveyThroughKeyWrite() {
+  setSf(7);
+  configureSurvey(0x03, 10, 0);
+  simRun(60000);
+  simReport->values[0] = simReport->uplinks;
+  simProvisionAbp();
+  simRun(120000);
+  simReport->values[1] = simReport->uplinks;
+}
+
+void test_survey_survives_key_write(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  TEST_ASSERT_TRUE(simBoot(surveyThroughKeyWrite));
+  TEST_ASSERT_GREATER_OR_EQUAL(5, simReport->values[0]);
+  TEST_ASSERT_GREATER_OR_EQUAL(10, simReport->values[1] - simReport->values[0]);
+}
+
+// Pings rotate SF7 and SF9. Samples before and after go out at the SF set by the phone.
+static void surveyThenSamples() {
+  setSf(8);
+  configureSurvey(0x03, 30, 0x05);
+  simRun(300000);
+  configureSurvey(0x00, 30, 0x05);
+  simRun(30000);
+  for (uint8_t sf=7; sf<=9; ++sf) {
+    simReport->values[sf - 7] = simReport->uplinksPerSf[sf];
+  }
+  for (uint8_t i=0; i<3; ++i) {
+    simSendSample(simReport->samplesWritten + 1, 6);
+    simRun(30000);
+  }
+}
+
+void test_survey_keeps_sf_setting(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  TEST_ASSERT_TRUE(simBoot(surveyThenSamples));
+  TEST_ASSERT_GREATER_OR_EQUAL(4, simReport->values[0]); // SF7 pings
+  TEST_ASSERT_GREATER_OR_EQUAL(4, simReport->values[2]); // SF9 pings
+  TEST_ASSERT_EQUAL(simReport->values[0], simReport->uplinksPerSf[7]);
+  TEST_ASSERT_EQUAL(simReport->values[2], simReport->uplinksPerSf[9]);
+  TEST_ASSERT_EQUAL(simReport->values[1] + 3, simReport->uplinksPerSf[8]);
+  TEST_ASSERT_EQUAL(3, simReport->samplesDelivered);
+}
+
+// The MAC state snapshot is saved outside checkpoints only for settings the network
+// changes. Automatic SF on a patchy SF7 link moves the data rate every few uplinks.
+#define PATCHY_FRAMES 64
+#define FCNT_CHECKPOINT_INTERVAL 16 // As in the sketch
+
+static void autoSfOnPatchyLink() {
+  setSf(0);
+  for (uint8_t i=0; i<PATCHY_FRAMES; ++i) {
+    const uint8_t packet[] = { i, 0xA0, 0xA1, 0xA2, 0xA3 }; // BLE seq, then payload
+    simPhoneWrite(CONFIRMED_PACKET_UUID, packet, sizeof(packet));
+    simRun(6000);
+  }
+}
+
+void test_auto_sf_spares_nvm_writes(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  uint32_t setupWrites = simReport->nvmWrites;
+  simConfig->deliverPermille[7] = 300;
+  simConfig->deliverPermille[8] = 700;
+  TEST_ASSERT_TRUE(simBoot(autoSfOnPatchyLink));
+  TEST_ASSERT_GREATER_THAN(4, simReport->uplinksPerSf[8]);
+  // No more than one write per checkpoint interval
+  TEST_ASSERT_LESS_OR_EQUAL(PATCHY_FRAMES / FCNT_CHECKPOINT_INTERVAL, simReport->nvmWrites - setupWrites);
+}
+
+// An hour of pings every 30 s at SF7. The node's own awake share (Idle.h) is
+// checked against the simulator's accounting. Time awake comes from the
+// simulator's cost model (SIM_*_US in Sim.h), not from hardware.
+static void surveyHour() {
+  setSf(7);
+  configureSurvey(0x03, 30, 0);
+  simRun(3600000);
+  simReport->values[0] = idleActivePermille();
+}
+
+void test_survey_hour_active_time(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  uint64_t elapsedUs = simReport->elapsedUs;
+  uint64_t awakeUs = simReport->awakeUs;
+  TEST_ASSERT_TRUE(simBoot(surveyHour));
+  uint32_t simPermille = (simReport->awakeUs - awakeUs) * 1000 / (simReport->elapsedUs - elapsedUs);
+  printf("survey hour: %u pings, awake %u permille (node), %u permille (simulator)\n",
+    simReport->uplinks, simReport->values[0], simPermille);
+  TEST_ASSERT_GREATER_OR_EQUAL(110, simReport->uplinks);
+  TEST_ASSERT_INT_WITHIN(5, simPermille, simReport->values[0]);
+  TEST_ASSERT_LESS_THAN(100, simReport->values[0]);
+}
+
+#if defined(CFG_us915)
+// A 15 byte template and the counter make 17 byte pings, over the 11 bytes US915 SF10 carries
+static void configureLongSurvey(uint8_t sfMask) {
+  uint8_t config[SURVEY_CONFIG_HEADER + 15] = { 0x01, 0x03, 10, 0, sfMask };
+  memset(&config[SURVEY_CONFIG_HEADER], 'L', 15);
+  simPhoneWrite(SURVEY_CONFIG_UUID, config, sizeof(config));
+}
+
+static void longSurveyOverSf10() {
+  configureLongSurvey(0x08); // SF10 only
+  simRun(60000);
+  simReport->values[0] = simReport->uplinks;
+  setSf(10);
+  configureLongSurvey(0);
+  simRun(60000);
+}
+
+void test_survey_too_long_for_sf(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  TEST_ASSERT_TRUE(simBoot(longSurveyOverSf10));
+  TEST_ASSERT_EQUAL(0, simReport->values[0]); // Rotation rejected
+  TEST_ASSERT_GREATER_OR_EQUAL(5, simReport->uplinksPerSf[9]); // SF setting stepped over
+  TEST_ASSERT_EQUAL(0, simReport->uplinksPerSf[10]);
+  TEST_ASSERT_EQUAL(0, simReport->oversizeFrames);
+}
+#endif
+
+// The first ping is a runnable LMIC job. Idle sleep must not hold it back.
+// Configured away from the battery check, which would end the sleep anyway.
+static void surveyStartsAtOnce() {
+  setSf(7);
+  simRun(1500);
+  configureSurvey(0x03, 60, 0);
+  simRun(50);
+  simReport->values[0] = simReport->uplinks;
+}
+
+void test_survey_starts_at_once(void) {
+  TEST_ASSERT_TRUE(simBoot(provisionAbp));
+  TEST_ASSERT_TRUE(simBoot(surveyStartsAtOnce));
+  TEST_ASSERT_EQUAL(1, simReport->values[0]);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_survey_survives_key_write);
+  RUN_TEST(test_survey_keeps_sf_setting);
+  RUN_TEST(test_auto_sf_spares_nvm_writes);
+  RUN_TEST(test_survey_hour_active_time);
+  RUN_TEST(test_survey_starts_at_once);
+  #if defined(CFG_us915)
+  RUN_TEST(test_survey_too_long_for_sf);
+  #endif
+  return UNITY_END();
+}
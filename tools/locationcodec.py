@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+"""Host side of the location codec (see MapTheThings-Arduino/LocationCodec.h).
+
+  locationcodec.py decode FRAME...   frames as hex, oldest first (or one per line on stdin)
+  locationcodec.py airtime           airtime per SF of the frame formats
+
+Delta frames need the key frame they refer to, so pass one device's frames in order.
+"""
+import sys
+
+FORMAT_V1 = 0
+ALT_OFFSET = 1000
+KEY_FIELDS = ((25, False), (26, False), (14, False))
+DELTA_FIELDS = ((12, True), (12, True), (6, True))
+LORAWAN_OVERHEAD = 13
+
+
+def read_bits(frame, start, widths):
+    value = int.from_bytes(frame, 'big')
+    total = len(frame) * 8
+    pos = start
+    out = []
+    for bits, signed in widths:
+        v = (value >> (total - pos - bits)) & ((1 << bits) - 1)
+        if signed and v >= 1 << (bits - 1):
+            v -= 1 << bits
+        out.append(v)
+        pos += bits
+    return out
+
+
+class Decoder:
+    def __init__(self):
+        self.keys = {}
+
+    def decode(self, frame):
+        """Returns (lat, lon, alt) in degrees and metres, or None if the key frame is missing."""
+        header = frame[0]
+        if (header >> 5) & 0x3 != FORMAT_V1:
+            raise ValueError('unknown format %d' % ((header >> 5) & 0x3))
+        key_id = header & 0x1F
+        if header & 0x80:
+            if key_id not in self.keys:
+                return None
+            d = read_bits(frame, 8, DELTA_FIELDS)
+            lat, lon, alt = (k + v for k, v in zip(self.keys[key_id], d))
+        else:
+            lat, lon, alt = read_bits(frame, 8, KEY_FIELDS)
+            self.keys[key_id] = (lat, lon, alt)
+        return ((lat - 9000000) / 1e5, (lon - 18000000) / 1e5, alt - ALT_OFFSET)
+
+
+def airtime_ms(sf, payload_len, bw=125000):
+    """Same formula as airtimeUs() in MapTheThings-Arduino/Airtime.cpp."""
+    symbol = (1 << sf) / bw * 1000
+    de = 1 if sf >= 11 and bw == 125000 else 0
+    numerator = 8 * (payload_len + LORAWAN_OVERHEAD) - 4 * sf + 28 + 16
+    blocks = max(-(-numerator // (4 * (sf - 2 * de))), 0)
+    return (8 + 4.25) * symbol + (8 + blocks * 5) * symbol
+
+
+def airtime_table():
+    formats = (('text', 23), ('float', 12), ('key', 10), ('delta', 5))
+    print('SF   ' + ''.join('%10s' % ('%s %dB' % f) for f in formats) + '   saved (delta vs float)')
+    for sf in range(7, 13):
+        times = [airtime_ms(sf, n) for _, n in formats]
+        print('SF%-3d' % sf + ''.join('%8.1fms' % t for t in times)
+              + '   %.1fms' % (times[1] - times[3]))
+
+
+def main(argv):
+    if len(argv) >= 2 and argv[1] == 'airtime':
+        airtime_table()
+    elif len(argv) >= 2 and argv[1] == 'decode':
+        frames = argv[2:] or [line.strip() for line in sys.stdin if line.strip()]
+        decoder = Decoder()
+        for hex_frame in frames:
+            fix = decoder.decode(bytes.fromhex(hex_frame))
+            print('%s: %s' % (hex_frame, 'missing key frame' if fix is None else '%.5f %.5f %dm' % fix))
+    else:
+        print(__doc__)
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+"""Host side of tokenized logging (see MapTheThings-Arduino/TokenLog.h).
+
+  tokenlog.py table MapTheThings-Arduino/*.cpp MapTheThings-Arduino/*.ino > tokens.json
+  tokenlog.py decode tokens.json capture.bin
+
+The table maps each token (FNV-1a hash of a TLOG_* format string) to its format.
+Decode reads a captured log stream (Serial or BLE log characteristic), passes
+plain text through and expands tokenized records back into text.
+"""
+import json
+import re
+import struct
+import sys
+
+SYNC = 0xA5
+HEADER_SIZE = 7
+LEVELS = {1: 'E', 2: 'I', 3: 'D', 4: 'V'}
+MACROS = {'CR': '\r\n'}
+ESCAPES = {'n': '\n', 'r': '\r', 't': '\t', '\\': '\\', '"': '"', "'": "'", '0': '\0'}
+
+CALL = re.compile(r'\bTLOG_(?:ERROR|WARN|INFO|DEBUG|VERBOSE)\s*\(')
+LITERAL = re.compile(r'\s*"((?:[^"\\]|\\.)*)"')
+MACRO = re.compile(r'\s*([A-Za-z_]\w*)')
+SPEC = re.compile(r'%([-+ #0]*\d*(?:\.\d+)?(?:hh|h|ll|l)?)([diuxXocfeEgGsH%])')
+
+
+def unescape(s):
+    return re.sub(r'\\(.)', lambda m: ESCAPES.get(m.group(1), m.group(1)), s)
+
+
+def fnv1a(s):
+    h = 2166136261
+    for b in s.encode('latin-1'):
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def formats_in(source):
+    """Yields the format string of each TLOG_* call, with adjacent literals and CR joined."""
+    for call in CALL.finditer(source):
+        pos = call.end()
+        parts = []
+        while True:
+            m = LITERAL.match(source, pos)
+            if m:
+                parts.append(unescape(m.group(1)))
+                pos = m.end()
+                continue
+            m = MACRO.match(source, pos)
+            if m and m.group(1) in MACROS:
+                parts.append(MACROS[m.group(1)])
+                pos = m.end()
+                continue
+            break
+        if parts:
+            yield ''.join(parts)
+
+
+def build_table(paths):
+    table = {}
+    for path in paths:
+        with open(path, encoding='latin-1') as f:
+            for fmt in formats_in(f.read()):
+                token = '%08x' % fnv1a(fmt)
+                if table.get(token, fmt) != fmt:
+                    sys.stderr.write('Token collision %s: %r and %r\n' % (token, table[token], fmt))
+                table[token] = fmt
+    return table
+
+
+def read_varint(data, pos):
+    value = shift = 0
+    while pos < len(data):
+        b = data[pos]
+        pos += 1
+        value |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+            break
+    return value, pos
+
+
+def render(fmt, payload):
+    pos = 0
+    out = []
+    last = 0
+    for m in SPEC.finditer(fmt):
+        out.append(fmt[last:m.start()])
+        last = m.end()
+        flags, conv = m.groups()
+        if conv == '%':
+            out.append('%')
+            continue
+        if pos >= len(payload):
+            out.append('<missing>')
+            continue
+        if conv == 's':
+            end = payload.find(b'\0', pos)
+            end = len(payload) if end < 0 else end
+            out.append(payload[pos:end].decode('latin-1'))
+            pos = end + 1
+        elif conv == 'H':
+            n, pos = read_varint(payload, pos)
+            out.append(payload[pos:pos + n].hex())
+            pos += n
+        elif conv in 'feEgG':
+            (value,) = struct.unpack_from('<f', payload.ljust(pos + 4, b'\0'), pos)
+            out.append(('%' + flags.rstrip('hl') + conv) % value)
+            pos += 4
+        else:
+            value, pos = read_varint(payload, pos)
+            if conv in 'di' and value & 0x80000000:
+                value -= 1 << 32
+            if conv == 'c':
+                out.append(chr(value & 0xFF))
+            else:
+                out.append(('%' + flags.rstrip('hl') + conv.replace('u', 'd')) % value)
+    out.append(fmt[last:])
+    return ''.join(out)
+
+
+def decode(table, data, out):
+    pos = 0
+    while pos < len(data):
+        if data[pos] != SYNC or pos + HEADER_SIZE > len(data):
+            out.write(chr(data[pos]))
+            pos += 1
+            continue
+        level = data[pos + 1]
+        (token,) = struct.unpack_from('<I', data, pos + 2)
+        length = data[pos + 6]
+        payload = data[pos + HEADER_SIZE:pos + HEADER_SIZE + length]
+        pos += HEADER_SIZE + length
+        fmt = table.get('%08x' % token)
+        if fmt is None:
+            out.write('<%s unknown token %08x: %s>\r\n' % (LEVELS.get(level, '?'), token, payload.hex()))
+        else:
+            out.write(render(fmt, payload))
+
+
+def main(argv):
+    if len(argv) >= 2 and argv[1] == 'table':
+        json.dump(build_table(argv[2:]), sys.stdout, indent=1, sort_keys=True)
+        sys.stdout.write('\n')
+    elif len(argv) in (3, 4) and argv[1] == 'decode':
+        with open(argv[2]) as f:
+            table = json.load(f)
+        if len(argv) == 4:
+            with open(argv[3], 'rb') as f:
+                data = f.read()
+        else:
+            data = sys.stdin.buffer.read()
+        decode(table, data, sys.stdout)
+    else:
+        sys.stderr.write(__doc__)
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))